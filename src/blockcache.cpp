@@ -0,0 +1,346 @@
+/**
+ * Purpose: Decoded imagery block cache shared between compositor runs.
+ *
+ * Copyright 2016, Planet Labs, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include "cpl_multiproc.h"
+#include "compositor.h"
+
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(3,4,0)
+#  include "cpl_compressor.h"
+#  define PLC_HAVE_COMPRESSOR
+#endif
+
+// Spill files are a header of BC_HEADER_WORDS ints followed by the
+// block data, lz4 compressed where available.
+#define BC_MAGIC         0x42434c50
+#define BC_RAW           0
+#define BC_LZ4           1
+#define BC_HEADER_WORDS  5
+
+/************************************************************************/
+/*                           PLCBlockCache()                            */
+/************************************************************************/
+
+PLCBlockCache::PLCBlockCache(PLCContext *context)
+
+{
+    directory = context->blockCacheDir;
+    memoryBudget = ((GIntBig) context->blockCacheMB) * 1024 * 1024;
+    diskBudget = ((GIntBig) context->blockCacheDiskMB) * 1024 * 1024;
+    memoryUsed = 0;
+    diskUsed = 0;
+
+    VSIMkdir(directory, 0755);
+
+    // Start from what earlier runs left, trimmed to the budget.
+    trimSpill(diskBudget);
+}
+
+/************************************************************************/
+/*                           ~PLCBlockCache()                           */
+/************************************************************************/
+
+PLCBlockCache::~PLCBlockCache()
+
+{
+    trimSpill(diskBudget);
+}
+
+/************************************************************************/
+/*                              readRow()                               */
+/*                                                                      */
+/*      Read count pixels of a band row into data as Float32, one      */
+/*      block at a time through the cache.                              */
+/************************************************************************/
+
+void PLCBlockCache::readRow(const CPLString &fileKey, GDALRasterBand *band,
+                            int bandNumber, int xOff, int yOff, int count,
+                            float *data)
+
+{
+    int blockXSize, blockYSize;
+
+    band->GetBlockSize(&blockXSize, &blockYSize);
+
+    int blockY = yOff / blockYSize;
+    int rowInBlock = yOff - blockY * blockYSize;
+
+    for( int blockX = xOff / blockXSize;
+         blockX * blockXSize < xOff + count; blockX++ )
+    {
+        Block *block = getBlock(fileKey, band, bandNumber, blockX, blockY);
+        int start = MAX(xOff, blockX * blockXSize);
+        int end = MIN(xOff + count, (blockX+1) * blockXSize);
+
+        memcpy(data + start - xOff,
+               &(block->data[rowInBlock * block->xSize
+                             + start - blockX * blockXSize]),
+               sizeof(float) * (end - start));
+    }
+}
+
+/************************************************************************/
+/*                              getBlock()                              */
+/*                                                                      */
+/*      Fetch a block from memory, the spill directory or the file,    */
+/*      in that order.                                                  */
+/************************************************************************/
+
+PLCBlockCache::Block *PLCBlockCache::getBlock(const CPLString &fileKey,
+                                              GDALRasterBand *band,
+                                              int bandNumber,
+                                              int blockX, int blockY)
+
+{
+    CPLString key;
+
+    key.Printf("%016llx_%d_%d_%d",
+               (unsigned long long) PLCHashKey(fileKey),
+               bandNumber, blockX, blockY);
+
+    std::map<CPLString, Block>::iterator it = blocks.find(key);
+
+    if( it != blocks.end() )
+    {
+        lru.splice(lru.begin(), lru, it->second.lruPos);
+        return &(it->second);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Make room, dropping the least recently used blocks.             */
+/* -------------------------------------------------------------------- */
+    while( memoryUsed > memoryBudget && lru.size() > 0 )
+    {
+        std::map<CPLString, Block>::iterator oldest = blocks.find(lru.back());
+
+        memoryUsed -= sizeof(float) * oldest->second.data.size();
+        blocks.erase(oldest);
+        lru.pop_back();
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Blocks on the right and bottom edges are partial.               */
+/* -------------------------------------------------------------------- */
+    int blockXSize, blockYSize;
+
+    band->GetBlockSize(&blockXSize, &blockYSize);
+
+    int xSize = MIN(blockXSize, band->GetXSize() - blockX * blockXSize);
+    int ySize = MIN(blockYSize, band->GetYSize() - blockY * blockYSize);
+
+    Block &block = blocks[key];
+
+    block.xSize = xSize;
+    lru.push_front(key);
+    block.lruPos = lru.begin();
+
+    CPLString filename = CPLFormFilename(directory, key, "blk");
+
+    if( !readSpill(filename, block, (size_t) xSize * ySize) )
+    {
+        block.data.resize((size_t) xSize * ySize);
+
+        CPLErr eErr = band->RasterIO(GF_Read,
+                                     blockX * blockXSize, blockY * blockYSize,
+                                     xSize, ySize, &(block.data[0]),
+                                     xSize, ySize, GDT_Float32, 0, 0);
+        if( eErr != CE_None )
+            exit(1);
+
+        writeSpill(filename, block);
+    }
+
+    memoryUsed += sizeof(float) * block.data.size();
+
+    return &block;
+}
+
+/************************************************************************/
+/*                             readSpill()                              */
+/************************************************************************/
+
+int PLCBlockCache::readSpill(const CPLString &filename, Block &block,
+                             size_t count)
+
+{
+    VSILFILE *fp = VSIFOpenL(filename, "rb");
+
+    if( fp == NULL )
+        return FALSE;
+
+    GUInt32 header[BC_HEADER_WORDS];
+    std::vector<GByte> packed;
+    int ok = VSIFReadL(header, sizeof(header), 1, fp) == 1
+        && header[0] == BC_MAGIC
+        && header[2] == count * sizeof(float)
+        && header[4] == (GUInt32) block.xSize;
+
+    if( ok )
+    {
+        packed.resize(header[3]);
+        ok = header[3] > 0 && VSIFReadL(&(packed[0]), header[3], 1, fp) == 1;
+    }
+    VSIFCloseL(fp);
+
+    if( !ok )
+        return FALSE;
+
+    block.data.resize(count);
+
+    if( header[1] == BC_RAW && header[3] == header[2] )
+    {
+        memcpy(&(block.data[0]), &(packed[0]), header[2]);
+        return TRUE;
+    }
+
+#ifdef PLC_HAVE_COMPRESSOR
+    const CPLCompressor *decompressor = CPLGetDecompressor("lz4");
+
+    if( header[1] == BC_LZ4 && decompressor != NULL )
+    {
+        void *out = &(block.data[0]);
+        size_t outSize = header[2];
+
+        if( decompressor->pfnFunc(&(packed[0]), packed.size(),
+                                  &out, &outSize, NULL,
+                                  decompressor->user_data)
+            && outSize == header[2] )
+            return TRUE;
+    }
+#endif
+
+    block.data.clear();
+    return FALSE;
+}
+
+/************************************************************************/
+/*                             writeSpill()                             */
+/*                                                                      */
+/*      Write under a name of our own and rename into place, so other   */
+/*      processes never read a partial block.                           */
+/************************************************************************/
+
+void PLCBlockCache::writeSpill(const CPLString &filename, Block &block)
+
+{
+    GUInt32 header[BC_HEADER_WORDS];
+    size_t rawSize = sizeof(float) * block.data.size();
+    const void *packed = &(block.data[0]);
+    std::vector<GByte> compressed;
+
+    header[0] = BC_MAGIC;
+    header[1] = BC_RAW;
+    header[2] = rawSize;
+    header[3] = rawSize;
+    header[4] = block.xSize;
+
+#ifdef PLC_HAVE_COMPRESSOR
+    const CPLCompressor *compressor = CPLGetCompressor("lz4");
+
+    if( compressor != NULL )
+    {
+        compressed.resize(rawSize + rawSize / 255 + 16);
+
+        void *out = &(compressed[0]);
+        size_t outSize = compressed.size();
+
+        if( compressor->pfnFunc(packed, rawSize, &out, &outSize, NULL,
+                                compressor->user_data)
+            && outSize < rawSize )
+        {
+            header[1] = BC_LZ4;
+            header[3] = outSize;
+            packed = &(compressed[0]);
+        }
+    }
+#endif
+
+    CPLString tempFilename;
+    tempFilename.Printf("%s.%d.tmp", filename.c_str(), (int) CPLGetPID());
+
+    VSILFILE *fp = VSIFOpenL(tempFilename, "wb");
+
+    if( fp == NULL )
+        return;
+
+    int ok = VSIFWriteL(header, sizeof(header), 1, fp) == 1
+        && VSIFWriteL(packed, header[3], 1, fp) == 1;
+
+    if( VSIFCloseL(fp) != 0 )
+        ok = FALSE;
+
+    if( !ok || VSIRename(tempFilename, filename) != 0 )
+    {
+        VSIUnlink(tempFilename);
+        return;
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Keep within the disk budget as we go, so a long or crashed      */
+/*      run doesn't fill the disk.  Trim a quarter below the budget     */
+/*      so the directory isn't scanned for every new block.             */
+/* -------------------------------------------------------------------- */
+    diskUsed += sizeof(header) + header[3];
+
+    if( diskBudget > 0 && diskUsed > diskBudget )
+        trimSpill(diskBudget - diskBudget / 4);
+}
+
+/************************************************************************/
+/*                             trimSpill()                              */
+/*                                                                      */
+/*      Bring the spill directory down to target bytes by removing     */
+/*      the oldest blocks, and note what is left.                       */
+/************************************************************************/
+
+void PLCBlockCache::trimSpill(GIntBig target)
+
+{
+    if( diskBudget <= 0 )
+        return;
+
+    CPLStringList files(VSIReadDir(directory));
+    std::vector< std::pair<GIntBig, CPLString> > spills;
+    GIntBig total = 0;
+
+    for( int i = 0; i < files.size(); i++ )
+    {
+        CPLString filename = CPLFormFilename(directory, files[i], NULL);
+        VSIStatBufL sStat;
+
+        if( !EQUAL(CPLGetExtension(files[i]), "blk")
+            || VSIStatL(filename, &sStat) != 0 )
+            continue;
+
+        spills.push_back(std::make_pair((GIntBig) sStat.st_mtime, filename));
+        total += sStat.st_size;
+    }
+
+    std::sort(spills.begin(), spills.end());
+
+    for( unsigned int i = 0; i < spills.size() && total > target; i++ )
+    {
+        VSIStatBufL sStat;
+
+        if( VSIStatL(spills[i].second, &sStat) == 0
+            && VSIUnlink(spills[i].second) == 0 )
+            total -= sStat.st_size;
+    }
+
+    diskUsed = total;
+}
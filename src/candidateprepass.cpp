@@ -0,0 +1,239 @@
+/**
+ * Purpose: Low resolution pre-pass selecting candidate inputs per tile.
+ *
+ * Copyright 2016, Planet Labs, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compositor.h"
+
+static void WriteCandidates(PLCContext *plContext);
+
+/************************************************************************/
+/*                          CandidatePrePass()                          */
+/*                                                                      */
+/*      Run the quality methods over a decimated view of the inputs     */
+/*      and record, per output tile, which inputs come within           */
+/*      prepass_margin of the best quality seen there.  The full        */
+/*      resolution pass then only reads and evaluates those inputs.     */
+/*      Tiles the pre-pass could not score keep all their inputs.       */
+/************************************************************************/
+
+void CandidatePrePass(PLCContext *plContext)
+
+{
+    unsigned int i;
+    int decimation = plContext->prepassDecimation;
+    int tileSize = MAX(1, plContext->prepassTileSize);
+    int inputCount = plContext->inputFiles.size();
+
+/* -------------------------------------------------------------------- */
+/*      Stack wide methods and averaging consider all inputs at         */
+/*      once, so a subset of candidates could change the result.        */
+/* -------------------------------------------------------------------- */
+    if( plContext->averageBestRatio > 0.0 )
+    {
+        CPLError(CE_Warning, CPLE_AppDefined,
+                 "prepass_decimation ignored with average_best_ratio.");
+        return;
+    }
+
+    for( i = 0; i < plContext->qualityMethods.size(); i++ )
+    {
+        if( plContext->qualityMethods[i]->isStackWide() )
+        {
+            CPLError(CE_Warning, CPLE_AppDefined,
+                     "prepass_decimation ignored with stack wide quality "
+                     "methods.");
+            return;
+        }
+    }
+
+    plContext->tileCols = (plContext->width + tileSize - 1) / tileSize;
+    plContext->tileRows = (plContext->height + tileSize - 1) / tileSize;
+    plContext->tileCandidates.clear();
+    plContext->tileCandidates.resize(
+        plContext->tileCols * plContext->tileRows * inputCount, 0);
+
+    GByte *flags = &(plContext->tileCandidates[0]);
+    int dWidth = (plContext->width + decimation - 1) / decimation;
+    int dHeight = (plContext->height + decimation - 1) / decimation;
+
+    plContext->decimation = decimation;
+
+/* -------------------------------------------------------------------- */
+/*      Process each decimated line.                                    */
+/* -------------------------------------------------------------------- */
+    for( int dLine = 0; dLine < dHeight; dLine++ )
+    {
+        int blockTop = dLine * decimation;
+        int blockBottom = MIN(blockTop + decimation, plContext->height);
+        int line = MIN(blockTop + decimation / 2, plContext->height - 1);
+
+        std::vector<PLCInput *> inputs;
+        std::vector<PLCLine *> inputLines;
+
+        plContext->line = line;
+        plContext->getWindowInputs(0, blockTop, plContext->width,
+                                   blockBottom - blockTop, inputs);
+
+        for( i = 0; i < inputs.size(); i++ )
+            inputLines.push_back(inputs[i]->getLine(line, PLC_QUALITY_BANDS));
+
+        if( inputs.size() > 0 )
+            ComputeLineQualities(plContext, line, inputs, inputLines);
+
+        // Tiles touched by this block, widened by one sample so a
+        // candidate near a tile edge is kept on both sides.
+        int tileRowStart = MAX(0, blockTop - decimation) / tileSize;
+        int tileRowEnd = (MIN(plContext->height, blockBottom + decimation)
+                          - 1) / tileSize;
+
+        for( int j = 0; j < dWidth; j++ )
+        {
+            float best = 0.0;
+
+            for( i = 0; i < inputs.size(); i++ )
+                best = MAX(best, inputLines[i]->getQuality()[j]);
+
+            float threshold = best * (1.0 - plContext->prepassMargin);
+            int tileColStart = MAX(0, (j-1) * decimation) / tileSize;
+            int tileColEnd = (MIN(plContext->width, (j+2) * decimation) - 1)
+                / tileSize;
+
+            for( i = 0; i < inputs.size(); i++ )
+            {
+                float quality = inputLines[i]->getQuality()[j];
+                GByte flag = 0;
+
+                if( quality > 0.0 )
+                    flag |= PLC_TILE_SAMPLED;
+                if( best <= 0.0 || (quality > 0.0 && quality >= threshold) )
+                    flag |= PLC_TILE_CANDIDATE;
+                if( flag == 0 )
+                    continue;
+
+                for( int tRow = tileRowStart; tRow <= tileRowEnd; tRow++ )
+                {
+                    for( int tCol = tileColStart; tCol <= tileColEnd; tCol++ )
+                    {
+                        flags[(tRow * plContext->tileCols + tCol) * inputCount
+                              + inputs[i]->getInputIndex()] |= flag;
+                    }
+                }
+            }
+        }
+
+        for( i = 0; i < inputs.size(); i++ )
+        {
+            delete inputLines[i];
+
+            if( blockBottom >= inputs[i]->getYOff() + inputs[i]->getYSize() )
+                inputs[i]->releaseDS();
+        }
+    }
+
+    plContext->decimation = 1;
+    plContext->line = -1;
+
+/* -------------------------------------------------------------------- */
+/*      Tiles where nothing scored (all decimated samples missed        */
+/*      valid data, or small tiles between samples) keep every          */
+/*      input that touches them.                                        */
+/* -------------------------------------------------------------------- */
+    int candidateCount = 0;
+
+    for( int tRow = 0; tRow < plContext->tileRows; tRow++ )
+    {
+        for( int tCol = 0; tCol < plContext->tileCols; tCol++ )
+        {
+            GByte *tileFlags =
+                flags + (tRow * plContext->tileCols + tCol) * inputCount;
+            int sampled = FALSE;
+
+            for( int iInput = 0; iInput < inputCount; iInput++ )
+                sampled |= (tileFlags[iInput] & PLC_TILE_SAMPLED);
+
+            std::vector<PLCInput *> inputs;
+
+            plContext->getWindowInputs(
+                tCol * tileSize, tRow * tileSize,
+                MIN(tileSize, plContext->width - tCol * tileSize),
+                MIN(tileSize, plContext->height - tRow * tileSize),
+                inputs);
+
+            for( i = 0; i < inputs.size(); i++ )
+            {
+                GByte *flag = tileFlags + inputs[i]->getInputIndex();
+
+                if( !sampled )
+                    *flag |= PLC_TILE_CANDIDATE;
+                if( *flag & PLC_TILE_CANDIDATE )
+                    candidateCount++;
+            }
+        }
+    }
+
+    CPLDebug("PLC", "Pre-pass kept %d input/tile candidates over %dx%d tiles.",
+             candidateCount, plContext->tileCols, plContext->tileRows);
+
+    if( !EQUAL(plContext->prepassCandidatesFilename, "") )
+        WriteCandidates(plContext);
+}
+
+/************************************************************************/
+/*                          WriteCandidates()                           */
+/*                                                                      */
+/*      Write the candidates as text, one tile per line:                */
+/*        tile_col tile_row xoff yoff xsize ysize: input input ...      */
+/*      with inputs numbered from 1 as in the source trace.             */
+/************************************************************************/
+
+static void WriteCandidates(PLCContext *plContext)
+
+{
+    VSILFILE *fp = VSIFOpenL(plContext->prepassCandidatesFilename, "w");
+    if( fp == NULL )
+    {
+        CPLError(CE_Fatal, CPLE_FileIO, "Failed to create %s.",
+                 plContext->prepassCandidatesFilename.c_str());
+        exit(1);
+    }
+
+    int tileSize = MAX(1, plContext->prepassTileSize);
+    int inputCount = plContext->inputFiles.size();
+
+    for( int tRow = 0; tRow < plContext->tileRows; tRow++ )
+    {
+        for( int tCol = 0; tCol < plContext->tileCols; tCol++ )
+        {
+            int xOff = tCol * tileSize, yOff = tRow * tileSize;
+
+            VSIFPrintfL(fp, "%d %d %d %d %d %d:", tCol, tRow, xOff, yOff,
+                        MIN(tileSize, plContext->width - xOff),
+                        MIN(tileSize, plContext->height - yOff));
+
+            for( int iInput = 0; iInput < inputCount; iInput++ )
+            {
+                if( plContext->tileCandidates[
+                        (tRow * plContext->tileCols + tCol) * inputCount
+                        + iInput] & PLC_TILE_CANDIDATE )
+                    VSIFPrintfL(fp, " %d", iInput + 1);
+            }
+            VSIFPrintfL(fp, "\n");
+        }
+    }
+
+    VSIFCloseL(fp);
+}
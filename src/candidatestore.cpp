@@ -0,0 +1,364 @@
+/**
+ * Purpose: Per pixel store of the best candidates, and input removal.
+ *
+ * Copyright 2016, Planet Labs, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compositor.h"
+
+/************************************************************************/
+/*                    GetCandidateQualityFilename()                     */
+/************************************************************************/
+
+static CPLString GetCandidateQualityFilename(PLCContext *plContext)
+
+{
+    return plContext->candidateStoreFilename + ".quality.tif";
+}
+
+/************************************************************************/
+/*                          CreateStoreFile()                           */
+/************************************************************************/
+
+static GDALDataset *CreateStoreFile(PLCContext *plContext, 
+                                    const char *filename,
+                                    GDALDataType dataType)
+
+{
+    GDALDriver *tiffDriver = (GDALDriver *) GDALGetDriverByName("GTiff");
+    CPLStringList createOptions;
+
+    createOptions.AddString("COMPRESS=DEFLATE");
+
+    GDALDataset *DS = 
+        tiffDriver->Create(filename, plContext->width, plContext->height,
+                           plContext->candidateCount,
+                           dataType, createOptions);
+    if( DS == NULL )
+        exit(1);
+
+    DS->SetProjection(plContext->outputDS->GetProjectionRef());
+
+    double geotransform[6];
+    plContext->outputDS->GetGeoTransform(geotransform);
+    DS->SetGeoTransform(geotransform);
+
+    return DS;
+}
+
+/************************************************************************/
+/*                        CreateCandidateStore()                        */
+/*                                                                      */
+/*      The store holds candidateCount UInt16 source bands (1 based     */
+/*      input numbers, 0 for none), best first, and its companion      */
+/*      file the matching Float32 quality bands.  They are written     */
+/*      a line at a time, so are stripped, and compressed as most      */
+/*      pixels only have a few candidates.                              */
+/************************************************************************/
+
+void CreateCandidateStore(PLCContext *plContext)
+
+{
+    if( plContext->candidateCount < 1 )
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "candidate_count must be at least 1, not %d.",
+                 plContext->candidateCount);
+
+    plContext->candidateStoreDS = 
+        CreateStoreFile(plContext, plContext->candidateStoreFilename,
+                        GDT_UInt16);
+    plContext->candidateQualityDS = 
+        CreateStoreFile(plContext, GetCandidateQualityFilename(plContext),
+                        GDT_Float32);
+
+    CPLStringList storeMD;
+    CPLString key;
+
+    storeMD.SetNameValue("CANDIDATE_COUNT",
+                         CPLString().Printf("%d", plContext->candidateCount));
+
+    for( unsigned int i=0; i < plContext->inputFiles.size(); i++ )
+    {
+        key.Printf("SOURCE_%d", i+1);
+        storeMD.SetNameValue(key, plContext->inputFiles[i]->getFilename());
+    }
+
+    plContext->candidateStoreDS->SetMetadata(storeMD);
+}
+
+/************************************************************************/
+/*                         OpenCandidateStore()                         */
+/*                                                                      */
+/*      Open an existing store and its quality companion for update.   */
+/************************************************************************/
+
+void OpenCandidateStore(PLCContext *plContext)
+
+{
+    plContext->candidateStoreDS = (GDALDataset *)
+        GDALOpen(plContext->candidateStoreFilename, GA_Update);
+    plContext->candidateQualityDS = (GDALDataset *)
+        GDALOpen(GetCandidateQualityFilename(plContext), GA_Update);
+    if( plContext->candidateStoreDS == NULL 
+        || plContext->candidateQualityDS == NULL )
+        exit(1);
+}
+
+/************************************************************************/
+/*                          StoreBandRasterIO()                         */
+/*                                                                      */
+/*      Candidate lines hold the source rows and then the quality       */
+/*      rows, which are split between the two files.                   */
+/************************************************************************/
+
+static void StoreBandRasterIO(PLCContext *plContext, GDALRWFlag eRWFlag,
+                              int line, std::vector<float> &candidates)
+
+{
+    int width = plContext->width;
+    int candidateCount = plContext->candidateCount;
+
+    for( int iBand = 0; iBand < 2 * candidateCount; iBand++ )
+    {
+        GDALRasterBand *band = iBand < candidateCount
+            ? plContext->candidateStoreDS->GetRasterBand(iBand+1)
+            : plContext->candidateQualityDS->GetRasterBand(
+                iBand-candidateCount+1);
+
+        CPLErr eErr = band->RasterIO(eRWFlag, 0, line, width, 1,
+                                     &(candidates[iBand * width]), width, 1,
+                                     GDT_Float32, 0, 0);
+        if( eErr != CE_None )
+            exit(1);
+    }
+}
+
+/************************************************************************/
+/*                      WriteCandidateStoreLine()                       */
+/************************************************************************/
+
+void WriteCandidateStoreLine(PLCContext *plContext, int line,
+                             std::vector<float> &candidates)
+
+{
+    StoreBandRasterIO(plContext, GF_Write, line, candidates);
+}
+
+/************************************************************************/
+/*                       ReadCandidateStoreLine()                       */
+/************************************************************************/
+
+static void ReadCandidateStoreLine(PLCContext *plContext, int line,
+                                   std::vector<float> &candidates)
+
+{
+    candidates.resize(2 * plContext->candidateCount * plContext->width);
+
+    StoreBandRasterIO(plContext, GF_Read, line, candidates);
+}
+
+/************************************************************************/
+/*                            RemoveInputs()                            */
+/*                                                                      */
+/*      Withdraw inputs from an existing mosaic using the candidate     */
+/*      store.  Only pixels that came from a removed input are          */
+/*      recomputed, from the best remaining stored candidate, and       */
+/*      only those pixels are read from the inputs.  To replace an      */
+/*      input, remove it and then add the new version with update.     */
+/************************************************************************/
+
+void RemoveInputs(PLCContext *plContext)
+
+{
+    int width = plContext->width;
+    int candidateCount;
+    unsigned int i;
+
+    if( plContext->averageBestRatio > 0.0 )
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "remove_inputs can't be combined with average_best_ratio.");
+
+    OpenCandidateStore(plContext);
+
+    const char *countItem =
+        plContext->candidateStoreDS->GetMetadataItem("CANDIDATE_COUNT");
+    candidateCount = plContext->candidateCount =
+        countItem ? atoi(countItem) : 0;
+
+    if( candidateCount < 1
+        || plContext->candidateStoreDS->GetRasterCount() != candidateCount
+        || plContext->candidateStoreDS->GetRasterXSize() != width
+        || plContext->candidateStoreDS->GetRasterYSize() != plContext->height
+        || plContext->candidateQualityDS->GetRasterCount() != candidateCount
+        || plContext->candidateQualityDS->GetRasterXSize() != width
+        || plContext->candidateQualityDS->GetRasterYSize() 
+           != plContext->height )
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "%s is not a candidate store for this %dx%d output.",
+                 plContext->candidateStoreFilename.c_str(),
+                 width, plContext->height);
+
+    if( !EQUAL(plContext->sourceTraceFilename,"") )
+    {
+        plContext->sourceTraceDS = (GDALDataset *)
+            GDALOpen(plContext->sourceTraceFilename, GA_Update);
+        if( plContext->sourceTraceDS == NULL )
+            exit(1);
+    }
+
+    if( !EQUAL(plContext->qualityFilename,"") )
+    {
+        plContext->qualityDS = (GDALDataset *)
+            GDALOpen(plContext->qualityFilename, GA_Update);
+        if( plContext->qualityDS == NULL )
+            exit(1);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Removed inputs were not initialized, and are never read.        */
+/* -------------------------------------------------------------------- */
+    std::vector<PLCInput *> inputs;
+
+    for( i = 0; i < plContext->inputFiles.size(); i++ )
+    {
+        if( plContext->isRemovedInput(i) )
+            inputs.push_back(NULL);
+        else
+            inputs.push_back(plContext->inputFiles[i]);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Process all lines.                                              */
+/* -------------------------------------------------------------------- */
+    std::vector<float> candidates;
+    std::vector<unsigned short> traceSource(width);
+    std::vector<unsigned short> newSource(width);
+    std::vector<GByte> changed(width);
+    int changedLines = 0;
+
+    for( int line = 0; line < plContext->height; line++ )
+    {
+        ReadCandidateStoreLine(plContext, line, candidates);
+
+        // A sieved trace may differ from the best candidate.
+        if( plContext->sourceTraceDS != NULL )
+        {
+            CPLErr eErr = plContext->sourceTraceDS->GetRasterBand(1)->
+                RasterIO(GF_Read, 0, line, width, 1,
+                         &(traceSource[0]), width, 1, GDT_UInt16, 0, 0);
+            if( eErr != CE_None )
+                exit(1);
+        }
+
+/* -------------------------------------------------------------------- */
+/*      Drop removed inputs from each pixel's candidates, shifting      */
+/*      the runners-up forward.                                         */
+/* -------------------------------------------------------------------- */
+        int changeCount = 0;
+
+        for( int iPixel = 0; iPixel < width; iPixel++ )
+        {
+            int topSource = (int) candidates[iPixel];
+            int kOut = 0;
+
+            for( int k = 0; k < candidateCount; k++ )
+            {
+                int source = (int) candidates[k*width + iPixel];
+
+                if( source == 0 || plContext->isRemovedInput(source-1) )
+                    continue;
+
+                candidates[kOut*width + iPixel] = source;
+                candidates[(candidateCount+kOut)*width + iPixel] =
+                    candidates[(candidateCount+k)*width + iPixel];
+                kOut++;
+            }
+
+            for( int k = kOut; k < candidateCount; k++ )
+            {
+                candidates[k*width + iPixel] = 0.0;
+                candidates[(candidateCount+k)*width + iPixel] = 0.0;
+            }
+
+            changed[iPixel] =
+                (topSource != 0 && plContext->isRemovedInput(topSource-1))
+                || (plContext->sourceTraceDS != NULL
+                    && traceSource[iPixel] != 0
+                    && plContext->isRemovedInput(traceSource[iPixel]-1));
+
+            newSource[iPixel] = 0;
+            if( changed[iPixel] )
+            {
+                newSource[iPixel] = (unsigned short) candidates[iPixel];
+                changeCount++;
+            }
+        }
+
+        if( changeCount == 0 )
+            continue;
+
+        changedLines++;
+
+/* -------------------------------------------------------------------- */
+/*      Gather the new winners of the changed pixels.                   */
+/* -------------------------------------------------------------------- */
+        plContext->line = line - 1;
+        PLCLine *lineObj = plContext->getNextOutputLine();
+        PLCLine newLine(width);
+
+        for( int iBand = 0; iBand < lineObj->getBandCount(); iBand++ )
+            newLine.getBand(iBand);
+
+        GatherFromSource(plContext, line, inputs, &(newSource[0]), &newLine);
+
+        unsigned short *source = lineObj->getSource();
+        float *quality = lineObj->getQuality();
+        GByte *alpha = lineObj->getAlpha();
+
+        for( int iPixel = 0; iPixel < width; iPixel++ )
+        {
+            if( plContext->sourceTraceDS != NULL )
+                source[iPixel] = traceSource[iPixel];
+            quality[iPixel] = candidates[candidateCount*width + iPixel];
+
+            if( !changed[iPixel] )
+                continue;
+
+            for( int iBand = 0; iBand < lineObj->getBandCount(); iBand++ )
+                lineObj->getBand(iBand)[iPixel] =
+                    newLine.getBand(iBand)[iPixel];
+            alpha[iPixel] = newLine.getAlpha()[iPixel];
+            source[iPixel] = newSource[iPixel];
+        }
+
+        plContext->writeOutputLine(false);
+        WriteCandidateStoreLine(plContext, line, candidates);
+    }
+
+    CPLDebug("PLC", "Removing %d inputs changed %d of %d lines.",
+             (int) plContext->removeInputs.size(), changedLines,
+             plContext->height);
+
+    for( i = 0; i < plContext->inputFiles.size(); i++ )
+    {
+        if( inputs[i] != NULL )
+            inputs[i]->releaseDS();
+    }
+
+    GDALClose(plContext->candidateStoreDS);
+    plContext->candidateStoreDS = NULL;
+    GDALClose(plContext->candidateQualityDS);
+    plContext->candidateQualityDS = NULL;
+}
@@ -0,0 +1,237 @@
+/**
+ * Purpose: Checkpoint and resume of long compositing runs.
+ *
+ * Copyright 2016, Planet Labs, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compositor.h"
+
+// Checkpoints are binary, in native byte order, as they are only
+// meant to be read back by the same build on the same machine:
+//
+//   int     magic, version, width, height, linesWritten, sourceIndexOffset,
+//           count of pipelines
+//
+// followed by the state of the main context and then of each pipeline:
+//
+//   double  histogram scaleMin, scaleMax, actualMin, actualMax, actualMean
+//   int     histogram actualCount, count of bins, bins
+//   GUInt16 source of the last line written, width values
+
+#define CKPT_MAGIC    0x4b434c50
+#define CKPT_VERSION  2
+
+/************************************************************************/
+/*                          FlushDatasets()                             */
+/************************************************************************/
+
+static void FlushDatasets(PLCContext *plContext)
+
+{
+    plContext->outputDS->FlushCache();
+
+    if( plContext->sourceTraceDS != NULL )
+        plContext->sourceTraceDS->FlushCache();
+    if( plContext->qualityDS != NULL )
+        plContext->qualityDS->FlushCache();
+    if( plContext->candidateStoreDS != NULL )
+        plContext->candidateStoreDS->FlushCache();
+    if( plContext->candidateQualityDS != NULL )
+        plContext->candidateQualityDS->FlushCache();
+    if( plContext->statistics != NULL )
+        plContext->statistics->getDS()->FlushCache();
+
+    for( unsigned int i = 0; i < plContext->products.size(); i++ )
+        plContext->products[i]->DS->FlushCache();
+
+    for( unsigned int i = 0; i < plContext->qualityMethods.size(); i++ )
+        plContext->qualityMethods[i]->flush();
+
+    for( unsigned int i = 0; i < plContext->pipelines.size(); i++ )
+        FlushDatasets(plContext->pipelines[i]);
+}
+
+/************************************************************************/
+/*                         WriteContextState()                          */
+/************************************************************************/
+
+static int WriteContextState(VSILFILE *fp, PLCContext *context, int width)
+
+{
+    PLCHistogram &histogram = context->qualityHistogram;
+    double scales[5] = { histogram.scaleMin, histogram.scaleMax,
+                         histogram.actualMin, histogram.actualMax,
+                         histogram.actualMean };
+    int binCount = histogram.counts.size();
+    int ok = TRUE;
+
+    ok = ok && VSIFWriteL(scales, sizeof(scales), 1, fp) == 1;
+    ok = ok && VSIFWriteL(&(histogram.actualCount), sizeof(int), 1, fp) == 1;
+    ok = ok && VSIFWriteL(&binCount, sizeof(int), 1, fp) == 1;
+    ok = ok && VSIFWriteL(&(histogram.counts[0]), sizeof(int), binCount,
+                          fp) == (size_t) binCount;
+
+    std::vector<unsigned short> source = context->lastWrittenSource;
+    source.resize(width, 0);
+    ok = ok && VSIFWriteL(&(source[0]), sizeof(unsigned short),
+                          width, fp) == (size_t) width;
+
+    return ok;
+}
+
+/************************************************************************/
+/*                          ReadContextState()                          */
+/************************************************************************/
+
+static int ReadContextState(VSILFILE *fp, PLCContext *context, int width)
+
+{
+    PLCHistogram &histogram = context->qualityHistogram;
+    double scales[5];
+    int binCount = 0;
+    int ok = TRUE;
+
+    ok = ok && VSIFReadL(scales, sizeof(scales), 1, fp) == 1;
+    ok = ok && VSIFReadL(&(histogram.actualCount), sizeof(int), 1, fp) == 1;
+    ok = ok && VSIFReadL(&binCount, sizeof(int), 1, fp) == 1
+        && binCount == (int) histogram.counts.size();
+    ok = ok && VSIFReadL(&(histogram.counts[0]), sizeof(int), binCount,
+                         fp) == (size_t) binCount;
+
+    context->lastWrittenSource.resize(width);
+    ok = ok && VSIFReadL(&(context->lastWrittenSource[0]),
+                         sizeof(unsigned short), width,
+                         fp) == (size_t) width;
+
+    if( ok )
+    {
+        histogram.scaleMin = scales[0];
+        histogram.scaleMax = scales[1];
+        histogram.actualMin = scales[2];
+        histogram.actualMax = scales[3];
+        histogram.actualMean = scales[4];
+    }
+
+    return ok;
+}
+
+/************************************************************************/
+/*                          WriteCheckpoint()                           */
+/*                                                                      */
+/*      Flush everything written so far, then record how far we got.    */
+/*      The checkpoint is written under a temporary name and renamed    */
+/*      over the old one, so there is always a complete checkpoint      */
+/*      that is no further along than the rasters.                      */
+/************************************************************************/
+
+void WriteCheckpoint(PLCContext *plContext)
+
+{
+    CPLString tempFilename = plContext->checkpointFilename + ".tmp";
+
+    FlushDatasets(plContext);
+
+    VSILFILE *fp = VSIFOpenL(tempFilename, "wb");
+    if( fp == NULL )
+    {
+        CPLError(CE_Warning, CPLE_AppDefined,
+                 "Unable to write checkpoint %s.", tempFilename.c_str());
+        return;
+    }
+
+    int header[7] = { CKPT_MAGIC, CKPT_VERSION,
+                      plContext->width, plContext->height,
+                      plContext->linesWritten, plContext->sourceIndexOffset,
+                      (int) plContext->pipelines.size() };
+    int ok = TRUE;
+
+    ok = ok && VSIFWriteL(header, sizeof(header), 1, fp) == 1;
+    ok = ok && WriteContextState(fp, plContext, plContext->width);
+
+    for( unsigned int i = 0; i < plContext->pipelines.size(); i++ )
+        ok = ok && WriteContextState(fp, plContext->pipelines[i], 
+                                     plContext->width);
+
+    if( VSIFCloseL(fp) != 0 )
+        ok = FALSE;
+
+    if( !ok || VSIRename(tempFilename, plContext->checkpointFilename) != 0 )
+    {
+        CPLError(CE_Warning, CPLE_AppDefined,
+                 "Unable to write checkpoint %s.",
+                 plContext->checkpointFilename.c_str());
+        VSIUnlink(tempFilename);
+        return;
+    }
+
+    CPLDebug("PLC", "Checkpoint after %d lines.", plContext->linesWritten);
+}
+
+/************************************************************************/
+/*                           ReadCheckpoint()                           */
+/*                                                                      */
+/*      Restore the state saved by WriteCheckpoint(), returning the     */
+/*      line to resume at, or 0 if there is no checkpoint.              */
+/************************************************************************/
+
+int ReadCheckpoint(PLCContext *plContext)
+
+{
+    VSILFILE *fp = VSIFOpenL(plContext->checkpointFilename, "rb");
+
+    if( fp == NULL )
+    {
+        CPLDebug("PLC", "No checkpoint %s, starting from the beginning.",
+                 plContext->checkpointFilename.c_str());
+        return 0;
+    }
+
+    int header[7];
+    int ok = VSIFReadL(header, sizeof(header), 1, fp) == 1
+        && header[0] == CKPT_MAGIC && header[1] == CKPT_VERSION;
+
+    if( ok && (header[2] != plContext->width
+               || header[3] != plContext->height) )
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "Checkpoint %s is for a %dx%d output, not %dx%d.",
+                 plContext->checkpointFilename.c_str(), header[2], header[3],
+                 plContext->width, plContext->height);
+
+    if( ok && header[6] != (int) plContext->pipelines.size() )
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "Checkpoint %s is for %d pipelines, not %d.",
+                 plContext->checkpointFilename.c_str(), header[6],
+                 (int) plContext->pipelines.size());
+
+    ok = ok && ReadContextState(fp, plContext, plContext->width);
+
+    for( unsigned int i = 0; i < plContext->pipelines.size(); i++ )
+        ok = ok && ReadContextState(fp, plContext->pipelines[i], 
+                                    plContext->width);
+
+    VSIFCloseL(fp);
+
+    if( !ok )
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "Checkpoint %s is corrupt.",
+                 plContext->checkpointFilename.c_str());
+
+    plContext->linesWritten = header[4];
+    plContext->sourceIndexOffset = header[5];
+
+    CPLDebug("PLC", "Resuming at line %d.", plContext->linesWritten);
+
+    return plContext->linesWritten;
+}
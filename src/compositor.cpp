@@ -31,8 +31,14 @@ void Usage()
     printf( "Usage: compositor --help --help-general\n" );
     printf( "         [-j control.json]\n" );
     printf( "         -o output_file [-st source_trace_file] [-qo quality]\n" );
+    printf( "         [-rst render_from_source_trace_file] [-u]\n" );
+    printf( "         [-cs candidate_store] [-rm input_number]*\n" );
+    printf( "         [-qc quality_cache_dir] [-bc block_cache_dir]\n" );
+    printf( "         [-so statistics_output]\n" );
+    printf( "         [-ckpt checkpoint_file] [--resume]\n" );
     printf( "         [-s name value]* [-q] [-v] [-dp pixel line]\n" );
-    printf( "         [-i input_file [-c cloudmask] [-qm name value]*]*\n" );
+    printf( "         [-i input_file [-c cloudmask] [-cv cloudvector]\n" );
+    printf( "             [-qm name value]*]*\n" );
     exit(1);
 }
 
@@ -125,6 +131,149 @@ static void LoadJSON(PLCContext &plContext, const char *json_filename)
     fclose(fp);
 }
 
+/************************************************************************/
+/*                       OpenTraceAndQuality()                          */
+/*                                                                      */
+/*      Create the source trace and quality output of a pipeline if     */
+/*      requested, or open them to carry on when resuming.              */
+/************************************************************************/
+
+static void OpenTraceAndQuality(PLCContext *plContext, int startLine)
+
+{
+/* -------------------------------------------------------------------- */
+/*      Create source trace file if requested.                          */
+/* -------------------------------------------------------------------- */
+    if( !EQUAL(plContext->sourceTraceFilename,"") && !plContext->updateMode
+        && startLine > 0 )
+    {
+        plContext->sourceTraceDS = (GDALDataset *)
+            GDALOpen(plContext->sourceTraceFilename, GA_Update);
+        if( plContext->sourceTraceDS == NULL )
+            exit(1);
+    }
+    else if( !EQUAL(plContext->sourceTraceFilename,"") 
+             && !plContext->updateMode )
+    {
+        GDALDriver *tiffDriver = (GDALDriver *) GDALGetDriverByName("GTiff");
+        CPLStringList createOptions;
+        GDALDataType stPixelType = GDT_Byte;
+        if( plContext->inputFiles.size() > 255 )
+            stPixelType = GDT_UInt16;
+
+        createOptions.AddString("COMPRESS=LZW");
+        plContext->sourceTraceDS = 
+            tiffDriver->Create(plContext->sourceTraceFilename,
+                               plContext->width, plContext->height, 1,
+                               stPixelType, createOptions);
+        plContext->sourceTraceDS->SetProjection(
+            plContext->outputDS->GetProjectionRef());
+        
+        double geotransform[6];
+        plContext->outputDS->GetGeoTransform(geotransform);
+        plContext->sourceTraceDS->SetGeoTransform(geotransform);
+
+        CPLStringList sourceMD;
+        CPLString key;
+
+        for( unsigned int i=0; i < plContext->inputFiles.size(); i++ )
+        {
+            key.Printf("SOURCE_%d", i+1);
+            sourceMD.SetNameValue(key, 
+                                  plContext->inputFiles[i]->getFilename());
+        }
+
+        plContext->sourceTraceDS->SetMetadata(sourceMD);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Create quality file if requested.                               */
+/* -------------------------------------------------------------------- */
+    if( !EQUAL(plContext->qualityFilename,"") && !plContext->updateMode
+        && startLine > 0 )
+    {
+        plContext->qualityDS = (GDALDataset *)
+            GDALOpen(plContext->qualityFilename, GA_Update);
+        if( plContext->qualityDS == NULL )
+            exit(1);
+    }
+    else if( !EQUAL(plContext->qualityFilename,"") && !plContext->updateMode )
+    {
+        GDALDriver *tiffDriver = (GDALDriver *) GDALGetDriverByName("GTiff");
+        plContext->qualityDS = 
+            tiffDriver->Create(plContext->qualityFilename,
+                               plContext->width, plContext->height,
+                               plContext->inputFiles.size() + 1,
+                               GDT_Float32, NULL);
+        plContext->qualityDS->SetProjection(
+            plContext->outputDS->GetProjectionRef());
+        
+        double geotransform[6];
+        plContext->outputDS->GetGeoTransform(geotransform);
+        plContext->qualityDS->SetGeoTransform(geotransform);
+
+        for( unsigned int i=0; i < plContext->inputFiles.size(); i++ )
+        {
+            plContext->qualityDS->GetRasterBand(i+2)->
+                SetDescription(plContext->inputFiles[i]->getFilename());
+        }
+
+        plContext->qualityDS->GetRasterBand(1)->
+            SetDescription(plContext->outputFilename);
+    }
+}
+
+/************************************************************************/
+/*                         InitializePipeline()                         */
+/*                                                                      */
+/*      Open the outputs of another pipeline.  It is composited from    */
+/*      the same input lines, so its output must match the main one.    */
+/************************************************************************/
+
+static void InitializePipeline(PLCContext *plContext, PLCContext *pipeline,
+                               int startLine)
+
+{
+    pipeline->outputDS = (GDALDataset *) 
+        GDALOpen(pipeline->outputFilename, GA_Update);
+    if( pipeline->outputDS == NULL )
+        exit(1);
+
+    if( pipeline->outputDS->GetRasterXSize() != plContext->width
+        || pipeline->outputDS->GetRasterYSize() != plContext->height
+        || pipeline->outputDS->GetRasterCount() 
+           != plContext->outputDS->GetRasterCount() )
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "Pipeline output %s does not match the size and bands "
+                 "of %s.", 
+                 pipeline->outputFilename.c_str(),
+                 plContext->outputFilename.c_str());
+
+    pipeline->width = plContext->width;
+    pipeline->height = plContext->height;
+    pipeline->quiet = plContext->quiet;
+    pipeline->verbose = plContext->verbose;
+    pipeline->debugPixels = plContext->debugPixels;
+    pipeline->strategyParams = plContext->strategyParams;
+    pipeline->inputFiles = plContext->inputFiles;
+
+    // The last line written is kept for the main checkpoint.
+    pipeline->checkpointFilename = plContext->checkpointFilename;
+
+    OpenTraceAndQuality(pipeline, startLine);
+
+    // A resumed run picks up all pipelines at the same line, with the
+    // last line written as restored from the checkpoint.
+    if( startLine > 0 )
+    {
+        pipeline->line = startLine - 1;
+        pipeline->thisOutputLine = new PLCLine(pipeline->width);
+        memcpy(pipeline->thisOutputLine->getSource(),
+               &(pipeline->lastWrittenSource[0]),
+               sizeof(unsigned short) * pipeline->width);
+    }
+}
+
 /************************************************************************/
 /*                                main()                                */
 /************************************************************************/
@@ -185,12 +334,63 @@ int main(int argc, char **argv)
             plContext.sourceTraceFilename = argv[++i];
         }
 
+        else if( EQUAL(argv[i],"-rst") && i < argc-1 
+                 && EQUAL(plContext.renderSourceTraceFilename,""))
+        {
+            plContext.renderSourceTraceFilename = argv[++i];
+        }
+
         else if( EQUAL(argv[i],"-qo") && i < argc-1 
                  && EQUAL(plContext.qualityFilename,""))
         {
             plContext.qualityFilename = argv[++i];
         }
 
+        else if( EQUAL(argv[i],"-so") && i < argc-1 
+                 && EQUAL(plContext.statisticsFilename,""))
+        {
+            plContext.statisticsFilename = argv[++i];
+        }
+
+        else if( EQUAL(argv[i],"-cs") && i < argc-1 
+                 && EQUAL(plContext.candidateStoreFilename,""))
+        {
+            plContext.candidateStoreFilename = argv[++i];
+        }
+
+        else if( EQUAL(argv[i],"-qc") && i < argc-1 
+                 && EQUAL(plContext.qualityCacheDir,""))
+        {
+            plContext.qualityCacheDir = argv[++i];
+        }
+
+        else if( EQUAL(argv[i],"-bc") && i < argc-1 
+                 && EQUAL(plContext.blockCacheDir,""))
+        {
+            plContext.blockCacheDir = argv[++i];
+        }
+
+        else if( EQUAL(argv[i],"-ckpt") && i < argc-1 
+                 && EQUAL(plContext.checkpointFilename,""))
+        {
+            plContext.checkpointFilename = argv[++i];
+        }
+
+        else if( EQUAL(argv[i],"--resume") )
+        {
+            plContext.resume = TRUE;
+        }
+
+        else if( EQUAL(argv[i],"-rm") && i < argc-1 )
+        {
+            plContext.removeInputs.push_back(atoi(argv[++i]));
+        }
+
+        else if( EQUAL(argv[i],"-u") )
+        {
+            plContext.updateMode = TRUE;
+        }
+
         else if( EQUAL(argv[i],"-q") )
         {
             plContext.quiet = TRUE;
@@ -234,9 +434,15 @@ int main(int argc, char **argv)
     }
 
 /* -------------------------------------------------------------------- */
-/*      Confirm that all inputs and outputs are the same size.  We      */
-/*      will assume they are in a consistent coordinate system.         */
+/*      Open the output, and place all the inputs on the output         */
+/*      grid.  Inputs may be of any extent.  Inputs in another          */
+/*      coordinate system or resolution are warped on the fly, a        */
+/*      block at a time, and the warped blocks are kept in the GDAL     */
+/*      block cache which can be sized with warp_cache_mb.              */
 /* -------------------------------------------------------------------- */
+    if( plContext.warpCacheMB > 0 )
+        GDALSetCacheMax64(((GIntBig) plContext.warpCacheMB) * 1024 * 1024);
+
     plContext.outputDS = (GDALDataset *) 
         GDALOpen(plContext.outputFilename, GA_Update);
     if( plContext.outputDS == NULL )
@@ -245,23 +451,57 @@ int main(int argc, char **argv)
     plContext.width = plContext.outputDS->GetRasterXSize();
     plContext.height = plContext.outputDS->GetRasterYSize();
 
+    if( !EQUAL(plContext.blockCacheDir,"") )
+        plContext.blockCache = new PLCBlockCache(&plContext);
+
     for( unsigned int i=0; i < plContext.inputFiles.size(); i++ )
     {
-        plContext.inputFiles[i]->Initialize(&plContext);
+        // Removed inputs may no longer exist.
+        if( !plContext.isRemovedInput(i) )
+            plContext.inputFiles[i]->Initialize(&plContext);
+    }
 
-        GDALDataset *inputDS = plContext.inputFiles[i]->getDS();
-        if( inputDS->GetRasterXSize() != plContext.width
-            || inputDS->GetRasterYSize() != plContext.height)
-        {
+/* -------------------------------------------------------------------- */
+/*      Removing inputs only revisits the pixels they supplied, using   */
+/*      the candidate store of the existing mosaic.                     */
+/* -------------------------------------------------------------------- */
+    if( plContext.removeInputs.size() > 0 )
+    {
+        if( EQUAL(plContext.candidateStoreFilename,"") 
+            || plContext.updateMode || plContext.products.size() > 0 )
             CPLError(CE_Fatal, CPLE_AppDefined,
-                     "Size of %s (%dx%d) does not match target %s (%dx%d)",
-                     plContext.inputFiles[i]->getFilename(),
-                     inputDS->GetRasterXSize(),
-                     inputDS->GetRasterYSize(),
-                     plContext.outputFilename.c_str(),
-                     plContext.outputDS->GetRasterXSize(),
-                     plContext.outputDS->GetRasterYSize());
-        }
+                     "remove_inputs requires candidate_store, and can't be "
+                     "combined with update or products.");
+
+        RemoveInputs(&plContext);
+
+        if( plContext.sourceTraceDS )
+            GDALClose(plContext.sourceTraceDS);
+        if( plContext.qualityDS )
+            GDALClose(plContext.qualityDS);
+        GDALClose(plContext.outputDS);
+        delete plContext.blockCache;
+        exit(0);
+    }
+
+    plContext.buildInputIndex();
+
+    for( unsigned int i=0; i < plContext.products.size(); i++ )
+        plContext.products[i]->initialize(&plContext);
+
+/* -------------------------------------------------------------------- */
+/*      In render mode the output and products are just gathered        */
+/*      from an existing source trace.                                  */
+/* -------------------------------------------------------------------- */
+    if( !EQUAL(plContext.renderSourceTraceFilename,"") )
+    {
+        RenderFromSourceTrace(&plContext);
+
+        for( unsigned int i=0; i < plContext.products.size(); i++ )
+            delete plContext.products[i];
+        GDALClose(plContext.outputDS);
+        delete plContext.blockCache;
+        exit(0);
     }
 
 /* -------------------------------------------------------------------- */
@@ -271,72 +511,198 @@ int main(int argc, char **argv)
         plContext.initializeQualityMethods(NULL);
 
 /* -------------------------------------------------------------------- */
-/*      Create source trace file if requested.                          */
+/*      Optionally run a low resolution pre-pass to narrow the          */
+/*      inputs considered for each output tile.                         */
+/* -------------------------------------------------------------------- */
+    if( plContext.prepassTileSize < 1 )
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "prepass_tile_size must be at least 1, not %d.",
+                 plContext.prepassTileSize);
+
+    if( plContext.prepassDecimation > 1 )
+        CandidatePrePass(&plContext);
+
+/* -------------------------------------------------------------------- */
+/*      Reuse per-input qualities from earlier runs where we can.       */
+/*      Other pipelines start from the input qualities as read, so     */
+/*      the cache is only used with a single pipeline.                  */
+/* -------------------------------------------------------------------- */
+    if( !EQUAL(plContext.qualityCacheDir,"") 
+        && plContext.pipelines.size() == 0 )
+        plContext.qualityCache = new PLCQualityCache(&plContext);
+    else if( !EQUAL(plContext.qualityCacheDir,"") )
+        CPLDebug("PLC", "Quality cache not used with pipelines.");
+
+/* -------------------------------------------------------------------- */
+/*      When resuming, the outputs already exist and are updated in     */
+/*      place from the first line not yet written.                      */
 /* -------------------------------------------------------------------- */
-    if( !EQUAL(plContext.sourceTraceFilename,"") )
+    int startLine = 0;
+
+    if( plContext.resume )
     {
-        GDALDriver *tiffDriver = (GDALDriver *) GDALGetDriverByName("GTiff");
-        CPLStringList createOptions;
-        GDALDataType stPixelType = GDT_Byte;
-        if( plContext.inputFiles.size() > 255 )
-            stPixelType = GDT_UInt16;
+        if( EQUAL(plContext.checkpointFilename,"") )
+            CPLError(CE_Fatal, CPLE_AppDefined,
+                     "resume requires checkpoint_file.");
 
-        createOptions.AddString("COMPRESS=LZW");
-        plContext.sourceTraceDS = 
-            tiffDriver->Create(plContext.sourceTraceFilename,
-                               plContext.width, plContext.height, 1,
-                               stPixelType, createOptions);
-        plContext.sourceTraceDS->SetProjection(
-            plContext.outputDS->GetProjectionRef());
-        
-        double geotransform[6];
-        plContext.outputDS->GetGeoTransform(geotransform);
-        plContext.sourceTraceDS->SetGeoTransform(geotransform);
+        startLine = ReadCheckpoint(&plContext);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      In update mode the source trace and quality file of the         */
+/*      existing mosaic are updated in place.  New inputs are           */
+/*      numbered after the sources already recorded.                    */
+/* -------------------------------------------------------------------- */
+    if( plContext.updateMode )
+    {
+        if( EQUAL(plContext.sourceTraceFilename,"") 
+            || EQUAL(plContext.qualityFilename,"") )
+            CPLError(CE_Fatal, CPLE_AppDefined,
+                     "update requires the existing source_trace and "
+                     "quality_output.");
+
+        if( plContext.sourceSieveThreshold > 0 
+            || plContext.averageBestRatio > 0.0
+            || plContext.products.size() > 0 )
+            CPLError(CE_Fatal, CPLE_AppDefined,
+                     "update can't be combined with source_sieve_threshold, "
+                     "average_best_ratio or products.");
+
+        plContext.sourceTraceDS = (GDALDataset *)
+            GDALOpen(plContext.sourceTraceFilename, GA_Update);
+        plContext.qualityDS = (GDALDataset *)
+            GDALOpen(plContext.qualityFilename, GA_Update);
+        if( plContext.sourceTraceDS == NULL || plContext.qualityDS == NULL )
+            exit(1);
 
-        CPLStringList sourceMD;
         CPLString key;
 
-        for( unsigned int i=0; i < plContext.inputFiles.size(); i++ )
+        // A resumed update already recorded its sources, and the offset
+        // comes from the checkpoint.
+        while( startLine == 0 )
         {
-            key.Printf("SOURCE_%d", i+1);
-            sourceMD.SetNameValue(key, plContext.inputFiles[i]->getFilename());
+            key.Printf("SOURCE_%d", plContext.sourceIndexOffset+1);
+            if( plContext.sourceTraceDS->GetMetadataItem(key) == NULL )
+                break;
+            plContext.sourceIndexOffset++;
+        }
+
+        int sourceCount = 
+            plContext.sourceIndexOffset + plContext.inputFiles.size();
+        GDALDataType stPixelType = 
+            plContext.sourceTraceDS->GetRasterBand(1)->GetRasterDataType();
+
+        if( (stPixelType == GDT_Byte && sourceCount > 255)
+            || sourceCount > 65535 )
+            CPLError(CE_Fatal, CPLE_AppDefined,
+                     "%d sources do not fit in source trace %s.",
+                     sourceCount, plContext.sourceTraceFilename.c_str());
+
+        for( unsigned int i=0; i < plContext.inputFiles.size() 
+                 && startLine == 0; i++ )
+        {
+            key.Printf("SOURCE_%d", plContext.sourceIndexOffset + i + 1);
+            plContext.sourceTraceDS->SetMetadataItem(
+                key, plContext.inputFiles[i]->getFilename());
         }
 
-        plContext.sourceTraceDS->SetMetadata(sourceMD);
+        CPLDebug("PLC", "Updating mosaic of %d sources with %d new inputs.",
+                 plContext.sourceIndexOffset, 
+                 (int) plContext.inputFiles.size());
     }
 
+    OpenTraceAndQuality(&plContext, startLine);
+
 /* -------------------------------------------------------------------- */
-/*      Create quality file if requested.                               */
+/*      Per pixel statistics of the stack, if requested.  An update     */
+/*      only sees the new inputs, and the pre-pass drops inputs that    */
+/*      can't win.                                                      */
 /* -------------------------------------------------------------------- */
-    if( !EQUAL(plContext.qualityFilename,"") )
+    if( !EQUAL(plContext.statisticsFilename,"") )
     {
-        GDALDriver *tiffDriver = (GDALDriver *) GDALGetDriverByName("GTiff");
-        plContext.qualityDS = 
-            tiffDriver->Create(plContext.qualityFilename,
-                               plContext.width, plContext.height,
-                               plContext.inputFiles.size() + 1,
-                               GDT_Float32, NULL);
-        plContext.qualityDS->SetProjection(
-            plContext.outputDS->GetProjectionRef());
-        
-        double geotransform[6];
-        plContext.outputDS->GetGeoTransform(geotransform);
-        plContext.qualityDS->SetGeoTransform(geotransform);
+        if( plContext.updateMode || plContext.prepassDecimation > 1 )
+            CPLError(CE_Fatal, CPLE_AppDefined,
+                     "statistics_output can't be combined with update or "
+                     "prepass_decimation.");
 
-        for( unsigned int i=0; i < plContext.inputFiles.size(); i++ )
-        {
-            plContext.qualityDS->GetRasterBand(i+2)->
-                SetDescription(plContext.inputFiles[i]->getFilename());
-        }
+        plContext.statistics = new PLCStackStatistics(&plContext, 
+                                                      startLine > 0);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Create the candidate store if requested.  The pre-pass would    */
+/*      drop runners-up, and updates can't refresh the store.          */
+/* -------------------------------------------------------------------- */
+    if( !EQUAL(plContext.candidateStoreFilename,"") )
+    {
+        if( plContext.updateMode || plContext.prepassDecimation > 1 )
+            CPLError(CE_Fatal, CPLE_AppDefined,
+                     "candidate_store can't be combined with update or "
+                     "prepass_decimation.");
+
+        if( startLine > 0 )
+            OpenCandidateStore(&plContext);
+        else
+            CreateCandidateStore(&plContext);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Open the outputs of the other pipelines.                        */
+/* -------------------------------------------------------------------- */
+    if( plContext.pipelines.size() > 0 
+        && (plContext.updateMode || plContext.prepassDecimation > 1) )
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "pipelines can't be combined with update or "
+                 "prepass_decimation.");
+
+    for( unsigned int i=0; i < plContext.pipelines.size(); i++ )
+        InitializePipeline(&plContext, plContext.pipelines[i], startLine);
+
+/* -------------------------------------------------------------------- */
+/*      Source sieving is normally done on the fly as lines are         */
+/*      produced, or may be done afterwards with GDALSieveFilter().     */
+/* -------------------------------------------------------------------- */
+    PLCStreamingSieve *sieve = NULL;
+
+    if( plContext.sourceSieveThreshold > 0 
+        && EQUAL(plContext.sourceSieveMethod, "streaming") )
+        sieve = new PLCStreamingSieve(&plContext);
+    else if( plContext.sourceSieveThreshold > 0 
+             && !EQUAL(plContext.sourceSieveMethod, "gdal") )
+    {
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "Unknown source_sieve_method '%s'.", 
+                 plContext.sourceSieveMethod.c_str());
+        exit(1);
+    }
 
-        plContext.qualityDS->GetRasterBand(1)->
-            SetDescription(plContext.outputFilename);
+/* -------------------------------------------------------------------- */
+/*      Pick up the last line written, for same_source and the sieve.   */
+/* -------------------------------------------------------------------- */
+    if( startLine > 0 )
+    {
+        plContext.line = startLine - 1;
+        plContext.thisOutputLine = new PLCLine(plContext.width);
+        memcpy(plContext.thisOutputLine->getSource(),
+               &(plContext.lastWrittenSource[0]),
+               sizeof(unsigned short) * plContext.width);
+
+        if( sieve != NULL )
+            sieve->seedLine(startLine - 1, &(plContext.lastWrittenSource[0]));
     }
 
+    int lastCheckpoint = startLine;
+
+    // For testing, stop as if interrupted after the first checkpoint at
+    // or beyond this many lines.
+    int stopAfterLines = 
+        atoi(CPLGetConfigOption("COMPOSITOR_CHECKPOINT_STOP", "0"));
+
 /* -------------------------------------------------------------------- */
 /*      Run through the image processing scanlines.                     */
 /* -------------------------------------------------------------------- */
-    for(int line=0; line < plContext.outputDS->GetRasterYSize(); line++ )
+    for(int line=startLine; line < plContext.outputDS->GetRasterYSize(); 
+        line++ )
     {
         pfnProgress(line / (double) plContext.height, NULL, NULL);
 
@@ -344,17 +710,57 @@ int main(int argc, char **argv)
 
         CPLAssert( plContext.line == line );
 
-        LineCompositor(&plContext, line, lineObj );
+        for( unsigned int i=0; i < plContext.pipelines.size(); i++ )
+            plContext.pipelines[i]->getNextOutputLine();
+
+        if( plContext.updateMode )
+            UpdateLineCompositor(&plContext, line, lineObj );
+        else
+            LineCompositor(&plContext, line, lineObj );
+
+        if( sieve != NULL )
+            sieve->addLine(line, lineObj);
+        else
+            plContext.writeOutputLine();
+
+        for( unsigned int i=0; i < plContext.pipelines.size(); i++ )
+            plContext.pipelines[i]->writeOutputLine();
+
+        if( !EQUAL(plContext.checkpointFilename,"")
+            && plContext.linesWritten >= 
+               lastCheckpoint + plContext.checkpointInterval )
+        {
+            WriteCheckpoint(&plContext);
+            lastCheckpoint = plContext.linesWritten;
+
+            if( stopAfterLines > 0 && lastCheckpoint >= stopAfterLines )
+            {
+                CPLDebug("PLC", "Stopping after checkpoint at line %d.",
+                         lastCheckpoint);
+                exit(1);
+            }
+        }
+    }
 
-        plContext.writeOutputLine();
+    if( sieve != NULL )
+    {
+        sieve->finish();
+        delete sieve;
     }
+    delete plContext.qualityCache;
+    plContext.qualityCache = NULL;
     pfnProgress(1.0, NULL, NULL);
 
+    // A failure in post processing resumes straight into it.
+    if( !EQUAL(plContext.checkpointFilename,"") )
+        WriteCheckpoint(&plContext);
+
 /* -------------------------------------------------------------------- */
 /*      Do we need to post process the source trace, and rebuild the    */
 /*      output?                                                         */
 /* -------------------------------------------------------------------- */
-    if( plContext.sourceSieveThreshold > 0 )
+    if( plContext.sourceSieveThreshold > 0 
+        && EQUAL(plContext.sourceSieveMethod, "gdal") )
         SourcePostProcess(&plContext);
     
 /* -------------------------------------------------------------------- */
@@ -362,10 +768,42 @@ int main(int argc, char **argv)
 /* -------------------------------------------------------------------- */
     GDALClose(plContext.outputDS);
 
+    for( unsigned int i=0; i < plContext.products.size(); i++ )
+        delete plContext.products[i];
+
     if( plContext.sourceTraceDS )
         GDALClose(plContext.sourceTraceDS);
     if( plContext.qualityDS )
         GDALClose(plContext.qualityDS);
+    if( plContext.candidateStoreDS )
+        GDALClose(plContext.candidateStoreDS);
+    if( plContext.candidateQualityDS )
+        GDALClose(plContext.candidateQualityDS);
+    delete plContext.statistics;
+
+    // Quality methods may have outputs of their own to close.
+    for( unsigned int i=0; i < plContext.qualityMethods.size(); i++ )
+        delete plContext.qualityMethods[i];
+
+    for( unsigned int i=0; i < plContext.pipelines.size(); i++ )
+    {
+        PLCContext *pipeline = plContext.pipelines[i];
+
+        GDALClose(pipeline->outputDS);
+        if( pipeline->sourceTraceDS )
+            GDALClose(pipeline->sourceTraceDS);
+        if( pipeline->qualityDS )
+            GDALClose(pipeline->qualityDS);
+
+        for( unsigned int j=0; j < pipeline->qualityMethods.size(); j++ )
+            delete pipeline->qualityMethods[j];
+    }
+
+    // Trims the shared block cache to its disk budget.
+    delete plContext.blockCache;
+
+    if( !EQUAL(plContext.checkpointFilename,"") )
+        VSIUnlink(plContext.checkpointFilename);
 
 /* -------------------------------------------------------------------- */
 /*      Reporting?                                                      */
@@ -373,6 +811,10 @@ int main(int argc, char **argv)
     if( plContext.verbose )
     {
         plContext.qualityHistogram.report(stdout, "final_quality");
+
+        for( unsigned int i=0; i < plContext.pipelines.size(); i++ )
+            plContext.pipelines[i]->qualityHistogram.report(
+                stdout, CPLString().Printf("pipeline_%d_final_quality", i+1));
     }
 
     exit(0);
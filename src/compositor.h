@@ -17,12 +17,19 @@
  */
 
 #include <map>
+#include <deque>
+#include <list>
 #include "gdal_priv.h"
+#include "cpl_quad_tree.h"
 
 #include <wjelement.h>
 
 class QualityMethodBase;
+class PLCQualityCache;
+class PLCBlockCache;
+class PLCStackStatistics;
 class PLCContext;
+class OGRGeometry;
 
 ////////////////////////////////////////////////////////////////////////////
 class PLCLine {
@@ -30,11 +37,18 @@ class PLCLine {
     
     int     bandCount;
     std::vector<float*> bandData;
+    std::vector<GByte>  bandLoaded;
     unsigned short  *cloud;
     GByte  *alpha;
+    GByte  *validity;
     float  *quality;
     float  *newQuality;
+    int     newQualityUniform;
+    float   newQualityValue;
     unsigned short  *source;
+
+    std::vector<int> validSpans;
+    int     validSpansDirty;
     
   public:
     PLCLine(int width);
@@ -42,12 +56,40 @@ class PLCLine {
 
     int     getWidth() { return width; }
     int     getBandCount() { return bandCount; }
+    void    setBandCount(int);
     float  *getBand(int);
+
+    // Bands are allocated when first used, and flagged once read.
+    int     isBandLoaded(int band) { 
+        return band < bandCount && bandLoaded[band]; }
+    void    setBandLoaded(int band) { getBand(band); bandLoaded[band] = 1; }
     GByte  *getAlpha();
     unsigned short  *getCloud();
+
+    // Validity bitmap, one bit per pixel.  NULL means all pixels are valid.
+    GByte  *getValidity() { return validity; }
+    int     isAllValid() { return validity == NULL; }
+    int     isValid(int i) { 
+        return validity == NULL || (validity[i>>3] & (1 << (i & 7))); }
+    void    setValidityFromMask(const GByte *mask);
+    void    maskQuality(float *quality);
+
+    // Runs of valid pixels as [start,end) pairs, built from the validity
+    // bitmap when first needed.  Quality methods and the selector only
+    // visit these pixels, values outside them are left undefined.
+    const std::vector<int> &getValidSpans();
+    int     hasValidPixels() { return getValidSpans().size() > 0; }
+
     unsigned short  *getSource();
     float  *getQuality();
     float  *getNewQuality();
+
+    // A new quality that is the same for every pixel is kept as a single
+    // value, and merged as a scalar.  getNewQuality() expands it.
+    void    setNewQualityUniform(float value) {
+        newQualityUniform = TRUE; newQualityValue = value; }
+    int     getNewQualityUniform(float *value) {
+        *value = newQualityValue; return newQualityUniform; }
 };
 
 ////////////////////////////////////////////////////////////////////////////
@@ -67,16 +109,104 @@ class PLCHistogram {
     std::vector<int> counts;
 
     void accumulate(float *qualities, int count);
+    void accumulate(float *qualities, const std::vector<int> &spans);
     void report(FILE *fp, const char *id);
 };
 
+////////////////////////////////////////////////////////////////////////////
+class PLCAuxRaster {
+    CPLString    filename;
+    GDALDataset *DS;
+    int          bilinear;
+
+    int          targetWidth;
+    int          targetHeight;
+    int          ratio;
+
+    // Coarse rows currently held, and per target pixel sampling info.
+    int          cachedRow[2];
+    std::vector<float> rowCache[2];
+    std::vector<int>   xIndex;
+    std::vector<float> xWeight;
+    std::vector<float> expanded;
+
+    float       *getCoarseRow(int coarseLine, int slot);
+    void         expandRow(float *coarse, float *dst);
+
+  public:
+                 PLCAuxRaster(const char *filename, 
+                              const char *resampling = "nearest");
+    virtual     ~PLCAuxRaster();
+
+    void         Initialize(int targetWidth, int targetHeight);
+    void         setDS(GDALDataset *ds) { DS = ds; } // takes ownership
+    GDALDataset *getDS() { return DS; }
+    int          getRatio() { return ratio; }
+
+    void         readLine(int line, void *data, GDALDataType dataType);
+};
+
+////////////////////////////////////////////////////////////////////////////
+class PLCVectorMask {
+  public:
+    struct Edge {
+        double yMin;
+        double yMax;
+        double xAtYMin;
+        double slope;
+        int    polygon;
+    };
+
+  private:
+    CPLString    filename;
+    int          width;
+    int          polygonCount;
+
+    // Edge table sorted by yMin, and the edges active on lastLine.
+    std::vector<Edge> edges;
+    std::vector<unsigned int> activeEdges;
+    unsigned int nextEdge;
+    int          lastLine;
+
+    void         addGeometry(OGRGeometry *geom, const double *invGT);
+    void         addRing(std::vector<double> &x, std::vector<double> &y);
+
+  public:
+                 PLCVectorMask(const char *filename);
+    virtual     ~PLCVectorMask();
+
+    void         Initialize(GDALDataset *imageryDS);
+    void         getSpans(int line, std::vector<int> &spans);
+};
+
+// Candidate pre-pass flags per tile and input.
+#define PLC_TILE_CANDIDATE      0x1
+#define PLC_TILE_SAMPLED        0x2
+
+// Imagery bands loaded by PLCInput::getLine(), the rest can be loaded
+// later with PLCInput::readImagery().
+#define PLC_NO_BANDS            0
+#define PLC_QUALITY_BANDS       1
+#define PLC_ALL_BANDS           2
+
 ////////////////////////////////////////////////////////////////////////////
 class PLCInput {
     CPLString    filename;
+    CPLString    fileKey;
     GDALDataset *DS;
+
+    std::vector<int> imageryBands;
+    int          maskFlags;
+    std::vector<GDALRasterBand*> maskBands;
     
     CPLString    cloudMask;
-    GDALDataset *cloudDS;
+    PLCAuxRaster *cloudRaster;
+
+    CPLString    cloudVector;
+    PLCVectorMask *cloudVectorMask;
+
+    // Other auxiliary rasters, such as quality files, by filename.
+    std::map <CPLString,PLCAuxRaster*> auxRasters;
     
     std::map <CPLString,double> qualityMetrics;
     std::map <CPLString,CPLString> parameters;
@@ -85,6 +215,25 @@ class PLCInput {
     PLCHistogram cloudQualityHistogram;
 
     int          inputIndex;
+
+    // Footprint on the output grid.
+    int          xOff;
+    int          yOff;
+    int          xSize;
+    int          ySize;
+    int          outputWidth;
+
+    // Inputs not on the output grid are read through a warped VRT.
+    PLCContext  *context;
+    int          warped;
+    double       warpGT[6];
+    void         computeWarpFootprint(PLCContext *);
+    GDALDataset *createWarpedDS(GDALDataset *srcDS, const char *resampling,
+                                int imagery);
+
+    void         readImageryRange(PLCLine *lineObj, int line, 
+                                  int outStart, int outEnd,
+                                  std::vector<int> &bands);
     
   public:
                  PLCInput(int inputIndex = -1);
@@ -93,19 +242,72 @@ class PLCInput {
     int          ConsumeArgs(int argc, char **argv);
     void         ConsumeJson(WJElement);
     void         Initialize(PLCContext *);
+    PLCInput    *createVariant(const char *variantFilename);
 
     double       getQM(const char *key, double defaultValue = -1.0);
     const char  *getParm(const char *key, const char *defaultValue = NULL);
+    CPLString    getBinValue(const char *key);
 
     const char  *getFilename() { return filename; }
     GDALDataset *getDS();
+    void         releaseDS();
+
+    int          getXOff() { return xOff; }
+    int          getYOff() { return yOff; }
+    int          getXSize() { return xSize; }
+    int          getYSize() { return ySize; }
+    int          intersectsLine(int line) {
+        return line >= yOff && line < yOff + ySize; }
+    int          isWarped() { return warped; }
+
+    PLCAuxRaster *openAuxRaster(const char *auxFilename, 
+                                const char *resampling);
+    PLCAuxRaster *getAuxRaster(const char *auxFilename, 
+                               const char *resampling);
 
     const char  *getCloudFilename() { return cloudMask; }
-    GDALDataset *getCloudDS();
+    PLCAuxRaster *getCloudRaster();
 
-    PLCLine     *getLine(int line);
+    const char  *getCloudVectorFilename() { return cloudVector; }
+    PLCVectorMask *getCloudVectorMask();
+
+    PLCLine     *getLine(int line, int bands = PLC_ALL_BANDS);
+    PLCLine     *getDecimatedLine(int line, int bands);
+    int          getDecimatedRange(int *start, int *end);
+    void         readImagery(PLCLine *lineObj, int line, 
+                             const GByte *needed = NULL);
+    void         readAuxLine(PLCAuxRaster *aux, int line, void *data,
+                             GDALDataType dataType);
 
     int          getInputIndex() { return inputIndex; }
+
+    // Identifies the file, its settings and its placement, for caching.
+    CPLString    getCacheKey();
+
+    // Identifies just the file, for caching decoded blocks.
+    CPLString    getFileKey();
+};
+
+////////////////////////////////////////////////////////////////////////////
+// An additional rendering of the mosaic, gathered from its own variant of
+// each input (named by the input parameter inputKey) using the same
+// source map as the main output.
+class PLCProduct {
+  public:
+    PLCProduct();
+    ~PLCProduct();
+
+    CPLString     outputFilename;
+    CPLString     inputKey;
+    GDALDataset  *DS;
+
+    // Parallel to PLCContext::inputFiles, NULL where an input has no
+    // file for this product.
+    std::vector<PLCInput*> inputs;
+
+    void          initialize(PLCContext *);
+    void          renderLine(PLCContext *, int line, 
+                             const unsigned short *source);
 };
 
 ////////////////////////////////////////////////////////////////////////////
@@ -116,6 +318,8 @@ class PLCContext {
 
     void          initializeFromJson(WJElement);
     void          initializeQualityMethods(WJElement);
+    int           isQualityBand(int band);
+    int           qualityUsesCloud();
     int           width;
     int           height;
     int           line;
@@ -125,8 +329,29 @@ class PLCContext {
     int           currentLine;
 
     double        averageBestRatio;
+    int           averageQualityWeighted; // else equal weights
 
     int           sourceSieveThreshold;
+    CPLString     sourceSieveMethod;   // "streaming" or "gdal"
+    int           sourceSieveWindow;
+
+    double        warpErrorThreshold;
+    int           warpCacheMB;
+
+    // Decimation of lines returned by PLCInput::getLine(), only other
+    // than 1 during the candidate pre-pass.
+    int           decimation;
+
+    int           prepassDecimation;
+    int           prepassTileSize;
+    double        prepassMargin;
+    CPLString     prepassCandidatesFilename;
+
+    // Per tile and input PLC_TILE_* flags from the pre-pass, if run.
+    int           tileCols;
+    int           tileRows;
+    std::vector<GByte> tileCandidates;
+    int           isTileCandidate(PLCInput *, int tileCol, int tileRow);
     
     std::vector<int> debugPixels;
     int           isDebugPixel(int pixel, int line);
@@ -146,17 +371,217 @@ class PLCContext {
     CPLString     qualityFilename;
     GDALDataset  *qualityDS;
 
+    // Update an existing output, source trace and quality output with
+    // new inputs, whose source values follow the existing ones.
+    int           updateMode;
+    int           sourceIndexOffset;
+
+    // Optional store of the top candidateCount sources and qualities of
+    // each pixel, from which inputs listed in removeInputs (1 based
+    // source numbers) can later be withdrawn.  The qualities are kept
+    // in a Float32 companion file, so the sources can be UInt16.
+    CPLString     candidateStoreFilename;
+    int           candidateCount;
+    GDALDataset  *candidateStoreDS;
+    GDALDataset  *candidateQualityDS;
+    std::vector<int> removeInputs;
+    int           isRemovedInput(int inputIndex);
+
+    // Progress is checkpointed every checkpointInterval lines written,
+    // and a run with resume set carries on from the checkpoint.
+    CPLString     checkpointFilename;
+    int           checkpointInterval;
+    int           resume;
+    int           linesWritten;
+    std::vector<unsigned short> lastWrittenSource;
+
+    // Render from an existing source trace instead of compositing.
+    CPLString     renderSourceTraceFilename;
+
+    std::vector<PLCProduct*> products;
+
     std::vector<PLCInput*> inputFiles;
     std::vector<QualityMethodBase*> qualityMethods;
 
+    // Settings of each quality method in a canonical form, for caching.
+    std::vector<CPLString> qualityMethodKeys;
+
+    CPLString     qualityCacheDir;
+    PLCQualityCache *qualityCache;
+
+    CPLString     statisticsFilename;
+    PLCStackStatistics *statistics;
+
+    CPLString     blockCacheDir;
+    int           blockCacheMB;
+    int           blockCacheDiskMB;
+    PLCBlockCache *blockCache;
+
+    CPLQuadTree  *inputTree;
+    void          buildInputIndex();
+    void          getLineInputs(int line, std::vector<PLCInput*> &inputs);
+    void          getWindowInputs(int xOff, int yOff, int xSize, int ySize,
+                                  std::vector<PLCInput*> &inputs);
+
     PLCLine *     lastOutputLine;
     PLCLine *     thisOutputLine;
     
     PLCLine *     getNextOutputLine();
     PLCLine *     getLastOutputLine() { return lastOutputLine; }
     void          writeOutputLine(bool postProcessing = false);
+    void          writeOutputLine(PLCLine *lineObj, int line, 
+                                  bool postProcessing);
 
     PLCHistogram  qualityHistogram;
+
+    // Further compositor configurations evaluated against the same input
+    // lines, each with its own quality methods and outputs.
+    std::vector<PLCContext*> pipelines;
+
+    // A pipeline for a time bin only composites the inputs whose binKey
+    // parameter or quality metric is binValue.
+    CPLString     binKey;
+    CPLString     binValue;
+    int           isBinInput(PLCInput *);
+};
+
+////////////////////////////////////////////////////////////////////////////
+// Disk cache of each input's quality after the leading quality methods
+// that depend only on that input.  Cache files are named by a hash of
+// the input and the settings of those methods, so later runs using the
+// same scene and settings skip them, and the quality band reads.
+class PLCQualityCache {
+    PLCContext   *context;
+    CPLString     directory;
+    int           methodCount;
+    CPLString     methodKey;
+    int           writable;
+
+    // Per input: 0 not yet checked, 1 cached, 2 being written, 3 neither.
+    std::vector<GByte> state;
+    std::vector<GDALDataset*> cacheDS;
+    std::vector<int> linesWritten;
+
+    CPLString     getCacheFilename(PLCInput *);
+    CPLString     getTempCacheFilename(PLCInput *);
+    void          getCacheWindow(PLCInput *, int *xOff, int *yOff,
+                                 int *xSize, int *ySize);
+    void          closeInput(PLCInput *, int complete);
+
+  public:
+    PLCQualityCache(PLCContext *);
+    ~PLCQualityCache();
+
+    int           getMethodCount() { return methodCount; }
+    int           isCached(PLCInput *);
+    void          readLine(PLCInput *, int line, PLCLine *);
+    void          writeLine(PLCInput *, int line, PLCLine *);
+};
+
+////////////////////////////////////////////////////////////////////////////
+// Per pixel statistics of each output band over the inputs with a
+// positive quality, weighted by that quality.  Each output band has
+// PLC_STATISTIC_COUNT bands in the statistics output: mean, standard
+// deviation, minimum, maximum and count of observations.
+#define PLC_STATISTIC_COUNT 5
+
+class PLCStackStatistics {
+    PLCContext   *context;
+    GDALDataset  *DS;
+    int           bandCount;
+
+  public:
+    PLCStackStatistics(PLCContext *, int resume);
+    ~PLCStackStatistics();
+
+    GDALDataset  *getDS() { return DS; }
+    void          getWeights(std::vector<PLCLine *> &inputLines,
+                             std::vector< std::vector<float> > &weights);
+    void          processLine(int line, std::vector<PLCLine *> &inputLines,
+                              std::vector< std::vector<float> > &weights);
+};
+
+////////////////////////////////////////////////////////////////////////////
+// Cache of decoded imagery blocks as Float32, kept in memory and spilled
+// compressed to a directory that other compositor runs on the same node
+// may share.  Blocks are keyed by file, band and block offset.
+class PLCBlockCache {
+    CPLString     directory;
+    GIntBig       memoryBudget;
+    GIntBig       memoryUsed;
+    GIntBig       diskBudget;
+    GIntBig       diskUsed;
+
+    // Least recently used blocks at the back.
+    std::list<CPLString> lru;
+    struct Block {
+        std::vector<float> data;
+        int         xSize;
+        std::list<CPLString>::iterator lruPos;
+    };
+    std::map<CPLString, Block> blocks;
+
+    Block        *getBlock(const CPLString &fileKey, GDALRasterBand *band,
+                           int bandNumber, int blockX, int blockY);
+    int           readSpill(const CPLString &filename, Block &block, 
+                            size_t count);
+    void          writeSpill(const CPLString &filename, Block &block);
+    void          trimSpill(GIntBig target);
+
+  public:
+    PLCBlockCache(PLCContext *);
+    ~PLCBlockCache();
+
+    void          readRow(const CPLString &fileKey, GDALRasterBand *band, 
+                          int bandNumber, int xOff, int yOff, int count,
+                          float *data);
+};
+
+GUIntBig PLCHashKey(const CPLString &key);
+CPLString PLCFileStamp(const char *filename);
+
+////////////////////////////////////////////////////////////////////////////
+// Sieves the source map as the output lines are produced.  Lines are
+// buffered for a window of rows while source regions are labelled with
+// a union-find.  Regions smaller than the threshold are merged into
+// their largest neighbour once closed, and lines are written as they
+// leave the window.
+class PLCStreamingSieve {
+    PLCContext   *context;
+    int           width;
+    int           threshold;
+    int           window;
+    int           lastLine;
+    int           seedLines;   // leading rows already written
+
+    int           firstLine;   // output line of rows[0]
+    std::deque<PLCLine*> rows;
+    std::deque< std::vector<int> > labels;
+
+    // Union-find nodes, one per run of a source on a line.
+    std::vector<int> parent;
+    std::vector<int> size;
+    std::vector<int> firstRow;
+    std::vector<int> lastRow;
+    std::vector<unsigned short> value;
+    std::vector<GByte> settled;   // region is kept as is
+
+    int           newLabel(unsigned short source, int line);
+    int           find(int label);
+    int           join(int a, int b);
+    void          closeComponents(int row, int nextLine);
+    void          mergeComponent(int label);
+    void          repaint(int label, unsigned short source);
+    void          flushLine();
+    void          compact();
+
+  public:
+    PLCStreamingSieve(PLCContext *);
+    ~PLCStreamingSieve();
+
+    void          addLine(int line, PLCLine *lineObj);
+    void          seedLine(int line, const unsigned short *source);
+    void          finish();
 };
 
 ////////////////////////////////////////////////////////////////////////////
@@ -171,10 +596,45 @@ class QualityMethodBase {
     virtual QualityMethodBase *create(PLCContext*, WJElement node) = 0;
 
     virtual int computeQuality(PLCInput *, PLCLine *) = 0;
-    virtual int computeStackQuality(PLCContext *, std::vector<PLCLine *>&);
+    virtual int computeStackQuality(PLCContext *, std::vector<PLCInput *>&,
+                                    std::vector<PLCLine *>&);
 
     virtual void mergeQuality(PLCInput *, PLCLine *);
 
+    // Does the quality of one input depend on the other inputs?
+    virtual int isStackWide() { return FALSE; }
+
+    // Does the quality depend only on the input and the method settings,
+    // so it may be reused by later runs?
+    virtual int isCacheable() { return !isStackWide(); }
+
+    // Upper bound on the new quality this method can assign to any
+    // pixel of the input, or FALSE if it can't be known in advance.
+    virtual int getUpperBound(PLCInput *, double *bound) { return FALSE; }
+
+    // Key for the auxiliary files this method reads for an input, so
+    // cached qualities are not reused once they change.
+    virtual CPLString getCacheKey(PLCInput *) { return ""; }
+
+    // Does this method look at the imagery bands, or only at the
+    // auxiliary data (cloud masks, quality files, scene measures)?
+    virtual int requiresImagery() { return TRUE; }
+
+    // Which imagery bands (from 0) and auxiliary layers are used.
+    // Anything not used by any method is not read for quality.
+    virtual int requiresBand(int band) { return requiresImagery(); }
+    virtual int requiresCloud() { return TRUE; }
+
+    // Methods with outputs of their own mark the further input pixels
+    // those outputs use before the deferred bands are read, and write
+    // them once the line is built.
+    virtual void addUsedPixels(std::vector<PLCInput *>&,
+                               std::vector< std::vector<GByte> >&) {}
+    virtual void finishLine(PLCContext *, int line, 
+                            std::vector<PLCInput *>&,
+                            std::vector<PLCLine *>&) {}
+    virtual void flush() {}
+
     virtual const char *getName() { return this->name; }
 
     static QualityMethodBase *CreateQualityFunction(PLCContext *,
@@ -183,5 +643,22 @@ class QualityMethodBase {
 };
 
 void LineCompositor(PLCContext *plContext, int line, PLCLine *lineObj);
+void UpdateLineCompositor(PLCContext *plContext, int line, PLCLine *lineObj);
+void ComputeLineQualities(PLCContext *plContext, int line,
+                          std::vector<PLCInput *> &inputs,
+                          std::vector<PLCLine *> &inputLines);
+
+void CandidatePrePass(PLCContext *plContext);
+void GatherFromSource(PLCContext *plContext, int line,
+                      std::vector<PLCInput *> &inputs,
+                      const unsigned short *source, PLCLine *lineObj);
+void RenderFromSourceTrace(PLCContext *plContext);
+void CreateCandidateStore(PLCContext *plContext);
+void OpenCandidateStore(PLCContext *plContext);
+void WriteCandidateStoreLine(PLCContext *plContext, int line,
+                             std::vector<float> &candidates);
+void RemoveInputs(PLCContext *plContext);
+int ReadCheckpoint(PLCContext *plContext);
+void WriteCheckpoint(PLCContext *plContext);
 
 void SourcePostProcess(PLCContext *plContext);
@@ -65,27 +65,31 @@ public:
         return obj;
     }
 
+    /********************************************************************/
+    int requiresBand(int band) {
+        return band >= DQ_MAX_BANDS || band_weight[band] != 0.0;
+    }
+
+    /********************************************************************/
+    int requiresCloud() { return FALSE; }
+
     /********************************************************************/
     int computeQuality(PLCInput *input, PLCLine *lineObj) {
 
         float *quality = lineObj->getNewQuality();
-        int width = lineObj->getWidth();
+        const std::vector<int> &spans = lineObj->getValidSpans();
         double scale = 1.0 / (lineObj->getBandCount() * (scale_max-scale_min));
 
-        memset(quality, 0, sizeof(float) * width);
+        memset(quality, 0, sizeof(float) * lineObj->getWidth());
         for(int iBand=0; iBand < lineObj->getBandCount(); iBand++)
         {
             float *pixels = lineObj->getBand(iBand);
 
-            for(int i=0; i < width; i++ )
-                quality[i] += (scale_max - pixels[i]) * scale * band_weight[iBand];
-        }
-    
-        GByte *alpha = lineObj->getAlpha();
-        for(int i=0; i < width; i++ )
-        {
-            if( alpha[i] < 128 )
-                quality[i] = -1.0;
+            for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
+            {
+                for(int i=spans[iSpan]; i < spans[iSpan+1]; i++ )
+                    quality[i] += (scale_max - pixels[i]) * scale * band_weight[iBand];
+            }
         }
 
         return TRUE;
@@ -35,11 +35,17 @@ public:
         return obj;
     }
 
+    /********************************************************************/
+    int requiresBand(int band) { return band < 3; }
+
+    /********************************************************************/
+    int requiresCloud() { return FALSE; }
+
     /********************************************************************/
     int computeQuality(PLCInput *input, PLCLine *lineObj) {
 
         float *quality = lineObj->getNewQuality();
-        int width = lineObj->getWidth();
+        const std::vector<int> &spans = lineObj->getValidSpans();
 
         if( lineObj->getBandCount() < 3 )
             CPLError( CE_Fatal, CPLE_AppDefined,
@@ -48,15 +54,12 @@ public:
         float *red = lineObj->getBand(0);
         float *green = lineObj->getBand(1);
         float *blue = lineObj->getBand(2);
-        GByte *alpha = lineObj->getAlpha();
 
-        for(int i=0; i < width; i++ )
+        for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
         {
-            if( alpha[i] < 128 )
-                quality[i] = -1.0;
-            else
+            for(int i=spans[iSpan]; i < spans[iSpan+1]; i++ )
                 quality[i] = green[i] / ((float) red[i]+green[i]+blue[i]+1);
-        }        
+        }
 
         return TRUE;
     }
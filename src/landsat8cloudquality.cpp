@@ -119,58 +119,83 @@ public:
         return obj;
     }
 
+    /********************************************************************/
+    int getUpperBound(PLCInput *input, double *bound) {
+        // Best of any cloud level combined with any cirrus level.
+        float cloudLevels[5] = { fully_confident_cloud, 
+                                 mostly_confident_cloud,
+                                 partially_confident_cloud, 
+                                 not_cloud, -1.0 };
+        float cirrusLevels[4] = { fully_confident_cirrus,
+                                  mostly_confident_cirrus,
+                                  partially_confident_cirrus, 1.0 };
+
+        *bound = cloudLevels[0] * cirrusLevels[0];
+        for( int i = 0; i < 5; i++ )
+            for( int j = 0; j < 4; j++ )
+                *bound = MAX(*bound, cloudLevels[i] * cirrusLevels[j]);
+
+        return TRUE;
+    }
+
+    /********************************************************************/
+    int requiresImagery() { return FALSE; }
+
     /********************************************************************/
     int computeQuality(PLCInput *input, PLCLine *lineObj) {
 
         float *quality = lineObj->getNewQuality();
         unsigned short *cloud = lineObj->getCloud();
-        int width = lineObj->getWidth();
+        const std::vector<int> &spans = lineObj->getValidSpans();
 
-        for(int i=0; i < width; i++ )
+        for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
         {
-            // Cloud bits
-            switch( cloud[i] & 0xc000 ) {
-              case 0xc000:
-                quality[i] = fully_confident_cloud;
-                break;
-
-              case 0x8000:
-                quality[i] = mostly_confident_cloud;
-                break;
+            for(int i=spans[iSpan]; i < spans[iSpan+1]; i++ )
+            {
+                // Cloud bits
+                switch( cloud[i] & 0xc000 ) {
+                  case 0xc000:
+                    quality[i] = fully_confident_cloud;
+                    break;
+
+                  case 0x8000:
+                    quality[i] = mostly_confident_cloud;
+                    break;
             
-              case 0x4000:
-                quality[i] = partially_confident_cloud;
-                break;
-
-              default:
-                if( cloud[i] & 0x7 ) // dead pixel markers.
-                    quality[i] = -1.0;
-                else
-                    quality[i] = not_cloud;
-                break;
-            }
-
-            // Cirrus Bits
-            switch( cloud[i] & 0x3000 ) {
-              case 0x3000:
-                quality[i] *= fully_confident_cirrus;
-                break;
-
-              case 0x2000:
-                quality[i] *= mostly_confident_cirrus;
-                break;
+                  case 0x4000:
+                    quality[i] = partially_confident_cloud;
+                    break;
+
+                  default:
+                    if( cloud[i] & 0x7 ) // dead pixel markers.
+                        quality[i] = -1.0;
+                    else
+                        quality[i] = not_cloud;
+                    break;
+                }
+
+                // Cirrus Bits
+                switch( cloud[i] & 0x3000 ) {
+                  case 0x3000:
+                    quality[i] *= fully_confident_cirrus;
+                    break;
+
+                  case 0x2000:
+                    quality[i] *= mostly_confident_cirrus;
+                    break;
             
-              case 0x1000:
-                quality[i] *= partially_confident_cirrus;
-                break;
-
-              default:
-                // no alteration.
-                break;
+                  case 0x1000:
+                    quality[i] *= partially_confident_cirrus;
+                    break;
+
+                  default:
+                    // no alteration.
+                    break;
+                }
             }
         }
 
-        cloudHistogram.accumulate(quality, width);
+        cloudHistogram.accumulate(quality, spans);
 
         if( context->line == context->height - 1 
             && context->verbose > 0 )
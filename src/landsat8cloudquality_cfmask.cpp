@@ -68,40 +68,46 @@ public:
         return obj;
     }
 
+    /********************************************************************/
+    int requiresImagery() { return FALSE; }
+
     /********************************************************************/
     int computeQuality(PLCInput *input, PLCLine *lineObj) {
 
         float *quality = lineObj->getNewQuality();
         unsigned short *cloud = lineObj->getCloud();
-        int width = lineObj->getWidth();
+        const std::vector<int> &spans = lineObj->getValidSpans();
 
-        for(int i=0; i < width; i++ )
+        for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
         {
-            switch( cloud[i] ) {
-
-              case 255:
-                quality[i] = -1.0;
-                break;
-
-              case 3:
-                quality[i] = fully_confident_cloud;
-                break;
-
-              case 2:
-                quality[i] = mostly_confident_cloud;
-                break;
-
-              case 1:
-                quality[i] = partially_confident_cloud;
-                break;
-
-              case 0:
-                quality[i] = not_cloud;
-                break;
+            for(int i=spans[iSpan]; i < spans[iSpan+1]; i++ )
+            {
+                switch( cloud[i] ) {
+
+                  case 255:
+                    quality[i] = -1.0;
+                    break;
+
+                  case 3:
+                    quality[i] = fully_confident_cloud;
+                    break;
+
+                  case 2:
+                    quality[i] = mostly_confident_cloud;
+                    break;
+
+                  case 1:
+                    quality[i] = partially_confident_cloud;
+                    break;
+
+                  case 0:
+                    quality[i] = not_cloud;
+                    break;
+                }
             }
         }
 
-        cloudHistogram.accumulate(quality, width);
+        cloudHistogram.accumulate(quality, spans);
 
         if( context->line == context->height - 1
             && context->verbose > 0 )
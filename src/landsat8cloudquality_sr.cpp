@@ -94,49 +94,55 @@ public:
         return obj;
     }
 
+    /********************************************************************/
+    int requiresImagery() { return FALSE; }
+
     /********************************************************************/
     int computeQuality(PLCInput *input, PLCLine *lineObj) {
 
         float *quality = lineObj->getNewQuality();
         unsigned short *value = lineObj->getCloud();
-        int width = lineObj->getWidth();
+        const std::vector<int> &spans = lineObj->getValidSpans();
 
-        for(int i=0; i < width; i++ )
+        for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
         {
-            if ( value[i] == 0 ) {
-                // Always skip pixels at edges with nodata cloud values
-                quality[i] = -1.0;
-            } else if ( value[i] & 0x2 ) {
-                quality[i] = cloud;
-            } else {
-                quality[i] = not_cloud;
-            }
-
-            if ( value[i] & 0x1 ) 
-                quality[i] *= cirrus;
-            if ( value[i] & 0x4 ) 
-                quality[i] *= adjacent;
-            if ( value[i] & 0x8 ) 
-                quality[i] *= shadow;
-
-            // Aerosol values take up two bits.
-            switch ( (value[i] & 0x10) + 2 * (value[i] & 0x20) ) {
-                case 0:
-                    quality[i] *= climatology_level_aerosol;
-                    break;
-                case 1:
-                    quality[i] *= low_aerosol;
-                    break;
-                case 2:
-                    quality[i] *= average_aerosol;
-                    break;
-                case 3:
-                    quality[i] *= high_aerosol;
-                    break;
+            for(int i=spans[iSpan]; i < spans[iSpan+1]; i++ )
+            {
+                if ( value[i] == 0 ) {
+                    // Always skip pixels at edges with nodata cloud values
+                    quality[i] = -1.0;
+                } else if ( value[i] & 0x2 ) {
+                    quality[i] = cloud;
+                } else {
+                    quality[i] = not_cloud;
+                }
+
+                if ( value[i] & 0x1 ) 
+                    quality[i] *= cirrus;
+                if ( value[i] & 0x4 ) 
+                    quality[i] *= adjacent;
+                if ( value[i] & 0x8 ) 
+                    quality[i] *= shadow;
+
+                // Aerosol values take up two bits.
+                switch ( (value[i] & 0x10) + 2 * (value[i] & 0x20) ) {
+                    case 0:
+                        quality[i] *= climatology_level_aerosol;
+                        break;
+                    case 1:
+                        quality[i] *= low_aerosol;
+                        break;
+                    case 2:
+                        quality[i] *= average_aerosol;
+                        break;
+                    case 3:
+                        quality[i] *= high_aerosol;
+                        break;
+                }
             }
         }
 
-        cloudHistogram.accumulate(quality, width);
+        cloudHistogram.accumulate(quality, spans);
 
         if( context->line == context->height - 1
             && context->verbose > 0 )
@@ -73,44 +73,50 @@ public:
         return obj;
     }
 
+    /********************************************************************/
+    int requiresImagery() { return FALSE; }
+
     /********************************************************************/
     int computeQuality(PLCInput *input, PLCLine *lineObj) {
 
         float *quality = lineObj->getNewQuality();
         unsigned short *value = lineObj->getCloud();
-        int width = lineObj->getWidth();
+        const std::vector<int> &spans = lineObj->getValidSpans();
 
-        for(int i=0; i < width; i++ )
+        for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
         {
-            switch( value[i] ) {
-
-              case 255:
-                quality[i] = -1.0;
-                break;
-
-              case 0:
-                quality[i] = clear;
-                break;
-
-              case 1:
-                quality[i] = water;
-                break;
-
-              case 2:
-                quality[i] = cloud_shadow;
-                break;
-
-              case 3:
-                quality[i] = snow;
-                break;
-
-              case 4:
-                quality[i] = cloud;
-                break;
+            for(int i=spans[iSpan]; i < spans[iSpan+1]; i++ )
+            {
+                switch( value[i] ) {
+
+                  case 255:
+                    quality[i] = -1.0;
+                    break;
+
+                  case 0:
+                    quality[i] = clear;
+                    break;
+
+                  case 1:
+                    quality[i] = water;
+                    break;
+
+                  case 2:
+                    quality[i] = cloud_shadow;
+                    break;
+
+                  case 3:
+                    quality[i] = snow;
+                    break;
+
+                  case 4:
+                    quality[i] = cloud;
+                    break;
+                }
             }
         }
 
-        cloudHistogram.accumulate(quality, width);
+        cloudHistogram.accumulate(quality, spans);
 
         if( context->line == context->height - 1
             && context->verbose > 0 )
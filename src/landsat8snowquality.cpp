@@ -73,39 +73,45 @@ public:
         return obj;
     }
 
+    /********************************************************************/
+    int requiresImagery() { return FALSE; }
+
     /********************************************************************/
     int computeQuality(PLCInput *input, PLCLine *lineObj) {
 
         float *quality = lineObj->getNewQuality();
         unsigned short *snow = lineObj->getCloud();
-        int width = lineObj->getWidth();
+        const std::vector<int> &spans = lineObj->getValidSpans();
 
-        for(int i=0; i < width; i++ )
+        for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
         {
-            // Snow bits
-            switch( snow[i] & 0x0c00 ) {
-              case 0x0c00:
-                quality[i] = fully_confident_snow;
-                break;
-
-              case 0x0800:
-                quality[i] = mostly_confident_snow;
-                break;
-
-              case 0x0400:
-                quality[i] = partially_confident_snow;
-                break;
-
-              default:
-                if( snow[i] & 0x7 ) // dead pixel markers.
-                    quality[i] = -1.0;
-                else
-                    quality[i] = not_snow;
-                break;
+            for(int i=spans[iSpan]; i < spans[iSpan+1]; i++ )
+            {
+                // Snow bits
+                switch( snow[i] & 0x0c00 ) {
+                  case 0x0c00:
+                    quality[i] = fully_confident_snow;
+                    break;
+
+                  case 0x0800:
+                    quality[i] = mostly_confident_snow;
+                    break;
+
+                  case 0x0400:
+                    quality[i] = partially_confident_snow;
+                    break;
+
+                  default:
+                    if( snow[i] & 0x7 ) // dead pixel markers.
+                        quality[i] = -1.0;
+                    else
+                        quality[i] = not_snow;
+                    break;
+                }
             }
         }
 
-        snowHistogram.accumulate(quality, width);
+        snowHistogram.accumulate(quality, spans);
 
         if( context->line == context->height - 1
             && context->verbose > 0 )
@@ -23,44 +23,63 @@ public:
     int inputFile;
     float quality;
     
+    // Best quality first, ties going to the earlier input.
     bool operator< (const InputQualityPair &rhs) const {
-        return this->quality > rhs.quality;
+        if( this->quality != rhs.quality )
+            return this->quality > rhs.quality;
+        return this->inputFile < rhs.inputFile;
     }
 };
 
 /************************************************************************/
-/*                           LineCompositor()                           */
+/*                        ComputeLineQualities()                        */
+/*                                                                      */
+/*      Run the quality method chain over a set of input lines.        */
 /************************************************************************/
 
-/**
- * \brief Line compositor.
- *
- * Composite one scanline.  The "quality_percentile" value determines what
- * input pixel to use based on a review of qualities - 100 means highest 
- * quality, and 50 would be median.
- */
-
-void LineCompositor(PLCContext *plContext, int line, PLCLine *lineObj)
+void ComputeLineQualities(PLCContext *plContext, int line,
+                          std::vector<PLCInput *> &inputs,
+                          std::vector<PLCLine *> &inputLines)
 
 {
-    std::vector<PLCLine *> inputLines;
-    unsigned int i, iPixel, width=lineObj->getWidth();
-    std::vector<float*> inputQualities;
+    unsigned int i, iPixel, width = inputLines.size() ? 
+        inputLines[0]->getWidth() : 0;
 
 /* -------------------------------------------------------------------- */
-/*      Read inputs.                                                    */
+/*      Inputs with a cached quality skip the cached methods, the       */
+/*      rest go through them all.                                       */
 /* -------------------------------------------------------------------- */
-    for(i = 0; i < plContext->inputFiles.size(); i++ )
-        inputLines.push_back(plContext->inputFiles[i]->getLine(line));
+    PLCQualityCache *cache = plContext->qualityCache;
+    int cachedMethods = 0;
+    std::vector<PLCInput *> uncachedInputs;
+    std::vector<PLCLine *> uncachedLines;
 
-/* -------------------------------------------------------------------- */
-/*      Compute qualities.                                              */
-/* -------------------------------------------------------------------- */
-    for(unsigned int iQM = 0; iQM < plContext->qualityMethods.size(); iQM++ )
+    if( cache != NULL )
+    {
+        cachedMethods = cache->getMethodCount();
+
+        for(i = 0; i < inputs.size(); i++)
+        {
+            if( cache->isCached(inputs[i]) )
+                cache->readLine(inputs[i], line, inputLines[i]);
+            else
+            {
+                uncachedInputs.push_back(inputs[i]);
+                uncachedLines.push_back(inputLines[i]);
+            }
+        }
+    }
+
+    for(int iQM = 0; iQM < (int) plContext->qualityMethods.size(); iQM++ )
     {
+        std::vector<PLCInput *> &qmInputs = 
+            iQM < cachedMethods ? uncachedInputs : inputs;
+        std::vector<PLCLine *> &qmLines = 
+            iQM < cachedMethods ? uncachedLines : inputLines;
+
         // TODO(check result status)
         plContext->qualityMethods[iQM]->computeStackQuality(
-            plContext, inputLines);
+            plContext, qmInputs, qmLines);
 
         if( plContext->isDebugLine(line) )
         {
@@ -68,12 +87,12 @@ void LineCompositor(PLCContext *plContext, int line, PLCLine *lineObj)
             {
                 if( plContext->isDebugPixel(iPixel, line) )
                 {
-                    for( i=0; i < inputLines.size(); i++ )
+                    for( i=0; i < qmLines.size(); i++ )
                     {
                         printf( "Input %d quality is %.5f @ %dx%d for "
                                 "quality phase %d.\n", 
-                                i+1,
-                                inputLines[i]->getNewQuality()[iPixel], 
+                                qmInputs[i]->getInputIndex()+1,
+                                qmLines[i]->getNewQuality()[iPixel], 
                                 iPixel, line, iQM );
                     }
                 }
@@ -82,10 +101,10 @@ void LineCompositor(PLCContext *plContext, int line, PLCLine *lineObj)
 
         // opportunity here to save intermediate "New" quality measures.
         // merge "newQuality()" back into "quality", and reset new Quality.
-        for(i = 0; i < inputLines.size(); i++)
+        for(i = 0; i < qmLines.size(); i++)
         {
             plContext->qualityMethods[iQM]->mergeQuality(
-                plContext->inputFiles[i], inputLines[i]);
+                qmInputs[i], qmLines[i]);
         }
 
         if( plContext->isDebugLine(line) )
@@ -94,49 +113,497 @@ void LineCompositor(PLCContext *plContext, int line, PLCLine *lineObj)
             {
                 if( plContext->isDebugPixel(iPixel, line) )
                 {
-                    for( i=0; i < inputLines.size(); i++ )
+                    for( i=0; i < qmLines.size(); i++ )
                     {
                         printf( "Input %d quality is %.5f @ %dx%d after merge "
                                 "for quality phase %d.\n", 
-                                i+1,
-                                inputLines[i]->getQuality()[iPixel], 
+                                qmInputs[i]->getInputIndex()+1,
+                                qmLines[i]->getQuality()[iPixel], 
                                 iPixel, line, iQM );
                     }
                 }
             }
         }
 
+        if( iQM == cachedMethods - 1 )
+        {
+            for(i = 0; i < uncachedLines.size(); i++)
+                cache->writeLine(uncachedInputs[i], line, uncachedLines[i]);
+        }
+    }
+}
+
+/************************************************************************/
+/*                          PruneCandidates()                           */
+/*                                                                      */
+/*      Drop inputs the candidate pre-pass found could not win in any   */
+/*      tile of this line.                                              */
+/************************************************************************/
+
+static void PruneCandidates(PLCContext *plContext, int line,
+                            std::vector<PLCInput *> &allInputs,
+                            std::vector<PLCInput *> &inputs)
+
+{
+    inputs.clear();
+
+    if( plContext->tileCandidates.size() == 0 )
+    {
+        inputs = allInputs;
+        return;
+    }
+
+    int tileRow = line / plContext->prepassTileSize;
+
+    for(unsigned int i = 0; i < allInputs.size(); i++ )
+    {
+        for(int tileCol = 0; tileCol < plContext->tileCols; tileCol++ )
+        {
+            if( plContext->isTileCandidate(allInputs[i], tileCol, tileRow) )
+            {
+                inputs.push_back(allInputs[i]);
+                break;
+            }
+        }
+    }
+
+    if( plContext->isDebugLine(line) )
+        printf("%d of %d inputs are candidates for line %d.\n",
+               (int) inputs.size(), (int) allInputs.size(), line);
+}
+
+/************************************************************************/
+/*                           GetInputLine()                             */
+/*                                                                      */
+/*      Read an input line with the bands needed for quality.  After    */
+/*      a pre-pass, pixels in tiles where the input is not a            */
+/*      candidate are marked invalid.                                   */
+/************************************************************************/
+
+static PLCLine *GetInputLine(PLCContext *plContext, PLCInput *input, 
+                             int line)
+
+{
+    // Inputs with a cached quality only need their validity for now.
+    int bands = PLC_QUALITY_BANDS;
+
+    if( plContext->qualityCache != NULL 
+        && plContext->qualityCache->isCached(input) )
+        bands = PLC_NO_BANDS;
+
+    PLCLine *lineObj = input->getLine(line, bands);
+
+    if( plContext->tileCandidates.size() == 0 )
+        return lineObj;
+
+    int width = lineObj->getWidth();
+    int tileSize = plContext->prepassTileSize;
+    int tileRow = line / tileSize;
+    int pruned = FALSE;
+    std::vector<GByte> mask(width, 255);
+
+    for(int tileCol = 0; tileCol < plContext->tileCols; tileCol++ )
+    {
+        if( plContext->isTileCandidate(input, tileCol, tileRow) )
+            continue;
+
+        int start = tileCol * tileSize;
+        int end = MIN(width, start + tileSize);
+
+        memset(&(mask[start]), 0, end - start);
+        pruned = TRUE;
+    }
+
+    if( pruned )
+    {
+        lineObj->setValidityFromMask(&(mask[0]));
+        lineObj->maskQuality(lineObj->getQuality());
     }
 
-    for(i = 0; i < plContext->inputFiles.size(); i++ )
+    return lineObj;
+}
+
+/************************************************************************/
+/*                          HasDeferredBands()                          */
+/*                                                                      */
+/*      Output bands not used by any quality method are not read with  */
+/*      the input lines.  Qualities and the source map are computed     */
+/*      first, and those bands are only read afterwards where each      */
+/*      input is used.  Inputs with a cached quality have all their     */
+/*      bands deferred.                                                 */
+/************************************************************************/
+
+static int HasDeferredBands(PLCContext *plContext, PLCLine *lineObj)
+
+{
+    if( plContext->qualityCache != NULL )
+        return TRUE;
+
+    for(int iBand = 0; iBand < lineObj->getBandCount(); iBand++ )
+    {
+        if( !plContext->isQualityBand(iBand) )
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/************************************************************************/
+/*                          GatherImagery()                             */
+/*                                                                      */
+/*      Second phase of select-then-gather: read the deferred bands     */
+/*      of each input only for the blocks containing pixels where it    */
+/*      is used.                                                        */
+/************************************************************************/
+
+static void GatherImagery(int line,
+                          std::vector<PLCInput *> &inputs,
+                          std::vector<PLCLine *> &inputLines,
+                          std::vector< std::vector<GByte> > &used)
+
+{
+    for(unsigned int i = 0; i < inputs.size(); i++ )
+    {
+        if( inputLines[i] != NULL )
+            inputs[i]->readImagery(inputLines[i], line, &(used[i][0]));
+    }
+}
+
+/************************************************************************/
+/*                         GetQualityBounds()                           */
+/*                                                                      */
+/*      Compute an upper bound on the final quality of each input,     */
+/*      the product of the bounds of all the quality methods.  This     */
+/*      is only possible if every method can give a bound, and it is    */
+/*      only useful if we just need the single best input for each     */
+/*      pixel, and not all the input qualities.                         */
+/************************************************************************/
+
+static int GetQualityBounds(PLCContext *plContext,
+                            std::vector<PLCInput *> &inputs,
+                            std::vector<double> &bounds)
+
+{
+    // Per input qualities are written out, except when updating, and
+    // the candidate store needs the runners-up.  Other pipelines and the
+    // stack statistics need every input line, and the quality cache
+    // needs every line of the inputs it writes.
+    if( plContext->averageBestRatio > 0.0 
+        || (plContext->qualityDS != NULL && !plContext->updateMode)
+        || plContext->candidateStoreDS != NULL
+        || plContext->statistics != NULL
+        || plContext->pipelines.size() > 0
+        || plContext->qualityCache != NULL )
+        return FALSE;
+
+    bounds.resize(inputs.size());
+
+    for(unsigned int i = 0; i < inputs.size(); i++ )
+    {
+        // Base quality is 1.0, unless raised for cloud polygons.
+        double inputBound = 1.0;
+
+        if( !EQUAL(inputs[i]->getCloudVectorFilename(),"") )
+            inputBound = MAX(inputBound, 
+                             inputs[i]->getQM("cloud_vector_quality", -1.0));
+
+        for(unsigned int iQM = 0; iQM < plContext->qualityMethods.size(); 
+            iQM++ )
+        {
+            double bound;
+
+            if( !plContext->qualityMethods[iQM]->getUpperBound(inputs[i],
+                                                               &bound) )
+                return FALSE;
+
+            // A negative quality at any stage is final.
+            if( bound <= 0.0 )
+                inputBound = 0.0;
+            else
+                inputBound *= bound;
+        }
+
+        bounds[i] = inputBound;
+    }
+
+    return TRUE;
+}
+
+/************************************************************************/
+/*                     ShortCircuitLineCompositor()                     */
+/*                                                                      */
+/*      Evaluate inputs in order of decreasing quality bound, keeping   */
+/*      the best input per pixel as we go, and stop as soon as every    */
+/*      pixel already has a better quality than any remaining input     */
+/*      could possibly achieve.  The result is the same as evaluating   */
+/*      all the inputs.                                                 */
+/************************************************************************/
+
+class InputBoundPair {
+public:
+    int inputFile;
+    double bound;
+    
+    bool operator< (const InputBoundPair &rhs) const {
+        if( this->bound != rhs.bound )
+            return this->bound > rhs.bound;
+        return this->inputFile < rhs.inputFile;
+    }
+};
+
+static void ShortCircuitLineCompositor(PLCContext *plContext, int line,
+                                       PLCLine *lineObj,
+                                       std::vector<PLCInput *> &inputs,
+                                       std::vector<double> &bounds,
+                                       int deferBands)
+
+{
+    unsigned int i, iPixel, width=lineObj->getWidth();
+    unsigned short *bestInput = lineObj->getSource();
+    float *bestQuality = lineObj->getQuality();
+    GByte *dst_alpha = lineObj->getAlpha();
+    std::vector<InputBoundPair> order(inputs.size());
+    std::vector<int> bestFile(width, -1);
+    std::vector<PLCLine *> inputLines(inputs.size(), NULL);
+
+    for(i = 0; i < inputs.size(); i++ )
+    {
+        order[i].inputFile = i;
+        order[i].bound = bounds[i];
+    }
+    std::sort(order.begin(), order.end());
+
+    for(iPixel=0; iPixel < width; iPixel++)
+    {
+        bestQuality[iPixel] = 0.0;
+        bestInput[iPixel] = 0;
+        dst_alpha[iPixel] = 0;
+    }
+
+    unsigned int iOrder;
+
+    for(iOrder = 0; iOrder < order.size(); iOrder++ )
+    {
+        int iFile = order[iOrder].inputFile;
+        double bound = order[iOrder].bound;
+
+        // Only qualities above zero are candidates.
+        if( bound <= 0.0 )
+            break;
+
+        // Allow a little slack for float rounding in the quality merge.
+        for(iPixel=0; iPixel < width; iPixel++)
+        {
+            if( bestQuality[iPixel] <= bound * 1.00001 )
+                break;
+        }
+        if( iPixel == width )
+            break;
+
+        std::vector<PLCInput *> oneInput(1, inputs[iFile]);
+        std::vector<PLCLine *> oneLine(1, 
+            GetInputLine(plContext, inputs[iFile], line));
+
+        inputLines[iFile] = oneLine[0];
+
+        ComputeLineQualities(plContext, line, oneInput, oneLine);
+
+        float *quality = inputLines[iFile]->getQuality();
+        const std::vector<int> &spans = inputLines[iFile]->getValidSpans();
+
+        for(unsigned int iSpan = 0; iSpan < spans.size(); iSpan += 2 )
+        {
+            for(iPixel=spans[iSpan]; iPixel < (unsigned) spans[iSpan+1]; 
+                iPixel++)
+            {
+                if( quality[iPixel] <= 0.0 )
+                    continue;
+
+                if( quality[iPixel] < bestQuality[iPixel] )
+                    continue;
+
+                if( quality[iPixel] == bestQuality[iPixel] 
+                    && iFile > bestFile[iPixel] )
+                    continue;
+
+                bestQuality[iPixel] = quality[iPixel];
+                bestFile[iPixel] = iFile;
+                bestInput[iPixel] = inputs[iFile]->getInputIndex()+1;
+            }
+        }
+    }
+
+    if( plContext->isDebugLine(line) )
+        printf("Evaluated %d of %d inputs for line %d.\n", 
+               iOrder, (int) inputs.size(), line);
+
+/* -------------------------------------------------------------------- */
+/*      Build the output from the winning inputs, reading their         */
+/*      deferred bands now.                                             */
+/* -------------------------------------------------------------------- */
+    if( deferBands )
+    {
+        std::vector< std::vector<GByte> > used(inputs.size());
+
+        for(i = 0; i < inputs.size(); i++ )
+            used[i].resize(width, 0);
+
+        for(iPixel=0; iPixel < width; iPixel++)
+        {
+            if( bestFile[iPixel] >= 0 )
+                used[bestFile[iPixel]][iPixel] = 1;
+        }
+
+        GatherImagery(line, inputs, inputLines, used);
+    }
+
+    for(iPixel=0; iPixel < width; iPixel++)
+    {
+        if( bestFile[iPixel] < 0 )
+            continue;
+
+        PLCLine *inputLine = inputLines[bestFile[iPixel]];
+
+        for(int iBand=0; iBand < lineObj->getBandCount(); iBand++)
+            lineObj->getBand(iBand)[iPixel] = 
+                inputLine->getBand(iBand)[iPixel];
+        dst_alpha[iPixel] = 255;
+    }
+
+    for(i = 0; i < inputs.size(); i++ )
+        delete inputLines[i];
+
+    for(iPixel=0; iPixel < width; iPixel++)
+    {
+        if( !plContext->isDebugPixel(iPixel, line) )
+            continue;
+
+        if( bestInput[iPixel] == 0 )
+            printf("No active candidates @ %d,%d\n", 
+                   iPixel, line );
+        else
+            printf("Best quality for %d,%d is %.5f from input %d.\n",
+                   iPixel, line, bestQuality[iPixel], bestInput[iPixel]);
+    }
+}
+
+/************************************************************************/
+/*                           SelectSources()                            */
+/*                                                                      */
+/*      Compute the qualities of one pipeline over the input lines,     */
+/*      and select the source(s) of each pixel into selected, with      */
+/*      those of pixel i at [selectedStart[i],selectedStart[i+1]).      */
+/*      selectedWeight holds the blending weight of each.               */
+/************************************************************************/
+
+static void SelectSources(PLCContext *plContext, int line, PLCLine *lineObj,
+                          std::vector<PLCInput *> &inputs,
+                          std::vector<PLCLine *> &inputLines,
+                          std::vector<int> &selectedStart,
+                          std::vector<int> &selected,
+                          std::vector<float> &selectedWeight)
+
+{
+    unsigned int i, iPixel, width=lineObj->getWidth();
+    std::vector<float*> inputQualities;
+
+/* -------------------------------------------------------------------- */
+/*      Compute qualities.                                              */
+/* -------------------------------------------------------------------- */
+    ComputeLineQualities(plContext, line, inputs, inputLines);
+
+    for(i = 0; i < inputs.size(); i++ )
         inputQualities.push_back(inputLines[i]->getQuality());
 
 /* -------------------------------------------------------------------- */
 /*      Establish which is the best source for each pixel.              */
 /* -------------------------------------------------------------------- */
     std::vector<InputQualityPair> candidates;
-    candidates.resize(plContext->inputFiles.size());
+    candidates.resize(inputs.size());
     unsigned short *bestInput = lineObj->getSource();
     float *bestQuality = lineObj->getQuality();
+    int candidateCount = plContext->candidateCount;
+    std::vector<float> storeLine;
 
-    for(iPixel=0; iPixel < width; iPixel++)
+    selectedStart.assign(width+1, 0);
+    selected.clear();
+    selectedWeight.clear();
+
+    // Sources for the candidate store in the first candidateCount
+    // rows, and their qualities in the following ones.
+    if( plContext->candidateStoreDS != NULL )
+        storeLine.resize(2 * candidateCount * width, 0.0);
+
+/* -------------------------------------------------------------------- */
+/*      Collect the positive qualities of each pixel, walking only      */
+/*      the valid spans of each input line.  activeStart/active hold    */
+/*      the candidate inputs of each pixel, in input order.             */
+/* -------------------------------------------------------------------- */
+    std::vector<int> activeStart(width+1, 0);
+    std::vector<int> active;
+
+    for(int pass = 0; pass < 2; pass++ )
     {
-        int activeCandidates = 0;
+        std::vector<int> activeNext;
 
-        for(i = 0; i < plContext->inputFiles.size(); i++ )
+        if( pass == 1 )
+        {
+            for(iPixel=0; iPixel < width; iPixel++)
+                activeStart[iPixel+1] += activeStart[iPixel];
+            active.resize(activeStart[width]);
+            activeNext.assign(activeStart.begin(), activeStart.end()-1);
+        }
+
+        for(i = 0; i < inputs.size(); i++ )
         {
-            if( inputQualities[i][iPixel] > 0.0 )
+            const std::vector<int> &spans = inputLines[i]->getValidSpans();
+
+            for(unsigned int iSpan = 0; iSpan < spans.size(); iSpan += 2 )
             {
-                candidates[activeCandidates].inputFile = i;
-                candidates[activeCandidates].quality = 
-                    inputQualities[i][iPixel];
-                activeCandidates++;
+                for(iPixel=spans[iSpan]; iPixel < (unsigned) spans[iSpan+1];
+                    iPixel++)
+                {
+                    if( inputQualities[i][iPixel] <= 0.0 )
+                        continue;
+
+                    if( pass == 0 )
+                        activeStart[iPixel+1]++;
+                    else
+                        active[activeNext[iPixel]++] = i;
+                }
             }
         }
+    }
+
+    for(iPixel=0; iPixel < width; iPixel++)
+    {
+        int activeCandidates = 0;
+
+        for(int k = activeStart[iPixel]; k < activeStart[iPixel+1]; k++ )
+        {
+            candidates[activeCandidates].inputFile = active[k];
+            candidates[activeCandidates].quality = 
+                inputQualities[active[k]][iPixel];
+            activeCandidates++;
+        }
+
+        int averageCount = 
+            (int) floor(activeCandidates * plContext->averageBestRatio);
+
+        averageCount = MIN(averageCount, activeCandidates);
+        if( averageCount == 0 && activeCandidates > 0 )
+            averageCount = 1;
+
+        // Only the candidates we use need to be found and ordered.
+        int topCount = averageCount;
+
+        if( storeLine.size() > 0 )
+            topCount = MAX(topCount, MIN(candidateCount, activeCandidates));
 
         if( activeCandidates > 1 )
-            std::sort(candidates.begin(), 
-                      candidates.begin() + activeCandidates);
+            std::partial_sort(candidates.begin(), 
+                              candidates.begin() + topCount,
+                              candidates.begin() + activeCandidates);
 
         if( activeCandidates == 0 )
         {
@@ -146,7 +613,19 @@ void LineCompositor(PLCContext *plContext, int line, PLCLine *lineObj)
         else
         {
             bestQuality[iPixel] = candidates[0].quality;
-            bestInput[iPixel] = candidates[0].inputFile+1;
+            bestInput[iPixel] = 
+                inputs[candidates[0].inputFile]->getInputIndex()+1;
+        }
+
+        if( storeLine.size() > 0 )
+        {
+            for(int k = 0; k < MIN(candidateCount, activeCandidates); k++)
+            {
+                storeLine[k*width + iPixel] = 
+                    inputs[candidates[k].inputFile]->getInputIndex()+1;
+                storeLine[(candidateCount+k)*width + iPixel] = 
+                    candidates[k].quality;
+            }
         }
             
         if( bestInput[iPixel] != 0 )
@@ -163,57 +642,365 @@ void LineCompositor(PLCContext *plContext, int line, PLCLine *lineObj)
         }
 
 /* -------------------------------------------------------------------- */
-/*      Build output with best pixel source(s) for each pixel.          */
+/*      Note the best pixel source(s) for each pixel.                   */
 /* -------------------------------------------------------------------- */
-        GByte *dst_alpha = lineObj->getAlpha();
-        int averageCount = (int) floor(activeCandidates * plContext->averageBestRatio);
-
-        if( averageCount == 0 && activeCandidates > 0 )
-            averageCount = 1;
-
-        if( averageCount == 0 )
-            dst_alpha[iPixel] = 0;
-        else
+        for(int i=0; i < averageCount; i++)
         {
-            for(int iBand=0; iBand < lineObj->getBandCount(); iBand++)
-            {
-                float *dst_pixels = lineObj->getBand(iBand);
-
-                dst_pixels[iPixel] = 0.0;
-
-                for(int i=0; i < averageCount; i++)
-                {
-                    dst_pixels[iPixel] += 
-                        inputLines[candidates[i].inputFile]->getBand(iBand)[iPixel];
-                }
-                if( averageCount > 0 )
-                    dst_pixels[iPixel] /= averageCount;
-            }
-            dst_alpha[iPixel] = 255;
+            selected.push_back(candidates[i].inputFile);
+            selectedWeight.push_back(plContext->averageQualityWeighted
+                                     ? candidates[i].quality : 1.0);
         }
+        selectedStart[iPixel+1] = selected.size();
     }
 
-    plContext->qualityHistogram.accumulate(bestQuality, width);
+    if( storeLine.size() > 0 )
+        WriteCandidateStoreLine(plContext, line, storeLine);
 
 /* -------------------------------------------------------------------- */
 /*      Consider writing input qualities.                               */
 /* -------------------------------------------------------------------- */
-    if( plContext->qualityDS != NULL )
+    if( plContext->qualityDS != NULL && !plContext->updateMode )
     {
+        std::vector<float> noQuality(width, -1.0);
+        unsigned int iActive = 0;
+
         for(i = 0; i < plContext->inputFiles.size(); i++ )
         {
+            float *quality = &(noQuality[0]);
+
+            if( iActive < inputs.size() 
+                && inputs[iActive] == plContext->inputFiles[i] )
+                quality = inputLines[iActive++]->getQuality();
+
             CPLErr eErr = plContext->qualityDS->GetRasterBand(i+2)->
                 RasterIO(GF_Write, 0, line, width, 1, 
-                         inputLines[i]->getQuality(), width, 1, GDT_Float32, 
+                         quality, width, 1, GDT_Float32, 
                          0, 0);
             if( eErr != CE_None )
                 exit(1);
         }
     }
+}
+
+/************************************************************************/
+/*                          BuildOutputLine()                           */
+/*                                                                      */
+/*      Build output with the selected pixel source(s) for each pixel, */
+/*      blending several by their weights.  Bands are done one at a     */
+/*      time, with the band of each input looked up once.               */
+/************************************************************************/
+
+static void BuildOutputLine(PLCLine *lineObj,
+                            std::vector<PLCLine *> &inputLines,
+                            std::vector<int> &selectedStart,
+                            std::vector<int> &selected,
+                            std::vector<float> &selectedWeight)
+
+{
+    unsigned int iPixel, width=lineObj->getWidth();
+    GByte *dst_alpha = lineObj->getAlpha();
+    std::vector<float> weightSum(width, 0.0);
+    std::vector<float*> srcBands(inputLines.size());
+
+    for(iPixel=0; iPixel < width; iPixel++)
+    {
+        for(int k=selectedStart[iPixel]; k < selectedStart[iPixel+1]; k++)
+            weightSum[iPixel] += selectedWeight[k];
+
+        dst_alpha[iPixel] = 
+            selectedStart[iPixel+1] > selectedStart[iPixel] ? 255 : 0;
+    }
+
+    for(int iBand=0; iBand < lineObj->getBandCount(); iBand++)
+    {
+        float *dst_pixels = lineObj->getBand(iBand);
+
+        // Only inputs selected somewhere have their band looked up.
+        std::fill(srcBands.begin(), srcBands.end(), (float *) NULL);
+        for(unsigned int k=0; k < selected.size(); k++)
+        {
+            if( srcBands[selected[k]] == NULL )
+                srcBands[selected[k]] = 
+                    inputLines[selected[k]]->getBand(iBand);
+        }
+
+        for(iPixel=0; iPixel < width; iPixel++)
+        {
+            int start = selectedStart[iPixel];
+            int end = selectedStart[iPixel+1];
+
+            if( end - start == 1 )
+                dst_pixels[iPixel] = srcBands[selected[start]][iPixel];
+            else if( end > start )
+            {
+                float sum = 0.0;
+
+                for(int k=start; k < end; k++)
+                    sum += selectedWeight[k] 
+                        * srcBands[selected[k]][iPixel];
+                dst_pixels[iPixel] = sum / weightSum[iPixel];
+            }
+        }
+    }
+}
+
+/************************************************************************/
+/*                           LineCompositor()                           */
+/************************************************************************/
+
+/**
+ * \brief Line compositor.
+ *
+ * Composite one scanline.  The "quality_percentile" value determines what
+ * input pixel to use based on a review of qualities - 100 means highest 
+ * quality, and 50 would be median.
+ *
+ * The input lines are read once, and composited by each pipeline in turn
+ * into its own current output line.
+ */
+
+void LineCompositor(PLCContext *plContext, int line, PLCLine *lineObj)
+
+{
+    std::vector<PLCInput *> inputs;
+    std::vector<PLCLine *> inputLines;
+    unsigned int i, p, iPixel, width=lineObj->getWidth();
 
 /* -------------------------------------------------------------------- */
-/*      Cleanup input buffers.                                          */
+/*      Read the inputs whose footprint intersects this line.  The      */
+/*      rest are not opened, read or evaluated at all.                  */
 /* -------------------------------------------------------------------- */
-    for(i = 0; i < plContext->inputFiles.size(); i++ )
+    std::vector<PLCInput *> allInputs;
+
+    plContext->getLineInputs(line, allInputs);
+    PruneCandidates(plContext, line, allInputs, inputs);
+
+/* -------------------------------------------------------------------- */
+/*      If all quality methods can bound the quality of each input,     */
+/*      we can often avoid reading most of them.                        */
+/* -------------------------------------------------------------------- */
+    std::vector<double> bounds;
+    int deferBands = HasDeferredBands(plContext, lineObj);
+
+    if( GetQualityBounds(plContext, inputs, bounds) )
+    {
+        ShortCircuitLineCompositor(plContext, line, lineObj, inputs, bounds,
+                                   deferBands);
+
+        for(i = 0; i < allInputs.size(); i++ )
+        {
+            if( line == allInputs[i]->getYOff() + allInputs[i]->getYSize() - 1 )
+                allInputs[i]->releaseDS();
+        }
+        return;
+    }
+
+    for(i = 0; i < inputs.size(); i++ )
+        inputLines.push_back(GetInputLine(plContext, inputs[i], line));
+
+/* -------------------------------------------------------------------- */
+/*      Each pipeline starts from the input qualities as read.          */
+/* -------------------------------------------------------------------- */
+    std::vector<PLCContext *> contexts(1, plContext);
+    std::vector<PLCLine *> outputLines(1, lineObj);
+    std::vector< std::vector<float> > initialQualities;
+
+    for(p = 0; p < plContext->pipelines.size(); p++ )
+    {
+        contexts.push_back(plContext->pipelines[p]);
+        outputLines.push_back(plContext->pipelines[p]->thisOutputLine);
+    }
+
+    if( contexts.size() > 1 )
+    {
+        initialQualities.resize(inputs.size());
+        for(i = 0; i < inputs.size(); i++ )
+            initialQualities[i].assign(inputLines[i]->getQuality(),
+                                       inputLines[i]->getQuality() + width);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Select the source(s) of each pixel for each pipeline.           */
+/* -------------------------------------------------------------------- */
+    std::vector< std::vector<int> > selectedStart(contexts.size());
+    std::vector< std::vector<int> > selected(contexts.size());
+    std::vector< std::vector<float> > selectedWeight(contexts.size());
+    std::vector< std::vector<float> > statisticsWeights;
+
+    for(p = 0; p < contexts.size(); p++ )
+    {
+        if( p > 0 )
+        {
+            for(i = 0; i < inputs.size(); i++ )
+                memcpy(inputLines[i]->getQuality(), 
+                       &(initialQualities[i][0]), sizeof(float) * width);
+        }
+
+        if( EQUAL(contexts[p]->binKey,"") )
+        {
+            SelectSources(contexts[p], line, outputLines[p], inputs, 
+                          inputLines, selectedStart[p], selected[p],
+                          selectedWeight[p]);
+
+            // The stack statistics are weighted by the final qualities
+            // of the main pipeline.
+            if( p == 0 && plContext->statistics != NULL )
+                plContext->statistics->getWeights(inputLines, 
+                                                  statisticsWeights);
+            continue;
+        }
+
+        // A time bin only sees its own inputs.  Map its selections back
+        // to the index of the input line.
+        std::vector<PLCInput *> binInputs;
+        std::vector<PLCLine *> binLines;
+        std::vector<int> binMap;
+
+        for(i = 0; i < inputs.size(); i++ )
+        {
+            if( contexts[p]->isBinInput(inputs[i]) )
+            {
+                binInputs.push_back(inputs[i]);
+                binLines.push_back(inputLines[i]);
+                binMap.push_back(i);
+            }
+        }
+
+        SelectSources(contexts[p], line, outputLines[p], binInputs, binLines,
+                      selectedStart[p], selected[p], selectedWeight[p]);
+
+        for(i = 0; i < selected[p].size(); i++ )
+            selected[p][i] = binMap[selected[p][i]];
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Read bands not needed for quality where any pipeline uses      */
+/*      them.                                                           */
+/* -------------------------------------------------------------------- */
+    if( deferBands )
+    {
+        std::vector< std::vector<GByte> > used(inputs.size());
+
+        for(i = 0; i < inputs.size(); i++ )
+            used[i].resize(width, 0);
+
+        for(p = 0; p < contexts.size(); p++ )
+        {
+            for(iPixel=0; iPixel < width; iPixel++)
+            {
+                for(int k=selectedStart[p][iPixel]; 
+                    k < selectedStart[p][iPixel+1]; k++)
+                    used[selected[p][k]][iPixel] = 1;
+            }
+
+            for(i = 0; i < contexts[p]->qualityMethods.size(); i++ )
+                contexts[p]->qualityMethods[i]->addUsedPixels(inputs, used);
+        }
+
+        for(i = 0; i < statisticsWeights.size(); i++ )
+        {
+            for(iPixel=0; iPixel < width; iPixel++)
+            {
+                if( statisticsWeights[i][iPixel] > 0.0 )
+                    used[i][iPixel] = 1;
+            }
+        }
+
+        GatherImagery(line, inputs, inputLines, used);
+    }
+
+    for(p = 0; p < contexts.size(); p++ )
+    {
+        BuildOutputLine(outputLines[p], inputLines, selectedStart[p], 
+                        selected[p], selectedWeight[p]);
+
+        for(i = 0; i < contexts[p]->qualityMethods.size(); i++ )
+            contexts[p]->qualityMethods[i]->finishLine(contexts[p], line,
+                                                       inputs, inputLines);
+    }
+
+    if( plContext->statistics != NULL )
+        plContext->statistics->processLine(line, inputLines, 
+                                           statisticsWeights);
+
+/* -------------------------------------------------------------------- */
+/*      Cleanup input buffers, and close inputs we are done with.       */
+/* -------------------------------------------------------------------- */
+    for(i = 0; i < inputs.size(); i++ )
         delete inputLines[i];
+
+    for(i = 0; i < allInputs.size(); i++ )
+    {
+        if( line == allInputs[i]->getYOff() + allInputs[i]->getYSize() - 1 )
+            allInputs[i]->releaseDS();
+    }
+}
+
+/************************************************************************/
+/*                        UpdateLineCompositor()                        */
+/*                                                                      */
+/*      Composite the new inputs of an update, and keep each new        */
+/*      winner only where it beats the best quality already recorded   */
+/*      in the quality output.  lineObj arrives holding the existing    */
+/*      output line.                                                    */
+/************************************************************************/
+
+void UpdateLineCompositor(PLCContext *plContext, int line, PLCLine *lineObj)
+
+{
+    int iPixel, iBand, width = lineObj->getWidth();
+
+/* -------------------------------------------------------------------- */
+/*      Keep the existing output, sources and best quality.             */
+/* -------------------------------------------------------------------- */
+    std::vector<unsigned short> oldSource(width);
+    std::vector<float> oldQuality(width);
+    std::vector<GByte> oldAlpha(lineObj->getAlpha(), 
+                                lineObj->getAlpha() + width);
+    std::vector< std::vector<float> > oldBands(lineObj->getBandCount());
+
+    CPLErr eErr = plContext->sourceTraceDS->GetRasterBand(1)->RasterIO(
+        GF_Read, 0, line, width, 1, 
+        &(oldSource[0]), width, 1, GDT_UInt16, 0, 0);
+    if( eErr == CE_None )
+        eErr = plContext->qualityDS->GetRasterBand(1)->RasterIO(
+            GF_Read, 0, line, width, 1, 
+            &(oldQuality[0]), width, 1, GDT_Float32, 0, 0);
+    if( eErr != CE_None )
+        exit(1);
+
+    for( iBand = 0; iBand < lineObj->getBandCount(); iBand++ )
+        oldBands[iBand].assign(lineObj->getBand(iBand), 
+                               lineObj->getBand(iBand) + width);
+
+/* -------------------------------------------------------------------- */
+/*      Composite the new inputs, then restore the existing pixels      */
+/*      they do not beat.  Ties go to the existing mosaic.              */
+/* -------------------------------------------------------------------- */
+    LineCompositor(plContext, line, lineObj);
+
+    unsigned short *source = lineObj->getSource();
+    float *quality = lineObj->getQuality();
+    GByte *alpha = lineObj->getAlpha();
+    int replaced = 0;
+
+    for( iPixel = 0; iPixel < width; iPixel++ )
+    {
+        if( source[iPixel] != 0 && quality[iPixel] > oldQuality[iPixel] )
+        {
+            source[iPixel] += plContext->sourceIndexOffset;
+            replaced++;
+            continue;
+        }
+
+        source[iPixel] = oldSource[iPixel];
+        quality[iPixel] = oldQuality[iPixel];
+        alpha[iPixel] = oldAlpha[iPixel];
+
+        for( iBand = 0; iBand < lineObj->getBandCount(); iBand++ )
+            lineObj->getBand(iBand)[iPixel] = oldBands[iBand][iPixel];
+    }
+
+    if( plContext->isDebugLine(line) )
+        printf("Update replaced %d pixels of line %d.\n", replaced, line);
 }
@@ -0,0 +1,229 @@
+/**
+ * Copyright 2016, Planet Labs, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compositor.h"
+
+/************************************************************************/
+/*                            MedoidQuality                             */
+/*                                                                      */
+/*      Favour the observation of each pixel with the smallest summed   */
+/*      spectral distance to the other candidates, optionally weighted  */
+/*      by their quality so far.  Deep stacks are only compared with    */
+/*      max_references evenly spaced candidates.                        */
+/************************************************************************/
+
+class MedoidQuality : public QualityMethodBase 
+{
+    int qualityWeighted;
+    int maxReferences;
+
+public:
+    MedoidQuality() : QualityMethodBase("medoid") {}
+    ~MedoidQuality() {}
+
+    /********************************************************************/
+    QualityMethodBase *create(PLCContext* context, WJElement node) {
+        MedoidQuality *obj = new MedoidQuality();
+
+        obj->qualityWeighted = FALSE;
+        obj->maxReferences = 64;
+
+        if( node != NULL )
+        {
+            obj->qualityWeighted = 
+                WJEBool(node, "quality_weighted", WJE_GET, FALSE);
+            obj->maxReferences = 
+                WJEInt32(node, "max_references", WJE_GET, obj->maxReferences);
+        }
+
+        CPLDebug("PLC", "Medoid Quality: weighted=%d, max references=%d.",
+                 obj->qualityWeighted, obj->maxReferences);
+        return obj;
+    }
+
+    /********************************************************************/
+    void mergeQuality(PLCInput *input, PLCLine *line) {
+        float *quality = line->getQuality();
+        float *newQuality = line->getNewQuality();
+        const std::vector<int> &spans = line->getValidSpans();
+
+        // The new quality replaces the old, which it was weighted by.
+        for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
+        {
+            for(int i=spans[iSpan]; i < spans[iSpan+1]; i++)
+                quality[i] = newQuality[i];
+        }
+
+        line->setNewQualityUniform(1.0);
+    }
+
+    /********************************************************************/
+    int isStackWide() { return TRUE; }
+
+    /********************************************************************/
+    int requiresCloud() { return FALSE; }
+
+    /********************************************************************/
+    int computeQuality(PLCInput *input, PLCLine *lineObj) {
+        // Everything is done in computeStackQuality().
+        return TRUE;
+    }
+
+    /********************************************************************/
+    static float distance(const float *a, const float *b, int bandCount) {
+        float sum = 0.0;
+
+        for(int iBand=0; iBand < bandCount; iBand++)
+            sum += (a[iBand] - b[iBand]) * (a[iBand] - b[iBand]);
+
+        return sqrt(sum);
+    }
+
+    /********************************************************************/
+    int computeStackQuality(PLCContext *context, 
+                            std::vector<PLCInput*>& inputs,
+                            std::vector<PLCLine*>& lines) {
+
+        unsigned int i, n = lines.size();
+        int a, k, bandCount = n > 0 ? lines[0]->getBandCount() : 0;
+        std::vector<float*> inputQualities, newQualities;
+
+        // Band pointers of each line, looked up once, input major.
+        std::vector<float*> bands(n * bandCount);
+
+        // Candidates of the current pixel, and their band values packed
+        // together so the pairwise distances walk contiguous memory.
+        std::vector<int> candidates(n);
+        std::vector<float> stack(n * bandCount);
+        std::vector<float> weights(n);
+        std::vector<double> distanceSums(n);
+        std::vector<int> references;
+
+        for(i = 0; i < n; i++ )
+        {
+            inputQualities.push_back(lines[i]->getQuality());
+            newQualities.push_back(lines[i]->getNewQuality());
+
+            for(int iBand=0; iBand < bandCount; iBand++)
+                bands[i*bandCount + iBand] = lines[i]->getBand(iBand);
+
+            const std::vector<int> &spans = lines[i]->getValidSpans();
+            for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
+            {
+                for(int iPixel=spans[iSpan]; iPixel < spans[iSpan+1]; iPixel++)
+                    newQualities[i][iPixel] = -1.0;
+            }
+        }
+
+        for(int iPixel=0; iPixel < context->width; iPixel++)
+        {
+            int activeCandidates = 0;
+
+            for(i = 0; i < n; i++ )
+            {
+                if( !lines[i]->isValid(iPixel) 
+                    || inputQualities[i][iPixel] <= 0.0 )
+                    continue;
+
+                float **lineBands = &(bands[i*bandCount]);
+                float *packed = &(stack[activeCandidates*bandCount]);
+
+                for(int iBand=0; iBand < bandCount; iBand++)
+                    packed[iBand] = lineBands[iBand][iPixel];
+
+                weights[activeCandidates] = 
+                    qualityWeighted ? inputQualities[i][iPixel] : 1.0;
+                distanceSums[activeCandidates] = 0.0;
+                candidates[activeCandidates++] = i;
+            }
+
+            if( activeCandidates == 0 )
+                continue;
+
+/* -------------------------------------------------------------------- */
+/*      Sum the weighted distances to every other candidate, each       */
+/*      pair only computed once.                                        */
+/* -------------------------------------------------------------------- */
+            double referenceWeight = 0.0;
+
+            if( maxReferences <= 0 || activeCandidates <= maxReferences )
+            {
+                for(a = 0; a < activeCandidates; a++)
+                {
+                    const float *pixelA = &(stack[a*bandCount]);
+
+                    for(int b = a+1; b < activeCandidates; b++)
+                    {
+                        float d = distance(pixelA, &(stack[b*bandCount]),
+                                           bandCount);
+
+                        distanceSums[a] += weights[b] * d;
+                        distanceSums[b] += weights[a] * d;
+                    }
+                    referenceWeight += weights[a];
+                }
+            }
+
+/* -------------------------------------------------------------------- */
+/*      Deep stacks are compared with evenly spaced references only.    */
+/* -------------------------------------------------------------------- */
+            else
+            {
+                references.resize(maxReferences);
+                for(k = 0; k < maxReferences; k++)
+                {
+                    references[k] = 
+                        (int) (((GIntBig) k * activeCandidates) / maxReferences);
+                    referenceWeight += weights[references[k]];
+                }
+
+                for(a = 0; a < activeCandidates; a++)
+                {
+                    const float *pixelA = &(stack[a*bandCount]);
+
+                    for(k = 0; k < maxReferences; k++)
+                    {
+                        int r = references[k];
+
+                        if( r != a )
+                            distanceSums[a] += weights[r] * 
+                                distance(pixelA, &(stack[r*bandCount]), 
+                                         bandCount);
+                    }
+                }
+            }
+
+            // 1.0 for a candidate identical to all others, falling with
+            // the mean distance to them.
+            int debug = context->isDebugPixel(iPixel, context->line);
+
+            for(a = 0; a < activeCandidates; a++)
+            {
+                newQualities[candidates[a]][iPixel] = 
+                    1.0 / (1.0 + distanceSums[a] / referenceWeight);
+
+                if( debug )
+                    printf("Input %d summed distance is %.5f @ %dx%d.\n",
+                           inputs[candidates[a]]->getInputIndex()+1,
+                           distanceSums[a], iPixel, context->line);
+            }
+        }
+
+        return TRUE;
+    }
+};
+
+static MedoidQuality medoidQualityTemplateInstance;
@@ -24,18 +24,35 @@
 
 class PercentileQuality : public QualityMethodBase 
 {
+    PLCContext *context;
     PLCInput *input;
     std::vector<float> targetQuality;
     double percentileRatio; 
 
+    // Further percentiles from the same ordering, each written to its
+    // own output.  percentileSource holds the source (input index + 1,
+    // or 0 for none) of each pixel for each of them.
+    std::vector<double> extraRatios;
+    std::vector<CPLString> extraFilenames;
+    std::vector<GDALDataset *> extraDS;
+    std::vector<unsigned short> percentileSource;
+
 public:
-    PercentileQuality() : QualityMethodBase("percentile") {}
-    ~PercentileQuality() {}
+    PercentileQuality() : QualityMethodBase("percentile") { context = NULL; }
+    ~PercentileQuality() {
+        for(unsigned int i=0; i < extraDS.size(); i++)
+        {
+            if( extraDS[i] != NULL )
+                GDALClose(extraDS[i]);
+        }
+    }
 
     /********************************************************************/
     QualityMethodBase *create(PLCContext* context, WJElement node) {
         PercentileQuality *obj = new PercentileQuality();
 
+        obj->context = context;
+
         if( node == NULL )
         {
             CPLString default_percentile;
@@ -62,6 +79,39 @@ public:
         {
             obj->percentileRatio = WJEDouble(node, "quality_percentile", 
                                              WJE_GET, 50.0) / 100.0;
+
+            // With a list of percentiles the first drives the selection
+            // for the output, and the others go to percentile_outputs.
+            WJElement percentiles = 
+                WJEArray(node, "quality_percentiles", WJE_GET);
+            WJElement outputs = WJEArray(node, "percentile_outputs", WJE_GET);
+            CPLString path;
+
+            for(int i=0; percentiles != NULL && i < percentiles->count; i++)
+            {
+                path.Printf("quality_percentiles[%d]", i);
+                double ratio = WJEDouble(node, path, WJE_GET, 50.0) / 100.0;
+
+                if( i == 0 )
+                {
+                    obj->percentileRatio = ratio;
+                    continue;
+                }
+
+                path.Printf("percentile_outputs[%d]", i-1);
+                obj->extraRatios.push_back(ratio);
+                obj->extraFilenames.push_back(
+                    WJEString(node, path, WJE_GET, ""));
+            }
+
+            if( (outputs == NULL ? 0 : outputs->count) 
+                != (int) obj->extraRatios.size() )
+                CPLError(CE_Fatal, CPLE_AppDefined,
+                         "percentile_outputs needs one output for each "
+                         "of quality_percentiles after the first.");
+
+            obj->extraDS.resize(obj->extraRatios.size(), NULL);
+
             CPLDebug("PLC", "Percentile Quality: %.2f.", obj->percentileRatio);
         }
         return obj;
@@ -71,74 +121,219 @@ public:
     void mergeQuality(PLCInput *input, PLCLine *line) {
         float *quality = line->getQuality();
         float *newQuality = line->getNewQuality();
+        const std::vector<int> &spans = line->getValidSpans();
 
         // In this case we copy the new quality over the old since it already incorporates
         // the old. 
-        for(int i=0; i < line->getWidth(); i++)
+        for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
         {
-            quality[i] = newQuality[i];
-            newQuality[i] = 1.0;
+            for(int i=spans[iSpan]; i < spans[iSpan+1]; i++)
+                quality[i] = newQuality[i];
         }
+
+        line->setNewQualityUniform(1.0);
     }
 
+    /********************************************************************/
+    int isStackWide() { return TRUE; }
+
+    /********************************************************************/
+    int requiresImagery() { return FALSE; }
+
+    /********************************************************************/
+    int requiresCloud() { return FALSE; }
+
     /********************************************************************/
     int computeQuality(PLCInput *input, PLCLine *lineObj) {
         float *newQuality = lineObj->getNewQuality();
         float *oldQuality = lineObj->getQuality();
+        const std::vector<int> &spans = lineObj->getValidSpans();
 
-        for(int i=lineObj->getWidth()-1; i >= 0; i--)
+        for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
         {
-            if( oldQuality[i] <= 0 )
-                newQuality[i] = -1;
-            else
-                newQuality[i] = 1.0 - fabs(oldQuality[i] - targetQuality[i]); // rescale?
+            for(int i=spans[iSpan]; i < spans[iSpan+1]; i++)
+            {
+                if( oldQuality[i] <= 0 )
+                    newQuality[i] = -1;
+                else
+                    newQuality[i] = 1.0 - fabs(oldQuality[i] - targetQuality[i]); // rescale?
+            }
         }
         
         return TRUE;
     }
 
     /********************************************************************/
-    int computeStackQuality(PLCContext *context, std::vector<PLCLine*>& lines) {
+    int computeStackQuality(PLCContext *context, 
+                            std::vector<PLCInput*>& inputs,
+                            std::vector<PLCLine*>& lines) {
 
-        unsigned int i;
+        unsigned int i, k;
+        int width = context->width;
         std::vector<float*> inputQualities;
 
-        targetQuality.resize(context->width);
+        targetQuality.resize(width);
+        percentileSource.assign(extraRatios.size() * width, 0);
 
-        for(i = 0; i < context->inputFiles.size(); i++ )
+        for(i = 0; i < lines.size(); i++ )
             inputQualities.push_back(lines[i]->getQuality());
 
-        std::vector<float> pixelQualities;
-        pixelQualities.resize(context->width);
+        // Qualities are sorted with the input they came from, so every
+        // percentile is picked from the one ordering.
+        std::vector< std::pair<float,int> > pixelQualities;
+        pixelQualities.resize(lines.size());
 
-        for(int iPixel=0; iPixel < context->width; iPixel++)
+        for(int iPixel=0; iPixel < width; iPixel++)
         {
             int activeCandidates = 0;
 
             for(i=0; i < inputQualities.size(); i++)
             {
                 if( inputQualities[i][iPixel] > 0.0 )
-                    pixelQualities[activeCandidates++] = inputQualities[i][iPixel];
+                    pixelQualities[activeCandidates++] = 
+                        std::make_pair(inputQualities[i][iPixel], (int) i);
             }
 
-            if( activeCandidates > 1 )
+            if( activeCandidates == 0 )
             {
+                targetQuality[iPixel] = -1.0;
+                continue;
+            }
+
+            if( activeCandidates > 1 )
                 std::sort(pixelQualities.begin(),
                           pixelQualities.begin()+activeCandidates);
                 
-                int bestCandidate = 
+            int bestCandidate = 
+                MAX(0,MIN(activeCandidates-1,
+                          ((int) floor(activeCandidates*percentileRatio))));
+            targetQuality[iPixel] = pixelQualities[bestCandidate].first;
+
+            for(k = 0; k < extraRatios.size(); k++)
+            {
+                int candidate = 
                     MAX(0,MIN(activeCandidates-1,
-                              ((int) floor(activeCandidates*percentileRatio))));
-                targetQuality[iPixel] = pixelQualities[bestCandidate];
-                
+                              ((int) floor(activeCandidates*extraRatios[k]))));
+                percentileSource[k*width + iPixel] = 
+                    inputs[pixelQualities[candidate].second]->getInputIndex()
+                    + 1;
             }
-            else if( activeCandidates == 1 )
-                targetQuality[iPixel] = pixelQualities[0];
-            else
-                targetQuality[iPixel] = -1.0;
         }
 
-        return QualityMethodBase::computeStackQuality(context, lines);
+        return QualityMethodBase::computeStackQuality(context, inputs, lines);
+    }
+
+    /********************************************************************/
+    // Position of each input index in the inputs of the line, or -1.
+    std::vector<int> getPositions(std::vector<PLCInput*>& inputs) {
+        std::vector<int> position(context->inputFiles.size(), -1);
+
+        for(unsigned int i=0; i < inputs.size(); i++)
+            position[inputs[i]->getInputIndex()] = i;
+
+        return position;
+    }
+
+    /********************************************************************/
+    void addUsedPixels(std::vector<PLCInput*>& inputs,
+                       std::vector< std::vector<GByte> > &used) {
+        std::vector<int> position = getPositions(inputs);
+
+        for(unsigned int i=0; i < percentileSource.size(); i++)
+        {
+            int source = percentileSource[i];
+
+            if( source != 0 && position[source-1] >= 0 )
+                used[position[source-1]][i % context->width] = 1;
+        }
+    }
+
+    /********************************************************************/
+    void finishLine(PLCContext *context, int line,
+                    std::vector<PLCInput*>& inputs,
+                    std::vector<PLCLine*>& lines) {
+        std::vector<int> position = getPositions(inputs);
+        int width = context->width;
+
+        for(unsigned int k=0; k < extraRatios.size(); k++)
+        {
+            if( extraDS[k] == NULL )
+            {
+                extraDS[k] = (GDALDataset *) 
+                    GDALOpen(extraFilenames[k], GA_Update);
+                if( extraDS[k] == NULL )
+                    exit(1);
+
+                if( extraDS[k]->GetRasterXSize() != width
+                    || extraDS[k]->GetRasterYSize() != context->height
+                    || extraDS[k]->GetRasterCount() 
+                       != context->outputDS->GetRasterCount() )
+                    CPLError(CE_Fatal, CPLE_AppDefined,
+                             "Percentile output %s does not match the size "
+                             "and bands of the output.",
+                             extraFilenames[k].c_str());
+            }
+
+            GDALDataset *DS = extraDS[k];
+            PLCLine lineObj(width);
+            GByte *alpha = lineObj.getAlpha();
+            std::vector<int> bands;
+            int iBand;
+
+            for(iBand=0; iBand < DS->GetRasterCount(); iBand++)
+            {
+                if( DS->GetRasterBand(iBand+1)->GetColorInterpretation() 
+                    != GCI_AlphaBand )
+                    bands.push_back(iBand);
+            }
+
+            for(int iPixel=0; iPixel < width; iPixel++)
+            {
+                int source = percentileSource[k*width + iPixel];
+                PLCLine *sourceLine = NULL;
+
+                if( source != 0 && position[source-1] >= 0 )
+                    sourceLine = lines[position[source-1]];
+
+                if( sourceLine == NULL || !sourceLine->isValid(iPixel) )
+                {
+                    alpha[iPixel] = 0;
+                    continue;
+                }
+
+                for(unsigned int i=0; i < bands.size(); i++)
+                    lineObj.getBand(bands[i])[iPixel] = 
+                        sourceLine->getBand(bands[i])[iPixel];
+                alpha[iPixel] = 255;
+            }
+
+            for(iBand=0; iBand < DS->GetRasterCount(); iBand++)
+            {
+                CPLErr eErr;
+                GDALRasterBand *band = DS->GetRasterBand(iBand+1);
+
+                if( band->GetColorInterpretation() == GCI_AlphaBand )
+                    eErr = band->RasterIO(
+                        GF_Write, 0, line, width, 1,
+                        alpha, width, 1, GDT_Byte, 0, 0);
+                else
+                    eErr = band->RasterIO(
+                        GF_Write, 0, line, width, 1,
+                        lineObj.getBand(iBand), width, 1, GDT_Float32, 0, 0);
+
+                if( eErr != CE_None )
+                    exit(1);
+            }
+        }
+    }
+
+    /********************************************************************/
+    void flush() {
+        for(unsigned int i=0; i < extraDS.size(); i++)
+        {
+            if( extraDS[i] != NULL )
+                extraDS[i]->FlushCache();
+        }
     }
 };
 
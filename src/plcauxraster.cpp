@@ -0,0 +1,267 @@
+/**
+ * Purpose: Reader for auxiliary rasters (cloud masks, quality files) that
+ *          may be at a coarser resolution than the imagery they go with.
+ *
+ * Copyright 2016, Planet Labs, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compositor.h"
+
+/************************************************************************/
+/*                            PLCAuxRaster()                            */
+/************************************************************************/
+
+PLCAuxRaster::PLCAuxRaster(const char *filename, const char *resampling)
+
+{
+    this->filename = filename;
+    DS = NULL;
+    targetWidth = 0;
+    targetHeight = 0;
+    ratio = 1;
+    cachedRow[0] = cachedRow[1] = -1;
+
+    if( resampling == NULL || EQUAL(resampling,"nearest") )
+        bilinear = FALSE;
+    else if( EQUAL(resampling,"bilinear") )
+        bilinear = TRUE;
+    else
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "Unsupported resampling '%s' for %s, "
+                 "use nearest or bilinear.",
+                 resampling, filename);
+}
+
+/************************************************************************/
+/*                           ~PLCAuxRaster()                            */
+/************************************************************************/
+
+PLCAuxRaster::~PLCAuxRaster()
+
+{
+    if( DS != NULL )
+        GDALClose(DS);
+}
+
+/************************************************************************/
+/*                             Initialize()                             */
+/*                                                                      */
+/*      Open the raster and establish the integer ratio between the     */
+/*      target (imagery) grid and this raster.  The raster may be       */
+/*      short a partial coarse pixel on the right and bottom edges.     */
+/************************************************************************/
+
+void PLCAuxRaster::Initialize(int targetWidth, int targetHeight)
+
+{
+    if( DS == NULL )
+    {
+        DS = (GDALDataset *) GDALOpen(filename, GA_ReadOnly);
+        if( DS == NULL )
+            exit(1);
+    }
+
+    this->targetWidth = targetWidth;
+    this->targetHeight = targetHeight;
+
+    int auxWidth = DS->GetRasterXSize();
+    int auxHeight = DS->GetRasterYSize();
+
+    ratio = 0;
+    for( int r = MAX(1,targetWidth / auxWidth);
+         r <= targetWidth / auxWidth + 1; r++ )
+    {
+        if( (targetWidth + r - 1) / r == auxWidth
+            && (targetHeight + r - 1) / r == auxHeight )
+        {
+            ratio = r;
+            break;
+        }
+    }
+
+    if( ratio == 0 )
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "Size of %s (%dx%d) is not an integer fraction of "
+                 "the imagery size (%dx%d).",
+                 filename.c_str(), auxWidth, auxHeight,
+                 targetWidth, targetHeight);
+
+    if( ratio > 1 )
+        CPLDebug("PLC", "%s is at 1/%d of imagery resolution, %s expansion.",
+                 filename.c_str(), ratio, bilinear ? "bilinear" : "nearest");
+
+/* -------------------------------------------------------------------- */
+/*      Precompute horizontal sampling.  For nearest we only use        */
+/*      xIndex, for bilinear xIndex is the left coarse pixel and        */
+/*      xWeight the weight of the right one.                            */
+/* -------------------------------------------------------------------- */
+    xIndex.resize(targetWidth);
+    xWeight.resize(targetWidth);
+    expanded.resize(targetWidth);
+
+    for( int x = 0; x < targetWidth; x++ )
+    {
+        if( !bilinear )
+        {
+            xIndex[x] = x / ratio;
+            xWeight[x] = 0.0;
+            continue;
+        }
+
+        double fx = (x + 0.5) / ratio - 0.5;
+        int x0 = (int) floor(fx);
+
+        if( x0 < 0 )
+        {
+            xIndex[x] = 0;
+            xWeight[x] = 0.0;
+        }
+        else if( x0 >= auxWidth - 1 )
+        {
+            xIndex[x] = auxWidth - 1;
+            xWeight[x] = 0.0;
+        }
+        else
+        {
+            xIndex[x] = x0;
+            xWeight[x] = (float) (fx - x0);
+        }
+    }
+
+    cachedRow[0] = cachedRow[1] = -1;
+}
+
+/************************************************************************/
+/*                            getCoarseRow()                            */
+/*                                                                      */
+/*      Return the requested coarse row, reading it only if it is not   */
+/*      already held in one of the two row slots.                       */
+/************************************************************************/
+
+float *PLCAuxRaster::getCoarseRow(int coarseLine, int slot)
+
+{
+    for( int i = 0; i < 2; i++ )
+    {
+        if( cachedRow[i] == coarseLine )
+            return &(rowCache[i][0]);
+    }
+
+    int auxWidth = DS->GetRasterXSize();
+
+    rowCache[slot].resize(auxWidth);
+
+    CPLErr eErr = DS->GetRasterBand(1)->RasterIO(
+        GF_Read, 0, coarseLine, auxWidth, 1,
+        &(rowCache[slot][0]), auxWidth, 1, GDT_Float32, 0, 0);
+    if( eErr != CE_None )
+        exit(1);
+
+    cachedRow[slot] = coarseLine;
+
+    return &(rowCache[slot][0]);
+}
+
+/************************************************************************/
+/*                             expandRow()                              */
+/************************************************************************/
+
+void PLCAuxRaster::expandRow(float *coarse, float *dst)
+
+{
+    if( !bilinear )
+    {
+        for( int x = 0; x < targetWidth; x++ )
+            dst[x] = coarse[xIndex[x]];
+        return;
+    }
+
+    for( int x = 0; x < targetWidth; x++ )
+    {
+        int x0 = xIndex[x];
+        float w = xWeight[x];
+
+        if( w == 0.0 )
+            dst[x] = coarse[x0];
+        else
+            dst[x] = coarse[x0] * (1.0f - w) + coarse[x0+1] * w;
+    }
+}
+
+/************************************************************************/
+/*                              readLine()                              */
+/*                                                                      */
+/*      Read one line at the target resolution into the supplied        */
+/*      buffer of dataType.  Each coarse row is read only once while    */
+/*      the target lines it covers are processed.                       */
+/************************************************************************/
+
+void PLCAuxRaster::readLine(int line, void *data, GDALDataType dataType)
+
+{
+    CPLAssert( DS != NULL );
+
+    if( ratio == 1 )
+    {
+        CPLErr eErr = DS->GetRasterBand(1)->RasterIO(
+            GF_Read, 0, line, targetWidth, 1,
+            data, targetWidth, 1, dataType, 0, 0);
+        if( eErr != CE_None )
+            exit(1);
+        return;
+    }
+
+    float *result = &(expanded[0]);
+
+    if( !bilinear )
+    {
+        expandRow(getCoarseRow(line / ratio, 0), result);
+    }
+    else
+    {
+        int auxHeight = DS->GetRasterYSize();
+        double fy = (line + 0.5) / ratio - 0.5;
+        int y0 = (int) floor(fy);
+        float w = (float) (fy - y0);
+
+        if( y0 < 0 )
+        {
+            y0 = 0;
+            w = 0.0;
+        }
+        else if( y0 >= auxHeight - 1 )
+        {
+            y0 = auxHeight - 1;
+            w = 0.0;
+        }
+
+        // Keep the upper row in the slot it was not read into last.
+        int slot = (cachedRow[1] == y0) ? 1 : 0;
+        expandRow(getCoarseRow(y0, slot), result);
+
+        if( w != 0.0 )
+        {
+            std::vector<float> lower(targetWidth);
+            expandRow(getCoarseRow(y0+1, 1-slot), &(lower[0]));
+
+            for( int x = 0; x < targetWidth; x++ )
+                result[x] = result[x] * (1.0f - w) + lower[x] * w;
+        }
+    }
+
+    GDALCopyWords(result, GDT_Float32, sizeof(float),
+                  data, dataType, GDALGetDataTypeSizeBytes(dataType),
+                  targetWidth);
+}
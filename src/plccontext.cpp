@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include "compositor.h"
 
 /************************************************************************/
@@ -29,10 +30,35 @@ PLCContext::PLCContext()
     quiet = FALSE;
     verbose = 0;
     averageBestRatio = 0.0;
+    averageQualityWeighted = FALSE;
     sourceSieveThreshold = 0;
+    sourceSieveMethod = "streaming";
+    sourceSieveWindow = 0;
+    updateMode = FALSE;
+    candidateCount = 3;
+    candidateStoreDS = NULL;
+    candidateQualityDS = NULL;
+    qualityCache = NULL;
+    statistics = NULL;
+    blockCacheMB = 256;
+    blockCacheDiskMB = 10240;
+    blockCache = NULL;
+    sourceIndexOffset = 0;
+    checkpointInterval = 512;
+    resume = FALSE;
+    linesWritten = 0;
+    warpErrorThreshold = 0.125;
+    warpCacheMB = 0;
+    decimation = 1;
+    prepassDecimation = 0;
+    prepassTileSize = 256;
+    prepassMargin = 0.2;
+    tileCols = 0;
+    tileRows = 0;
     line = -1;
     lastOutputLine = NULL;
     thisOutputLine = NULL;
+    inputTree = NULL;
 }
 
 /************************************************************************/
@@ -44,6 +70,145 @@ PLCContext::~PLCContext()
 {
     delete lastOutputLine;
     delete thisOutputLine;
+
+    for( unsigned int i = 0; i < pipelines.size(); i++ )
+        delete pipelines[i];
+
+    if( inputTree != NULL )
+        CPLQuadTreeDestroy(inputTree);
+}
+
+/************************************************************************/
+/*                          buildInputIndex()                           */
+/*                                                                      */
+/*      Build a spatial index of input footprints on the output grid    */
+/*      so we only touch inputs that intersect the region being         */
+/*      processed.                                                      */
+/************************************************************************/
+
+static void InputFootprint(const void *feature, CPLRectObj *bounds)
+
+{
+    PLCInput *input = (PLCInput *) feature;
+
+    bounds->minx = input->getXOff();
+    bounds->miny = input->getYOff();
+    bounds->maxx = input->getXOff() + input->getXSize();
+    bounds->maxy = input->getYOff() + input->getYSize();
+}
+
+void PLCContext::buildInputIndex()
+
+{
+    CPLRectObj globalBounds;
+
+    globalBounds.minx = 0;
+    globalBounds.miny = 0;
+    globalBounds.maxx = width;
+    globalBounds.maxy = height;
+
+    if( inputTree != NULL )
+        CPLQuadTreeDestroy(inputTree);
+
+    inputTree = CPLQuadTreeCreate(&globalBounds, InputFootprint);
+
+    for( unsigned int i=0; i < inputFiles.size(); i++ )
+        CPLQuadTreeInsert(inputTree, inputFiles[i]);
+}
+
+/************************************************************************/
+/*                          getWindowInputs()                           */
+/*                                                                      */
+/*      Return the inputs intersecting a window of the output, in       */
+/*      input order.                                                    */
+/************************************************************************/
+
+static bool InputIndexLess(PLCInput *a, PLCInput *b)
+{
+    return a->getInputIndex() < b->getInputIndex();
+}
+
+void PLCContext::getWindowInputs(int xOff, int yOff, int xSize, int ySize,
+                                 std::vector<PLCInput*> &inputs)
+
+{
+    CPLAssert( inputTree != NULL );
+
+    CPLRectObj aoi;
+    int count = 0;
+
+    // Search on pixel centers so touching footprints don't match.
+    aoi.minx = xOff + 0.5;
+    aoi.maxx = xOff + xSize - 0.5;
+    aoi.miny = yOff + 0.5;
+    aoi.maxy = yOff + ySize - 0.5;
+
+    void **results = CPLQuadTreeSearch(inputTree, &aoi, &count);
+
+    inputs.clear();
+    for( int i = 0; i < count; i++ )
+        inputs.push_back((PLCInput *) results[i]);
+    CPLFree(results);
+
+    std::sort(inputs.begin(), inputs.end(), InputIndexLess);
+}
+
+/************************************************************************/
+/*                           getLineInputs()                            */
+/*                                                                      */
+/*      Return the inputs intersecting an output line, in input order.  */
+/************************************************************************/
+
+void PLCContext::getLineInputs(int line, std::vector<PLCInput*> &inputs)
+
+{
+    getWindowInputs(0, line, width, 1, inputs);
+}
+
+/************************************************************************/
+/*                          isTileCandidate()                           */
+/*                                                                      */
+/*      Did the candidate pre-pass find that this input could win       */
+/*      somewhere in this tile?  Always true without a pre-pass.        */
+/************************************************************************/
+
+int PLCContext::isTileCandidate(PLCInput *input, int tileCol, int tileRow)
+
+{
+    if( tileCandidates.size() == 0 )
+        return TRUE;
+
+    return tileCandidates[(tileRow * tileCols + tileCol) * inputFiles.size()
+                          + input->getInputIndex()] & PLC_TILE_CANDIDATE;
+}
+
+/************************************************************************/
+/*                           isRemovedInput()                           */
+/************************************************************************/
+
+int PLCContext::isRemovedInput(int inputIndex)
+
+{
+    for( unsigned int i = 0; i < removeInputs.size(); i++ )
+    {
+        if( removeInputs[i] == inputIndex + 1 )
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/************************************************************************/
+/*                             isBinInput()                             */
+/************************************************************************/
+
+int PLCContext::isBinInput(PLCInput *input)
+
+{
+    if( EQUAL(binKey,"") )
+        return TRUE;
+
+    return EQUAL(input->getBinValue(binKey), binValue);
 }
 
 /************************************************************************/
@@ -101,6 +266,20 @@ PLCLine *PLCContext::getNextOutputLine()
 
 void PLCContext::writeOutputLine(bool postProcessing)
 
+{
+    writeOutputLine(thisOutputLine, line, postProcessing);
+}
+
+/************************************************************************/
+/*                          writeOutputLine()                           */
+/*                                                                      */
+/*      Write a line object, not necessarily the current one, such as   */
+/*      a line held back by the streaming sieve.                        */
+/************************************************************************/
+
+void PLCContext::writeOutputLine(PLCLine *lineObj, int line, 
+                                 bool postProcessing)
+
 {
     CPLAssert( outputDS != NULL );
     
@@ -114,11 +293,11 @@ void PLCContext::writeOutputLine(bool postProcessing)
         if( band->GetColorInterpretation() == GCI_AlphaBand )
             eErr = band->RasterIO(
                 GF_Write, 0, line, width, 1, 
-                thisOutputLine->getAlpha(), width, 1, GDT_Byte, 0, 0);
+                lineObj->getAlpha(), width, 1, GDT_Byte, 0, 0);
         else
             eErr = band->RasterIO(
                 GF_Write, 0, line, width, 1, 
-                thisOutputLine->getBand(i), width, 1, GDT_Float32, 0, 0);
+                lineObj->getBand(i), width, 1, GDT_Float32, 0, 0);
 
         if( eErr != CE_None )
             exit(1);
@@ -127,17 +306,37 @@ void PLCContext::writeOutputLine(bool postProcessing)
         {
             eErr = sourceTraceDS->GetRasterBand(1)->
                 RasterIO(GF_Write, 0, line, width, 1, 
-                         thisOutputLine->getSource(), width, 1, GDT_UInt16, 
+                         lineObj->getSource(), width, 1, GDT_UInt16, 
                          0, 0);
         }
         if( qualityDS != NULL && !postProcessing)
         {
             eErr = qualityDS->GetRasterBand(1)->
                 RasterIO(GF_Write, 0, line, width, 1, 
-                         thisOutputLine->getQuality(), width, 1, GDT_Float32, 
+                         lineObj->getQuality(), width, 1, GDT_Float32, 
                          0, 0);
         }
     }
+
+/* -------------------------------------------------------------------- */
+/*      Account for the final quality, and note the progress for        */
+/*      checkpoints.                                                    */
+/* -------------------------------------------------------------------- */
+    if( !postProcessing )
+    {
+        qualityHistogram.accumulate(lineObj->getQuality(), width);
+
+        linesWritten = line + 1;
+        if( !EQUAL(checkpointFilename,"") )
+            lastWrittenSource.assign(lineObj->getSource(),
+                                     lineObj->getSource() + width);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Render the other products from the same sources.                */
+/* -------------------------------------------------------------------- */
+    for( i=0; i < (int) products.size(); i++ )
+        products[i]->renderLine(this, line, lineObj->getSource());
 }
 
 /************************************************************************/
@@ -178,6 +377,66 @@ int PLCContext::isDebugLine(int line)
     return FALSE;
 }
 
+/************************************************************************/
+/*                           AppendJsonKey()                            */
+/*                                                                      */
+/*      Append a canonical text form of a JSON element, fetched from    */
+/*      its parent with path, to key.                                   */
+/************************************************************************/
+
+static void AppendJsonKey(CPLString &key, WJElement parent, WJElement node,
+                          const char *path)
+
+{
+    switch( node->type )
+    {
+      case WJR_TYPE_OBJECT:
+      case WJR_TYPE_ARRAY:
+      {
+          int i = 0;
+
+          key += (node->type == WJR_TYPE_OBJECT) ? "{" : "[";
+          for( WJElement child = node->child; child != NULL; 
+               child = child->next, i++ )
+          {
+              CPLString childPath;
+
+              if( node->type == WJR_TYPE_OBJECT )
+              {
+                  childPath = child->name;
+                  key += childPath + ":";
+              }
+              else
+                  childPath.Printf("[%d]", i);
+
+              AppendJsonKey(key, node, child, childPath);
+              key += ",";
+          }
+          key += (node->type == WJR_TYPE_OBJECT) ? "}" : "]";
+          break;
+      }
+
+      case WJR_TYPE_STRING:
+        key += CPLString("\"") + WJEString(parent, path, WJE_GET, "") + "\"";
+        break;
+
+      case WJR_TYPE_NUMBER:
+        key += CPLString().Printf("%.17g", 
+                                  WJEDouble(parent, path, WJE_GET, 0.0));
+        break;
+
+      case WJR_TYPE_TRUE:
+      case WJR_TYPE_FALSE:
+      case WJR_TYPE_BOOL:
+        key += WJEBool(parent, path, WJE_GET, FALSE) ? "true" : "false";
+        break;
+
+      default:
+        key += "null";
+        break;
+    }
+}
+
 /************************************************************************/
 /*                      initializeQualityMethods()                      */
 /************************************************************************/
@@ -226,6 +485,16 @@ void PLCContext::initializeQualityMethods(WJElement compositors)
             qualityMethods.push_back(method);
         }
 
+        // Any strategy parameter may affect any method.
+        for( unsigned int i = 0; i < qualityMethods.size(); i++ )
+        {
+            CPLString key = qualityMethods[i]->getName();
+
+            for( int j = 0; j < strategyParams.size(); j++ )
+                key += CPLString("|") + strategyParams[j];
+            qualityMethodKeys.push_back(key);
+        }
+
         return;
     }
 
@@ -247,7 +516,60 @@ void PLCContext::initializeQualityMethods(WJElement compositors)
                      methodClass.c_str());
 
         qualityMethods.push_back(method);
+
+        CPLString key;
+        AppendJsonKey(key, compositors, method_def, 
+                      CPLString().Printf("[%d]", 
+                                         (int) qualityMethodKeys.size()));
+        qualityMethodKeys.push_back(key);
+    }
+}
+
+/************************************************************************/
+/*                           isQualityBand()                            */
+/*                                                                      */
+/*      Is this imagery band (from 0) used by any quality method,      */
+/*      of this or any other pipeline?                                  */
+/************************************************************************/
+
+int PLCContext::isQualityBand(int band)
+
+{
+    for( unsigned int i = 0; i < qualityMethods.size(); i++ )
+    {
+        if( qualityMethods[i]->requiresBand(band) )
+            return TRUE;
+    }
+
+    for( unsigned int i = 0; i < pipelines.size(); i++ )
+    {
+        if( pipelines[i]->isQualityBand(band) )
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/************************************************************************/
+/*                          qualityUsesCloud()                          */
+/************************************************************************/
+
+int PLCContext::qualityUsesCloud()
+
+{
+    for( unsigned int i = 0; i < qualityMethods.size(); i++ )
+    {
+        if( qualityMethods[i]->requiresCloud() )
+            return TRUE;
+    }
+
+    for( unsigned int i = 0; i < pipelines.size(); i++ )
+    {
+        if( pipelines[i]->qualityUsesCloud() )
+            return TRUE;
     }
+
+    return FALSE;
 }
 
 /************************************************************************/
@@ -268,8 +590,72 @@ void PLCContext::initializeFromJson(WJElement doc)
         WJEString(doc, "quality_output", WJE_GET, qualityFilename);
     averageBestRatio = 
         WJEDouble(doc, "average_best_ratio", WJE_GET, 0.0);
+    averageQualityWeighted = 
+        EQUAL(WJEString(doc, "average_best_weighting", WJE_GET, "equal"),
+              "quality");
     sourceSieveThreshold = (int)
         WJEInt32(doc, "source_sieve_threshold", WJE_GET, 0);
+    sourceSieveMethod = 
+        WJEString(doc, "source_sieve_method", WJE_GET, sourceSieveMethod);
+    sourceSieveWindow = (int)
+        WJEInt32(doc, "source_sieve_window", WJE_GET, sourceSieveWindow);
+    warpErrorThreshold = 
+        WJEDouble(doc, "warp_error_threshold", WJE_GET, warpErrorThreshold);
+    warpCacheMB = (int)
+        WJEInt32(doc, "warp_cache_mb", WJE_GET, warpCacheMB);
+    prepassDecimation = (int)
+        WJEInt32(doc, "prepass_decimation", WJE_GET, prepassDecimation);
+    prepassTileSize = (int)
+        WJEInt32(doc, "prepass_tile_size", WJE_GET, prepassTileSize);
+    prepassMargin = 
+        WJEDouble(doc, "prepass_margin", WJE_GET, prepassMargin);
+    prepassCandidatesFilename = 
+        WJEString(doc, "prepass_candidates", WJE_GET, 
+                  prepassCandidatesFilename);
+    updateMode = WJEBool(doc, "update", WJE_GET, updateMode);
+    qualityCacheDir = 
+        WJEString(doc, "quality_cache_dir", WJE_GET, qualityCacheDir);
+    statisticsFilename = 
+        WJEString(doc, "statistics_output", WJE_GET, statisticsFilename);
+    checkpointFilename = 
+        WJEString(doc, "checkpoint_file", WJE_GET, checkpointFilename);
+    checkpointInterval = (int) 
+        WJEInt32(doc, "checkpoint_interval", WJE_GET, checkpointInterval);
+    resume = WJEBool(doc, "resume", WJE_GET, resume);
+    blockCacheDir = 
+        WJEString(doc, "block_cache_dir", WJE_GET, blockCacheDir);
+    blockCacheMB = (int) 
+        WJEInt32(doc, "block_cache_mb", WJE_GET, blockCacheMB);
+    blockCacheDiskMB = (int) 
+        WJEInt32(doc, "block_cache_disk_mb", WJE_GET, blockCacheDiskMB);
+    candidateStoreFilename = 
+        WJEString(doc, "candidate_store", WJE_GET, candidateStoreFilename);
+    candidateCount = (int)
+        WJEInt32(doc, "candidate_count", WJE_GET, candidateCount);
+
+    WJElement removeArray = WJEArray(doc, "remove_inputs", WJE_GET);
+    for( int i = 0; removeArray != NULL && i < removeArray->count; i++ )
+    {
+        CPLString path;
+        path.Printf("remove_inputs[%d]", i);
+        removeInputs.push_back(WJEInt32(doc, path, WJE_GET, 0));
+    }
+
+    renderSourceTraceFilename = 
+        WJEString(doc, "render_from_source_trace", WJE_GET, 
+                  renderSourceTraceFilename);
+
+    WJElement product_def = NULL;
+    while( (product_def = _WJEObject(doc, "products[]", WJE_GET, 
+                                     &product_def)) )
+    {
+        PLCProduct *product = new PLCProduct();
+        product->outputFilename = 
+            WJEString(product_def, "output_file", WJE_GET, "");
+        product->inputKey = 
+            WJEString(product_def, "input_key", WJE_GET, "");
+        products.push_back(product);
+    }
 
     initializeQualityMethods( WJEArray(doc, "compositors", WJE_GET) );
     
@@ -281,4 +667,65 @@ void PLCContext::initializeFromJson(WJElement doc)
         input->ConsumeJson(input_def);
         inputFiles.push_back(input);
     }
+
+/* -------------------------------------------------------------------- */
+/*      Other pipelines composite the same inputs into their own        */
+/*      outputs.                                                        */
+/* -------------------------------------------------------------------- */
+    WJElement pipeline_def = NULL;
+    while( (pipeline_def = _WJEObject(doc, "pipelines[]", WJE_GET, 
+                                      &pipeline_def)) )
+    {
+        PLCContext *pipeline = new PLCContext();
+
+        pipeline->outputFilename = 
+            WJEString(pipeline_def, "output_file", WJE_GET, "");
+        pipeline->sourceTraceFilename = 
+            WJEString(pipeline_def, "source_trace", WJE_GET, "");
+        pipeline->qualityFilename = 
+            WJEString(pipeline_def, "quality_output", WJE_GET, "");
+        pipeline->averageBestRatio = 
+            WJEDouble(pipeline_def, "average_best_ratio", WJE_GET, 0.0);
+        pipeline->averageQualityWeighted = 
+            EQUAL(WJEString(pipeline_def, "average_best_weighting", WJE_GET,
+                            "equal"), "quality");
+        pipeline->inputFiles = inputFiles;
+
+        WJElement compositors = WJEArray(pipeline_def, "compositors", WJE_GET);
+        if( compositors == NULL )
+            CPLError(CE_Fatal, CPLE_AppDefined,
+                     "Did not find 'compositors' for pipeline %d.",
+                     (int) pipelines.size() + 1);
+
+        pipeline->initializeQualityMethods(compositors);
+        pipelines.push_back(pipeline);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Time bins are pipelines with the main compositors, each only    */
+/*      considering the inputs of its bin.                              */
+/* -------------------------------------------------------------------- */
+    CPLString binKey = WJEString(doc, "bin_key", WJE_GET, "bin");
+
+    WJElement bin_def = NULL;
+    while( (bin_def = _WJEObject(doc, "bins[]", WJE_GET, &bin_def)) )
+    {
+        PLCContext *pipeline = new PLCContext();
+
+        pipeline->outputFilename = 
+            WJEString(bin_def, "output_file", WJE_GET, "");
+        pipeline->sourceTraceFilename = 
+            WJEString(bin_def, "source_trace", WJE_GET, "");
+        pipeline->qualityFilename = 
+            WJEString(bin_def, "quality_output", WJE_GET, "");
+        pipeline->averageBestRatio = averageBestRatio;
+        pipeline->averageQualityWeighted = averageQualityWeighted;
+        pipeline->binKey = binKey;
+        pipeline->binValue = WJEString(bin_def, "bin", WJE_GET, "");
+        pipeline->inputFiles = inputFiles;
+
+        pipeline->initializeQualityMethods(
+            WJEArray(doc, "compositors", WJE_GET));
+        pipelines.push_back(pipeline);
+    }
 }
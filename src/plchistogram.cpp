@@ -79,6 +79,19 @@ void PLCHistogram::accumulate(float *quality, int count)
     actualCount += count;
 }
 
+/************************************************************************/
+/*                             accumulate()                             */
+/*                                                                      */
+/*      Accumulate only the valid spans of a line.                      */
+/************************************************************************/
+
+void PLCHistogram::accumulate(float *quality, const std::vector<int> &spans)
+
+{
+    for( unsigned int iSpan = 0; iSpan < spans.size(); iSpan += 2 )
+        accumulate(quality + spans[iSpan], spans[iSpan+1] - spans[iSpan]);
+}
+
 /************************************************************************/
 /*                               report()                               */
 /************************************************************************/
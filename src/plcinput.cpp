@@ -15,7 +15,8 @@
  */
 
 #include "compositor.h"
-
+#include "gdalwarper.h"
+#include "ogr_spatialref.h"
 
 /************************************************************************/
 /*                              PLCInput()                              */
@@ -24,7 +25,16 @@
 PLCInput::PLCInput(int inputIndex)
 {
     DS = NULL;
-    cloudDS = NULL;
+    cloudRaster = NULL;
+    cloudVectorMask = NULL;
+    maskFlags = GMF_ALL_VALID;
+    xOff = 0;
+    yOff = 0;
+    xSize = 0;
+    ySize = 0;
+    outputWidth = 0;
+    context = NULL;
+    warped = FALSE;
     this->inputIndex = inputIndex;
 }
 
@@ -34,6 +44,75 @@ PLCInput::PLCInput(int inputIndex)
 
 PLCInput::~PLCInput()
 {
+    releaseDS();
+}
+
+/************************************************************************/
+/*                           createVariant()                            */
+/*                                                                      */
+/*      Create an input for another rendering of the same scene, such   */
+/*      as a visual or surface reflectance product, on the same         */
+/*      footprint.  Parameters and metrics are copied, but not the      */
+/*      cloud masks which are only used for quality.                    */
+/************************************************************************/
+
+PLCInput *PLCInput::createVariant(const char *variantFilename)
+
+{
+    PLCInput *variant = new PLCInput(inputIndex);
+
+    variant->filename = variantFilename;
+    variant->parameters = parameters;
+    variant->qualityMetrics = qualityMetrics;
+
+    return variant;
+}
+
+/************************************************************************/
+/*                            getCacheKey()                             */
+/*                                                                      */
+/*      Build a key for results derived from this input: the file,      */
+/*      its size and modification time, the cloud mask and vector      */
+/*      likewise, the parameters, and where it falls on the output      */
+/*      grid.                                                           */
+/************************************************************************/
+
+CPLString PLCInput::getCacheKey()
+
+{
+    CPLString key;
+
+    key = PLCFileStamp(filename) + "|";
+    key += PLCFileStamp(cloudMask) + "|" + PLCFileStamp(cloudVector) + "|";
+
+    for( std::map<CPLString,CPLString>::iterator it = parameters.begin();
+         it != parameters.end(); ++it )
+        key += it->first + "=" + it->second + "|";
+
+    for( std::map<CPLString,double>::iterator it = qualityMetrics.begin();
+         it != qualityMetrics.end(); ++it )
+        key += CPLString().Printf("%s=%.17g|", it->first.c_str(), it->second);
+
+    for( unsigned int i = 0; i < imageryBands.size(); i++ )
+        key += CPLString().Printf("%d,", imageryBands[i]);
+
+    key += CPLString().Printf("|%d,%d,%d,%d,%d", 
+                              xOff, yOff, xSize, ySize, warped);
+
+    return key;
+}
+
+/************************************************************************/
+/*                             getFileKey()                             */
+/************************************************************************/
+
+CPLString PLCInput::getFileKey()
+
+{
+    if( fileKey.size() == 0 )
+        fileKey = PLCFileStamp(filename);
+
+    return fileKey;
 }
 
 /************************************************************************/
@@ -42,7 +121,8 @@ PLCInput::~PLCInput()
 /*      Parse arguments defining an input file and related              */
 /*      information.                                                    */
 /*                                                                      */
-/*      Like:   [-i input_file [-c cloudmask] [-qm name value]*]*       */
+/*      Like:   [-i input_file [-c cloudmask] [-cv cloudvector]         */
+/*               [-qm name value]*]*                                    */
 /************************************************************************/
 int PLCInput::ConsumeArgs(int argc, char **argv)
 {
@@ -61,6 +141,11 @@ int PLCInput::ConsumeArgs(int argc, char **argv)
             cloudMask = argv[iArg+1];
             iArg += 2;
         }
+        else if( iArg < argc-1 && EQUAL(argv[iArg],"-cv") )
+        {
+            cloudVector = argv[iArg+1];
+            iArg += 2;
+        }
         else if( iArg < argc-2 && EQUAL(argv[iArg],"-qm") )
         {
             qualityMetrics[argv[iArg+1]] = CPLAtof(argv[iArg+2]);
@@ -91,6 +176,10 @@ void PLCInput::ConsumeJson(WJElement json)
         {
             cloudMask = WJEString(json, value->name, WJE_GET, "");
         }
+        else if( EQUAL(value->name, "cloud_vector") )
+        {
+            cloudVector = WJEString(json, value->name, WJE_GET, "");
+        }
         else if( value->type == WJR_TYPE_STRING )
         {
             parameters[value->name] = WJEString(json, value->name, WJE_GET, "");
@@ -107,15 +196,339 @@ void PLCInput::ConsumeJson(WJElement json)
 /************************************************************************/
 /*                             Initialize()                             */
 /*                                                                      */
-/*      Ensure all arguments make sense, initialize quality methods,    */
-/*      open file(s).                                                   */
+/*      Ensure all arguments make sense, and work out where the         */
+/*      input falls on the output grid.  Inputs in another coordinate   */
+/*      system, at another resolution or off the pixel grid are         */
+/*      warped to the output grid.  Files are opened again lazily       */
+/*      when the rows they cover are processed.                         */
 /************************************************************************/
 
 void PLCInput::Initialize(PLCContext *plContext)
 
 {
+    context = plContext;
+    warped = FALSE;
+
     getDS();
-    getCloudDS();
+
+    xSize = DS->GetRasterXSize();
+    ySize = DS->GetRasterYSize();
+    outputWidth = plContext->width;
+
+/* -------------------------------------------------------------------- */
+/*      Place the input on the output grid.  Inputs without a           */
+/*      geotransform must match the output size exactly.                */
+/* -------------------------------------------------------------------- */
+    double inGT[6], outGT[6];
+    int sameSize = (xSize == plContext->width && ySize == plContext->height);
+
+    if( DS->GetGeoTransform(inGT) != CE_None
+        || plContext->outputDS->GetGeoTransform(outGT) != CE_None )
+    {
+        if( !sameSize )
+            CPLError(CE_Fatal, CPLE_AppDefined,
+                     "Size of %s (%dx%d) does not match target %s (%dx%d), "
+                     "and it can't be placed by georeferencing.",
+                     filename.c_str(), xSize, ySize,
+                     plContext->outputFilename.c_str(),
+                     plContext->width, plContext->height);
+        xOff = 0;
+        yOff = 0;
+    }
+    else
+    {
+        double xOffD = (inGT[0] - outGT[0]) / outGT[1];
+        double yOffD = (inGT[3] - outGT[3]) / outGT[5];
+
+        xOff = (int) floor(xOffD + 0.5);
+        yOff = (int) floor(yOffD + 0.5);
+
+        const char *inWKT = DS->GetProjectionRef();
+        const char *outWKT = plContext->outputDS->GetProjectionRef();
+        int sameSRS = TRUE;
+
+        if( inWKT != NULL && strlen(inWKT) > 0 
+            && outWKT != NULL && strlen(outWKT) > 0 
+            && !EQUAL(inWKT, outWKT) )
+        {
+            OGRSpatialReference inSRS, outSRS;
+
+            inSRS.importFromWkt(inWKT);
+            outSRS.importFromWkt(outWKT);
+            sameSRS = inSRS.IsSame(&outSRS);
+        }
+
+        if( !sameSRS
+            || fabs(inGT[1] - outGT[1]) > fabs(outGT[1]) * 0.000001
+            || fabs(inGT[5] - outGT[5]) > fabs(outGT[5]) * 0.000001
+            || inGT[2] != 0.0 || inGT[4] != 0.0 
+            || outGT[2] != 0.0 || outGT[4] != 0.0 
+            || fabs(xOffD - xOff) > 0.001 || fabs(yOffD - yOff) > 0.001 )
+        {
+            computeWarpFootprint(plContext);
+            warped = TRUE;
+        }
+    }
+
+    CPLDebug("PLC", "Input %s placed at %d,%d (%dx%d)%s.",
+             filename.c_str(), xOff, yOff, xSize, ySize,
+             warped ? ", warped" : "");
+
+    if( xOff >= plContext->width || yOff >= plContext->height
+        || xOff + xSize <= 0 || yOff + ySize <= 0 )
+        CPLDebug("PLC", "Input %s does not intersect the output.",
+                 filename.c_str());
+
+    // The file will be reopened if and when it is actually needed.
+    releaseDS();
+}
+
+/************************************************************************/
+/*                        computeWarpFootprint()                        */
+/*                                                                      */
+/*      Work out the window of the output grid covered by an input      */
+/*      that has to be warped, by transforming points along the         */
+/*      edges of the input.  The window is clipped to the output.      */
+/*      The input is warped to exactly this window, so all of the       */
+/*      footprint logic is the same as for inputs on the grid.          */
+/************************************************************************/
+
+void PLCInput::computeWarpFootprint(PLCContext *plContext)
+
+{
+    void *transformArg = 
+        GDALCreateGenImgProjTransformer2(DS, plContext->outputDS, NULL);
+    if( transformArg == NULL )
+        exit(1);
+
+    const int steps = 20;
+    std::vector<double> x, y, z;
+    
+    for( int i = 0; i <= steps; i++ )
+    {
+        double ratio = i / (double) steps;
+
+        x.push_back(ratio * xSize); y.push_back(0.0);
+        x.push_back(ratio * xSize); y.push_back(ySize);
+        x.push_back(0.0);           y.push_back(ratio * ySize);
+        x.push_back(xSize);         y.push_back(ratio * ySize);
+    }
+    z.resize(x.size(), 0.0);
+    std::vector<int> success(x.size(), FALSE);
+
+    GDALGenImgProjTransform(transformArg, FALSE, x.size(),
+                            &(x[0]), &(y[0]), &(z[0]), &(success[0]));
+    GDALDestroyGenImgProjTransformer(transformArg);
+
+    double minX = 0, minY = 0, maxX = 0, maxY = 0;
+    int count = 0;
+
+    for( unsigned int i = 0; i < x.size(); i++ )
+    {
+        if( !success[i] )
+            continue;
+
+        if( count++ == 0 )
+        {
+            minX = maxX = x[i];
+            minY = maxY = y[i];
+        }
+        else
+        {
+            minX = MIN(minX, x[i]);
+            maxX = MAX(maxX, x[i]);
+            minY = MIN(minY, y[i]);
+            maxY = MAX(maxY, y[i]);
+        }
+    }
+
+    int x0 = MAX(0, (int) floor(minX));
+    int y0 = MAX(0, (int) floor(minY));
+    int x1 = MIN(plContext->width, (int) ceil(maxX));
+    int y1 = MIN(plContext->height, (int) ceil(maxY));
+
+    if( count == 0 || x0 >= x1 || y0 >= y1 )
+    {
+        xOff = yOff = 0;
+        xSize = ySize = 0;
+    }
+    else
+    {
+        xOff = x0;
+        yOff = y0;
+        xSize = x1 - x0;
+        ySize = y1 - y0;
+    }
+
+    double outGT[6];
+    plContext->outputDS->GetGeoTransform(outGT);
+
+    memcpy(warpGT, outGT, sizeof(warpGT));
+    warpGT[0] = outGT[0] + xOff * outGT[1] + yOff * outGT[2];
+    warpGT[3] = outGT[3] + xOff * outGT[4] + yOff * outGT[5];
+}
+
+/************************************************************************/
+/*                           createWarpedDS()                           */
+/*                                                                      */
+/*      Wrap srcDS in a warped VRT covering this input's footprint     */
+/*      on the output grid.  Blocks are only warped when read, and      */
+/*      are then held in the GDAL block cache.  For imagery an alpha    */
+/*      band is added so validity comes through the mask band.  A       */
+/*      source alpha, nodata or per dataset mask is honoured by the     */
+/*      warper.  The VRT takes over srcDS and closes it.                */
+/************************************************************************/
+
+static GDALResampleAlg ResampleAlgFromName(const char *name, 
+                                           const char *filename)
+
+{
+    if( EQUAL(name,"nearest") || EQUAL(name,"near") )
+        return GRA_NearestNeighbour;
+    else if( EQUAL(name,"bilinear") )
+        return GRA_Bilinear;
+    else if( EQUAL(name,"cubic") )
+        return GRA_Cubic;
+    else if( EQUAL(name,"cubicspline") )
+        return GRA_CubicSpline;
+    else if( EQUAL(name,"lanczos") )
+        return GRA_Lanczos;
+    else if( EQUAL(name,"average") )
+        return GRA_Average;
+
+    CPLError(CE_Fatal, CPLE_AppDefined,
+             "Unsupported warp resampling '%s' for %s.", name, filename);
+    return GRA_NearestNeighbour;
+}
+
+GDALDataset *PLCInput::createWarpedDS(GDALDataset *srcDS, 
+                                      const char *resampling, int imagery)
+
+{
+    GDALWarpOptions *psWO = GDALCreateWarpOptions();
+    std::vector<int> bands;
+
+    psWO->hSrcDS = (GDALDatasetH) srcDS;
+    psWO->eResampleAlg = ResampleAlgFromName(resampling, 
+                                             srcDS->GetDescription());
+
+    for( int i = 0; i < srcDS->GetRasterCount(); i++ )
+    {
+        if( !imagery && i > 0 )
+            break;
+
+        if( imagery && srcDS->GetRasterBand(i+1)->GetColorInterpretation() 
+            == GCI_AlphaBand )
+            psWO->nSrcAlphaBand = i+1;
+        else
+            bands.push_back(i+1);
+    }
+
+    psWO->nBandCount = bands.size();
+    psWO->panSrcBands = (int *) CPLMalloc(sizeof(int) * bands.size());
+    psWO->panDstBands = (int *) CPLMalloc(sizeof(int) * bands.size());
+
+    int hasNoData = FALSE;
+
+    // Nodata is honoured if any band has it.
+    for( unsigned int i = 0; i < bands.size(); i++ )
+    {
+        int bandHasNoData = FALSE;
+
+        psWO->panSrcBands[i] = bands[i];
+        psWO->panDstBands[i] = i+1;
+
+        srcDS->GetRasterBand(bands[i])->GetNoDataValue(&bandHasNoData);
+        if( bandHasNoData )
+            hasNoData = TRUE;
+    }
+
+    if( hasNoData )
+    {
+        psWO->padfSrcNoDataReal = (double *)
+            CPLCalloc(sizeof(double), bands.size());
+        psWO->padfSrcNoDataImag = (double *)
+            CPLCalloc(sizeof(double), bands.size());
+        for( unsigned int i = 0; i < bands.size(); i++ )
+            psWO->padfSrcNoDataReal[i] = 
+                srcDS->GetRasterBand(bands[i])->GetNoDataValue();
+    }
+
+    if( imagery )
+    {
+        psWO->nDstAlphaBand = bands.size() + 1;
+        psWO->papszWarpOptions = 
+            CSLSetNameValue(psWO->papszWarpOptions, "INIT_DEST", "0");
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Transform from the source to our window of the output grid,    */
+/*      approximated by linear interpolation within the error           */
+/*      threshold (in pixels) unless it is zero.                        */
+/* -------------------------------------------------------------------- */
+    void *transformArg = 
+        GDALCreateGenImgProjTransformer2(srcDS, context->outputDS, NULL);
+    if( transformArg == NULL )
+        exit(1);
+
+    GDALSetGenImgProjTransformerDstGeoTransform(transformArg, warpGT);
+
+    psWO->pfnTransformer = GDALGenImgProjTransform;
+    psWO->pTransformerArg = transformArg;
+
+    if( context->warpErrorThreshold > 0.0 )
+    {
+        psWO->pTransformerArg = 
+            GDALCreateApproxTransformer(GDALGenImgProjTransform, transformArg,
+                                        context->warpErrorThreshold);
+        psWO->pfnTransformer = GDALApproxTransform;
+        GDALApproxTransformerOwnsSubtransformer(psWO->pTransformerArg, TRUE);
+    }
+
+    GDALDatasetH warpedDS = 
+        GDALCreateWarpedVRT((GDALDatasetH) srcDS, xSize, ySize, warpGT, psWO);
+    GDALDestroyWarpOptions(psWO);
+
+    if( warpedDS == NULL )
+        exit(1);
+
+    // The VRT is on the output grid, so cloud vectors and the like are
+    // reprojected to it.
+    ((GDALDataset *) warpedDS)->SetProjection(
+        context->outputDS->GetProjectionRef());
+
+    // The VRT holds its own reference to the source.
+    GDALDereferenceDataset((GDALDatasetH) srcDS);
+
+    return (GDALDataset *) warpedDS;
+}
+
+/************************************************************************/
+/*                             releaseDS()                              */
+/*                                                                      */
+/*      Close the input and its auxiliary files.  Used once we are     */
+/*      done with the rows this input covers.                           */
+/************************************************************************/
+
+void PLCInput::releaseDS()
+
+{
+    if( DS != NULL )
+    {
+        GDALClose(DS);
+        DS = NULL;
+    }
+
+    delete cloudRaster;
+    cloudRaster = NULL;
+
+    delete cloudVectorMask;
+    cloudVectorMask = NULL;
+
+    for( std::map<CPLString,PLCAuxRaster*>::iterator it = auxRasters.begin();
+         it != auxRasters.end(); ++it )
+        delete it->second;
+    auxRasters.clear();
 }
 
 /************************************************************************/
@@ -130,79 +543,611 @@ GDALDataset *PLCInput::getDS()
         DS = (GDALDataset *) GDALOpen(filename, GA_ReadOnly);
         if( DS == NULL )
             exit(1);
+
+        if( warped )
+            DS = createWarpedDS(DS, getParm("warp_resampling", "nearest"),
+                                TRUE);
+
+/* -------------------------------------------------------------------- */
+/*      Identify the imagery bands, and work out how validity is to     */
+/*      be established.  Alpha bands are consumed via the mask band.    */
+/* -------------------------------------------------------------------- */
+        imageryBands.clear();
+        maskBands.clear();
+
+        for( int i=0; i < DS->GetRasterCount(); i++ )
+        {
+            if( DS->GetRasterBand(i+1)->GetColorInterpretation() 
+                != GCI_AlphaBand )
+                imageryBands.push_back(i+1);
+        }
+
+        if( imageryBands.size() == 0 )
+            CPLError(CE_Fatal, CPLE_AppDefined,
+                     "Input %s has no imagery bands.", filename.c_str());
+
+        GDALRasterBand *firstBand = DS->GetRasterBand(imageryBands[0]);
+        maskFlags = firstBand->GetMaskFlags();
+
+        if( maskFlags & GMF_PER_DATASET )
+            maskBands.push_back(firstBand->GetMaskBand());
+        else
+        {
+            for( unsigned int i=0; i < imageryBands.size(); i++ )
+            {
+                GDALRasterBand *band = DS->GetRasterBand(imageryBands[i]);
+                if( !(band->GetMaskFlags() & GMF_ALL_VALID) )
+                    maskBands.push_back(band->GetMaskBand());
+            }
+        }
+
+        CPLDebug("PLC", "Input %s has mask flags 0x%x, %d mask band(s).",
+                 filename.c_str(), maskFlags, (int) maskBands.size());
     }
 
     return DS;
 }
 
 /************************************************************************/
-/*                             getCloudDS()                             */
+/*                           openAuxRaster()                            */
+/*                                                                      */
+/*      Open an auxiliary raster (cloud mask, quality file) that goes   */
+/*      with this input.  Normally it is on the input grid or an        */
+/*      integer fraction of it.  For warped inputs it is warped to      */
+/*      the same footprint, so it must be georeferenced itself.        */
+/************************************************************************/
+
+PLCAuxRaster *PLCInput::openAuxRaster(const char *auxFilename, 
+                                      const char *resampling)
+
+{
+    PLCAuxRaster *aux = new PLCAuxRaster(auxFilename, resampling);
+
+    if( !warped )
+    {
+        aux->Initialize(xSize, ySize);
+        return aux;
+    }
+
+    GDALDataset *auxDS = (GDALDataset *) GDALOpen(auxFilename, GA_ReadOnly);
+    if( auxDS == NULL )
+        exit(1);
+
+    double auxGT[6];
+    if( auxDS->GetGeoTransform(auxGT) != CE_None )
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "%s has no georeferencing, and is required to warp it "
+                 "with %s to the output grid.",
+                 auxFilename, filename.c_str());
+
+    aux->setDS(createWarpedDS(auxDS, resampling, FALSE));
+    aux->Initialize(xSize, ySize);
+
+    return aux;
+}
+
+/************************************************************************/
+/*                            getAuxRaster()                            */
+/*                                                                      */
+/*      Fetch an auxiliary raster, opening it on first use.  It is      */
+/*      kept open until releaseDS().                                    */
+/************************************************************************/
+
+PLCAuxRaster *PLCInput::getAuxRaster(const char *auxFilename, 
+                                     const char *resampling)
+
+{
+    CPLString key = CPLString(auxFilename) + "|" + resampling;
+
+    if( auxRasters.count(key) == 0 )
+        auxRasters[key] = openAuxRaster(auxFilename, resampling);
+
+    return auxRasters[key];
+}
+
+/************************************************************************/
+/*                           getCloudRaster()                           */
+/*                                                                      */
+/*      The cloud mask may be at the imagery resolution, or an          */
+/*      integer fraction of it in which case it is expanded on the      */
+/*      fly using the cloud_resampling parameter (nearest default).     */
+/************************************************************************/
+
+PLCAuxRaster *PLCInput::getCloudRaster()
+
+{
+    if( cloudRaster == NULL && !EQUAL(cloudMask,""))
+    {
+        cloudRaster = openAuxRaster(
+            cloudMask, getParm("cloud_resampling", "nearest"));
+    }
+
+    return cloudRaster;
+}
+
+/************************************************************************/
+/*                         getCloudVectorMask()                         */
+/*                                                                      */
+/*      Polygon cloud masks are turned into an edge table once, and     */
+/*      then into coverage spans per line as needed.                    */
 /************************************************************************/
 
-GDALDataset *PLCInput::getCloudDS()
+PLCVectorMask *PLCInput::getCloudVectorMask()
 
 {
-    if( cloudDS == NULL && !EQUAL(cloudMask,""))
+    if( cloudVectorMask == NULL && !EQUAL(cloudVector,""))
     {
-        cloudDS = (GDALDataset *) GDALOpen(cloudMask, GA_ReadOnly);
-        if( cloudDS == NULL )
+        cloudVectorMask = new PLCVectorMask(cloudVector);
+        cloudVectorMask->Initialize(getDS());
+    }
+
+    return cloudVectorMask;
+}
+
+/************************************************************************/
+/*                            readAuxLine()                             */
+/*                                                                      */
+/*      Read a line of an auxiliary raster (on this input's grid)       */
+/*      into an output line buffer, placed at the input's offset.       */
+/*      Pixels outside the input footprint are left untouched.          */
+/*      During the pre-pass the line is sampled at the decimated        */
+/*      pixel centers instead.                                          */
+/************************************************************************/
+
+void PLCInput::readAuxLine(PLCAuxRaster *aux, int line, void *data,
+                           GDALDataType dataType)
+
+{
+    int outStart = MAX(0, xOff);
+    int outEnd = MIN(outputWidth, xOff + xSize);
+    int decimation = (context != NULL) ? context->decimation : 1;
+
+    if( decimation > 1 && ySize > 0 )
+        line = MAX(yOff, MIN(yOff + ySize - 1, line));
+
+    if( !intersectsLine(line) || outStart >= outEnd )
+        return;
+
+    int pixelSize = GDALGetDataTypeSizeBytes(dataType);
+
+    if( xOff == 0 && xSize == outputWidth && decimation == 1 )
+    {
+        aux->readLine(line - yOff, data, dataType);
+        return;
+    }
+
+    std::vector<GByte> inputLine(xSize * pixelSize);
+    aux->readLine(line - yOff, &(inputLine[0]), dataType);
+
+    if( decimation == 1 )
+    {
+        memcpy(((GByte *) data) + outStart * pixelSize,
+               &(inputLine[(outStart - xOff) * pixelSize]),
+               (outEnd - outStart) * pixelSize);
+        return;
+    }
+
+    int start, end;
+    getDecimatedRange(&start, &end);
+
+    for( int i = start; i < end; i++ )
+    {
+        int x = MIN(i * decimation + decimation / 2, outputWidth - 1);
+
+        memcpy(((GByte *) data) + i * pixelSize,
+               &(inputLine[(x - xOff) * pixelSize]), pixelSize);
+    }
+}
+
+/************************************************************************/
+/*                          readImageryRange()                          */
+/*                                                                      */
+/*      Read the listed imagery bands for output pixels outStart to     */
+/*      outEnd of an output line, which must be within the footprint.  */
+/************************************************************************/
+
+void PLCInput::readImageryRange(PLCLine *lineObj, int line, 
+                                int outStart, int outEnd,
+                                std::vector<int> &bands)
+
+{
+    int count = outEnd - outStart;
+
+    for( unsigned int i=0; i < bands.size(); i++ )
+    {
+        GDALRasterBand *band = DS->GetRasterBand(imageryBands[bands[i]]);
+
+        // Warped inputs are not cached, their blocks depend on the grid.
+        if( context->blockCache != NULL && !warped )
+        {
+            context->blockCache->readRow(getFileKey(), band, 
+                                         imageryBands[bands[i]],
+                                         outStart - xOff, line - yOff, count,
+                                         lineObj->getBand(bands[i]) + outStart);
+            continue;
+        }
+        
+        CPLErr eErr = band->RasterIO(GF_Read, outStart - xOff, line - yOff, 
+                                     count, 1, 
+                                     lineObj->getBand(bands[i]) + outStart, 
+                                     count, 1, GDT_Float32, 0, 0);
+        if( eErr != CE_None )
             exit(1);
     }
+}
+
+/************************************************************************/
+/*                            readImagery()                             */
+/*                                                                      */
+/*      Load the imagery bands not already loaded for a line.  If      */
+/*      needed is passed only the blocks holding pixels with            */
+/*      needed[i] set are read, a run of such blocks at a time.         */
+/*      Other pixels are zero.                                          */
+/************************************************************************/
+
+void PLCInput::readImagery(PLCLine *lineObj, int line, const GByte *needed)
+
+{
+    int outStart = MAX(0, xOff);
+    int outEnd = MIN(outputWidth, xOff + xSize);
+    std::vector<int> bands;
+
+    getDS();
+
+    for( int i = 0; i < (int) imageryBands.size(); i++ )
+    {
+        if( !lineObj->isBandLoaded(i) )
+            bands.push_back(i);
+    }
+
+    if( bands.size() == 0 )
+        return;
+
+    for( unsigned int i = 0; i < bands.size(); i++ )
+        lineObj->setBandLoaded(bands[i]);
+
+    if( !intersectsLine(line) || outStart >= outEnd )
+        return;
+
+    if( needed == NULL )
+    {
+        const std::vector<int> &spans = lineObj->getValidSpans();
+
+        if( spans.size() > 0 )
+            readImageryRange(lineObj, line, MAX(outStart, spans[0]), 
+                             MIN(outEnd, spans[spans.size()-1]), bands);
+        return;
+    }
+
+    int blockXSize, blockYSize;
+    DS->GetRasterBand(imageryBands[0])->GetBlockSize(&blockXSize, &blockYSize);
+
+    int runStart = -1;
+    int blockStart = outStart - (outStart - xOff) % blockXSize;
+
+    for( ; blockStart < outEnd; blockStart += blockXSize )
+    {
+        int start = MAX(outStart, blockStart);
+        int end = MIN(outEnd, blockStart + blockXSize);
+        int used = FALSE;
+
+        for( int i = start; i < end && !used; i++ )
+            used = needed[i];
 
-    return cloudDS;
+        if( used && runStart < 0 )
+            runStart = start;
+        else if( !used && runStart >= 0 )
+        {
+            readImageryRange(lineObj, line, runStart, start, bands);
+            runStart = -1;
+        }
+    }
+
+    if( runStart >= 0 )
+        readImageryRange(lineObj, line, runStart, outEnd, bands);
 }
 
 /************************************************************************/
 /*                              getLine()                               */
+/*                                                                      */
+/*      Fetch the portion of output line "line" covered by this         */
+/*      input.  The returned line is the full output width, with       */
+/*      pixels outside the footprint marked invalid.                    */
+/*                                                                      */
+/*      bands is PLC_ALL_BANDS, PLC_QUALITY_BANDS to load only the      */
+/*      imagery bands (and cloud mask) used by the quality methods,    */
+/*      or PLC_NO_BANDS.  Remaining bands can be loaded later with      */
+/*      readImagery() once we know which pixels will be used.          */
 /************************************************************************/
 
-PLCLine *PLCInput::getLine(int line)
+PLCLine *PLCInput::getLine(int line, int bands)
 
 {
-    getDS();
-    
-    int  i, width = DS->GetRasterXSize();
+    if( context != NULL && context->decimation > 1 )
+        return getDecimatedLine(line, bands);
+
+    int  i, width = outputWidth;
     PLCLine *lineObj = new PLCLine(width);
 
+    int outStart = MAX(0, xOff);
+    int outEnd = MIN(width, xOff + xSize);
+    int inLine = line - yOff;
+    int count = outEnd - outStart;
+
+    std::vector<GByte> mask;
+
+    if( !intersectsLine(line) || count <= 0 )
+    {
+        mask.resize(width, 0);
+        lineObj->setValidityFromMask(&(mask[0]));
+        lineObj->maskQuality(lineObj->getQuality());
+        return lineObj;
+    }
+
+    getDS();
+
 /* -------------------------------------------------------------------- */
-/*      Load imagery.                                                   */
+/*      Load validity from the mask band(s) (alpha, nodata or a real    */
+/*      mask).  Inputs flagged all valid skip reading this entirely.    */
+/*      Anything outside the footprint is invalid.                      */
 /* -------------------------------------------------------------------- */
-    for( i=0; i < DS->GetRasterCount(); i++ )
+    if( maskBands.size() > 0 || count < width )
     {
-        CPLErr eErr;
-        GDALRasterBand *band = DS->GetRasterBand(i+1);
-        
-        if( band->GetColorInterpretation() == GCI_AlphaBand )
-            eErr = band->RasterIO(GF_Read, 0, line, width, 1, 
-                                  lineObj->getAlpha(), width, 1, GDT_Byte,
-                                  0, 0);
+        mask.resize(width, 0);
+        memset(&(mask[outStart]), 255, count);
+
+        if( maskBands.size() > 0 )
+        {
+            for( i=0; i < (int) maskBands.size(); i++ )
+            {
+                CPLErr eErr = maskBands[i]->RasterIO(
+                    GF_Read, outStart - xOff, inLine, count, 1, 
+                    &(mask[outStart]), count, 1, GDT_Byte, 0, 0);
+                if( eErr != CE_None )
+                    exit(1);
+
+                lineObj->setValidityFromMask(&(mask[0]));
+            }
+        }
         else
-            eErr = band->RasterIO(GF_Read, 0, line, width, 1, 
-                                  lineObj->getBand(i), width, 1, GDT_Float32, 
-                                  0, 0);
+            lineObj->setValidityFromMask(&(mask[0]));
+    }
 
-        if( eErr != CE_None )
-            exit(1);
+/* -------------------------------------------------------------------- */
+/*      Load imagery, only over the range holding valid pixels.  If     */
+/*      there are none the line needs no further reads at all.          */
+/* -------------------------------------------------------------------- */
+    const std::vector<int> &validSpans = lineObj->getValidSpans();
+
+    lineObj->setBandCount(imageryBands.size());
+
+    if( validSpans.size() == 0 )
+    {
+        lineObj->maskQuality(lineObj->getQuality());
+        return lineObj;
     }
 
+    std::vector<int> loadBands;
+
+    for( i=0; i < (int) imageryBands.size(); i++ )
+    {
+        if( bands == PLC_ALL_BANDS
+            || (bands == PLC_QUALITY_BANDS && context->isQualityBand(i)) )
+        {
+            loadBands.push_back(i);
+            lineObj->setBandLoaded(i);
+        }
+    }
+
+    readImageryRange(lineObj, line, validSpans[0], 
+                     validSpans[validSpans.size()-1], loadBands);
+
 /* -------------------------------------------------------------------- */
 /*      Load cloud mask                                                 */
 /* -------------------------------------------------------------------- */
-    if( !EQUAL(cloudMask,"") )
+    if( !EQUAL(cloudMask,"") 
+        && (bands == PLC_ALL_BANDS 
+            || (bands == PLC_QUALITY_BANDS && context->qualityUsesCloud())) )
+    {
+        readAuxLine(getCloudRaster(), line, lineObj->getCloud(), GDT_UInt16);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Apply cloud polygons.  Covered pixels get the quality           */
+/*      cloud_vector_quality (default -1, excluded), and if             */
+/*      cloud_vector_value is set it is also or'ed into the cloud       */
+/*      mask for the benefit of cloud mask based quality methods.       */
+/* -------------------------------------------------------------------- */
+    if( !EQUAL(cloudVector,"") )
+    {
+        std::vector<int> spans;
+
+        getCloudVectorMask()->getSpans(inLine, spans);
+
+        if( spans.size() > 0 )
+        {
+            float coveredQuality = getQM("cloud_vector_quality", -1.0);
+            int cloudValue = (int) getQM("cloud_vector_value", -1.0);
+            float *quality = lineObj->getQuality();
+            unsigned short *cloud = NULL;
+
+            if( cloudValue >= 0 )
+                cloud = lineObj->getCloud();
+
+            for( unsigned int iSpan = 0; iSpan < spans.size(); iSpan += 2 )
+            {
+                int spanStart = MAX(0, spans[iSpan] + xOff);
+                int spanEnd = MIN(width, spans[iSpan+1] + xOff);
+
+                for( int iPixel = spanStart; iPixel < spanEnd; iPixel++ )
+                {
+                    quality[iPixel] = coveredQuality;
+                    if( cloud != NULL )
+                        cloud[iPixel] |= (unsigned short) cloudValue;
+                }
+            }
+        }
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Invalid pixels start with a quality of -1 so that no quality    */
+/*      method can make them eligible.                                  */
+/* -------------------------------------------------------------------- */
+    if( !lineObj->isAllValid() )
+        lineObj->maskQuality(lineObj->getQuality());
+
+    return lineObj;
+}
+
+/************************************************************************/
+/*                         getDecimatedRange()                          */
+/*                                                                      */
+/*      Range of decimated pixels whose center falls in the footprint.  */
+/*      Returns the count.                                              */
+/************************************************************************/
+
+int PLCInput::getDecimatedRange(int *start, int *end)
+
+{
+    int decimation = context->decimation;
+    int width = (outputWidth + decimation - 1) / decimation;
+
+#define DECIMATED_CENTER(i) MIN((i) * decimation + decimation / 2, \
+                                outputWidth - 1)
+
+    *start = 0;
+    while( *start < width && DECIMATED_CENTER(*start) < xOff )
+        (*start)++;
+
+    *end = *start;
+    while( *end < width && DECIMATED_CENTER(*end) < xOff + xSize )
+        (*end)++;
+
+#undef DECIMATED_CENTER
+
+    return *end - *start;
+}
+
+/************************************************************************/
+/*                          getDecimatedLine()                          */
+/*                                                                      */
+/*      Fetch a decimated line for the candidate pre-pass.  Each        */
+/*      pixel stands for a decimation x decimation block of the         */
+/*      output, starting at the block row holding "line".  Imagery      */
+/*      and masks are read with a reduced buffer so GDAL can use        */
+/*      overviews, while auxiliary data is sampled at block centers.   */
+/************************************************************************/
+
+PLCLine *PLCInput::getDecimatedLine(int line, int bands)
+
+{
+    int  i, decimation = context->decimation;
+    int  width = (outputWidth + decimation - 1) / decimation;
+    PLCLine *lineObj = new PLCLine(width);
+
+    int blockTop = (line / decimation) * decimation;
+    int rowStart = MAX(blockTop, yOff);
+    int rowEnd = MIN(MIN(blockTop + decimation, context->height), 
+                     yOff + ySize);
+    int start, end;
+    int count = getDecimatedRange(&start, &end);
+
+    std::vector<GByte> mask(width, 0);
+
+    if( count <= 0 || rowStart >= rowEnd )
+    {
+        lineObj->setValidityFromMask(&(mask[0]));
+        lineObj->maskQuality(lineObj->getQuality());
+        return lineObj;
+    }
+
+    getDS();
+
+    // The window read, in input pixels, and the sample line for
+    // auxiliary data.
+    int winStart = MAX(start * decimation, xOff) - xOff;
+    int winEnd = MIN(end * decimation, xOff + xSize) - xOff;
+    int sampleLine = MIN(rowEnd - 1, MAX(rowStart, line));
+
+/* -------------------------------------------------------------------- */
+/*      Load imagery and validity.                                      */
+/* -------------------------------------------------------------------- */
+    lineObj->setBandCount(imageryBands.size());
+
+    for( i=0; i < (int) imageryBands.size(); i++ )
     {
-        getCloudDS();
+        if( bands == PLC_NO_BANDS
+            || (bands == PLC_QUALITY_BANDS && !context->isQualityBand(i)) )
+            continue;
+
+        GDALRasterBand *band = DS->GetRasterBand(imageryBands[i]);
         
-        CPLErr eErr;
-        GDALRasterBand *band = cloudDS->GetRasterBand(1);
+        CPLErr eErr = band->RasterIO(GF_Read, winStart, rowStart - yOff, 
+                                     winEnd - winStart, rowEnd - rowStart, 
+                                     lineObj->getBand(i) + start, count, 1, 
+                                     GDT_Float32, 0, 0);
+        if( eErr != CE_None )
+            exit(1);
 
-        eErr = band->RasterIO(GF_Read, 0, line, width, 1, 
-                              lineObj->getCloud(), width, 1, GDT_UInt16, 
-                              0, 0);
+        lineObj->setBandLoaded(i);
+    }
+
+    memset(&(mask[start]), 255, count);
+    lineObj->setValidityFromMask(&(mask[0]));
 
+    for( i=0; i < (int) maskBands.size(); i++ )
+    {
+        CPLErr eErr = maskBands[i]->RasterIO(
+            GF_Read, winStart, rowStart - yOff, 
+            winEnd - winStart, rowEnd - rowStart, 
+            &(mask[start]), count, 1, GDT_Byte, 0, 0);
         if( eErr != CE_None )
             exit(1);
+
+        lineObj->setValidityFromMask(&(mask[0]));
     }
 
+/* -------------------------------------------------------------------- */
+/*      Cloud mask and polygons, sampled at the block centers.          */
+/* -------------------------------------------------------------------- */
+    if( !EQUAL(cloudMask,"") 
+        && (bands == PLC_ALL_BANDS 
+            || (bands == PLC_QUALITY_BANDS && context->qualityUsesCloud())) )
+    {
+        readAuxLine(getCloudRaster(), sampleLine, lineObj->getCloud(), 
+                    GDT_UInt16);
+    }
+
+    if( !EQUAL(cloudVector,"") )
+    {
+        std::vector<int> spans;
+
+        getCloudVectorMask()->getSpans(sampleLine - yOff, spans);
+
+        float coveredQuality = getQM("cloud_vector_quality", -1.0);
+        int cloudValue = (int) getQM("cloud_vector_value", -1.0);
+        float *quality = lineObj->getQuality();
+
+        for( unsigned int iSpan = 0; iSpan < spans.size(); iSpan += 2 )
+        {
+            for( i = start; i < end; i++ )
+            {
+                int x = MIN(i * decimation + decimation / 2, outputWidth - 1)
+                    - xOff;
+
+                if( x < spans[iSpan] || x >= spans[iSpan+1] )
+                    continue;
+
+                quality[i] = coveredQuality;
+                if( cloudValue >= 0 )
+                    lineObj->getCloud()[i] |= (unsigned short) cloudValue;
+            }
+        }
+    }
+
+    if( !lineObj->isAllValid() )
+        lineObj->maskQuality(lineObj->getQuality());
+
     return lineObj;
 }
 
@@ -231,3 +1176,21 @@ const char *PLCInput::getParm(const char *key, const char *defaultValue)
     else
         return defaultValue;
 }
+
+/************************************************************************/
+/*                            getBinValue()                             */
+/*                                                                      */
+/*      The time bin of an input, from a string parameter or a quality  */
+/*      metric such as "-qm month 3", or empty if it has neither.      */
+/************************************************************************/
+
+CPLString PLCInput::getBinValue(const char *key)
+
+{
+    if(parameters.count(key) > 0)
+        return parameters[key];
+    else if(qualityMetrics.count(key) > 0)
+        return CPLString().Printf("%.15g", qualityMetrics[key]);
+    else
+        return "";
+}
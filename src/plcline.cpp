@@ -28,8 +28,12 @@ PLCLine::PLCLine(int width)
     cloud = NULL;
     source = NULL;
     alpha = NULL;
+    validity = NULL;
     quality = NULL;
     newQuality = NULL;
+    newQualityUniform = TRUE;
+    newQualityValue = 1.0;
+    validSpansDirty = TRUE;
 }
 
 /************************************************************************/
@@ -40,32 +44,48 @@ PLCLine::~PLCLine()
 
 {
     for(int i=0; i < bandCount; i++)
-        CPLFree(bandData[i]);
+        CPLFree(bandData[i]);  // may be NULL
 
     CPLFree( cloud );
     CPLFree( source );
     CPLFree( alpha );
+    CPLFree( validity );
     CPLFree( quality );
     CPLFree( newQuality );
 }
 
+/************************************************************************/
+/*                            setBandCount()                            */
+/************************************************************************/
+
+void PLCLine::setBandCount(int count)
+{
+    for(int i=count; i < bandCount; i++)
+        CPLFree(bandData[i]);
+
+    bandCount = count;
+    bandData.resize(count, NULL);
+    bandLoaded.resize(count, 0);
+}
+
 /************************************************************************/
 /*                              getBand()                               */
+/*                                                                      */
+/*      Bands are allocated (zeroed) on first use, so bands that are    */
+/*      never needed for a line take no memory.                         */
 /************************************************************************/
 
 float *PLCLine::getBand(int band)
 {
-    if( band == bandCount )
-    {
-        bandCount++;
-        bandData.push_back((float *) CPLCalloc(sizeof(float),width));
-        return bandData[band];
-    }
-
-    if( band < 0 || band >= bandCount )
+    if( band < 0 )
         CPLError(CE_Fatal, CPLE_AppDefined,
-                 "Band %d requested, but only %d bands available.", 
-                 band, bandCount );
+                 "Band %d requested.", band );
+
+    if( band >= bandCount )
+        setBandCount(band+1);
+
+    if( bandData[band] == NULL )
+        bandData[band] = (float *) CPLCalloc(sizeof(float),width);
 
     return bandData[band];
 }
@@ -86,6 +106,112 @@ GByte *PLCLine::getAlpha()
     return alpha;
 }
 
+/************************************************************************/
+/*                        setValidityFromMask()                         */
+/*                                                                      */
+/*      Build the validity bitmap from a GDAL mask (or alpha) buffer.   */
+/*      Mask values of 128 and above are valid.  If every pixel is      */
+/*      valid no bitmap is kept at all.                                 */
+/************************************************************************/
+
+void PLCLine::setValidityFromMask(const GByte *mask)
+
+{
+    int i;
+
+    for( i=0; i < width && mask[i] >= 128; i++ ) {}
+
+    if( i == width )
+        return;
+
+    validSpansDirty = TRUE;
+
+    if( validity == NULL )
+    {
+        validity = (GByte *) CPLMalloc((width+7) / 8);
+        memset(validity, 255, (width+7) / 8);
+    }
+
+    for( ; i < width; i++ )
+    {
+        if( mask[i] < 128 )
+            validity[i>>3] &= ~(1 << (i & 7));
+    }
+}
+
+/************************************************************************/
+/*                            maskQuality()                             */
+/*                                                                      */
+/*      Set quality to -1 for all invalid pixels.                       */
+/************************************************************************/
+
+void PLCLine::maskQuality(float *quality)
+
+{
+    if( validity == NULL )
+        return;
+
+    const std::vector<int> &spans = getValidSpans();
+    int start = 0;
+
+    for( unsigned int iSpan = 0; iSpan <= spans.size(); iSpan += 2 )
+    {
+        int end = (iSpan < spans.size()) ? spans[iSpan] : width;
+
+        for( int i=start; i < end; i++ )
+            quality[i] = -1.0;
+
+        if( iSpan < spans.size() )
+            start = spans[iSpan+1];
+    }
+}
+
+/************************************************************************/
+/*                           getValidSpans()                            */
+/*                                                                      */
+/*      Return the runs of valid pixels, recomputing them if the        */
+/*      validity changed.  Whole bytes of the bitmap are skipped at     */
+/*      a time since scene edges give long invalid and valid runs.      */
+/************************************************************************/
+
+const std::vector<int> &PLCLine::getValidSpans()
+
+{
+    if( !validSpansDirty )
+        return validSpans;
+
+    validSpansDirty = FALSE;
+    validSpans.clear();
+
+    if( validity == NULL )
+    {
+        validSpans.push_back(0);
+        validSpans.push_back(width);
+        return validSpans;
+    }
+
+    int i = 0;
+
+    while( i < width )
+    {
+        while( i < width && !isValid(i) )
+            i += ((i & 7) == 0 && validity[i>>3] == 0) ? 8 : 1;
+
+        if( i >= width )
+            break;
+
+        int start = i;
+
+        while( i < width && isValid(i) )
+            i += ((i & 7) == 0 && validity[i>>3] == 0xff) ? 8 : 1;
+
+        validSpans.push_back(start);
+        validSpans.push_back(MIN(i, width));
+    }
+
+    return validSpans;
+}
+
 /************************************************************************/
 /*                              getCloud()                              */
 /************************************************************************/
@@ -134,17 +260,29 @@ float *PLCLine::getQuality()
 }
 
 /************************************************************************/
-/*                          getNewQuality()                             */
+/*                           getNewQuality()                            */
+/*                                                                      */
+/*      New quality starts out uniformly 1.0.  A uniform new quality    */
+/*      is only written out to the array (over the valid spans) when    */
+/*      a method needs per pixel values.                                */
 /************************************************************************/
 
 float *PLCLine::getNewQuality()
 
 {
     if( newQuality == NULL )
-    {
         newQuality = (float *) CPLCalloc(sizeof(float),width);
-        for( int i=0; i < width; i++ )
-            newQuality[i] = 1.0;
+
+    if( newQualityUniform )
+    {
+        const std::vector<int> &spans = getValidSpans();
+
+        for( unsigned int iSpan = 0; iSpan < spans.size(); iSpan += 2 )
+        {
+            for( int i=spans[iSpan]; i < spans[iSpan+1]; i++ )
+                newQuality[i] = newQualityValue;
+        }
+        newQualityUniform = FALSE;
     }
 
     return newQuality;
@@ -0,0 +1,287 @@
+/**
+ * Purpose: Polygon cloud/shadow masks rasterized a line at a time.
+ *
+ * Copyright 2016, Planet Labs, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include "compositor.h"
+#include "ogrsf_frmts.h"
+
+static bool EdgeYMinLess(const PLCVectorMask::Edge &a,
+                         const PLCVectorMask::Edge &b)
+{
+    return a.yMin < b.yMin;
+}
+
+/************************************************************************/
+/*                           PLCVectorMask()                            */
+/************************************************************************/
+
+PLCVectorMask::PLCVectorMask(const char *filename)
+
+{
+    this->filename = filename;
+    width = 0;
+    polygonCount = 0;
+    nextEdge = 0;
+    lastLine = -1;
+}
+
+/************************************************************************/
+/*                           ~PLCVectorMask()                           */
+/************************************************************************/
+
+PLCVectorMask::~PLCVectorMask()
+
+{
+}
+
+/************************************************************************/
+/*                              addRing()                               */
+/*                                                                      */
+/*      Add the edges of one ring, already in pixel/line space.         */
+/*      Horizontal edges never cross a line center and are dropped.     */
+/************************************************************************/
+
+void PLCVectorMask::addRing(std::vector<double> &x, std::vector<double> &y)
+
+{
+    int n = x.size();
+
+    for( int i = 0; i < n; i++ )
+    {
+        int j = (i + 1) % n;
+
+        if( y[i] == y[j] )
+            continue;
+
+        Edge edge;
+
+        edge.polygon = polygonCount;
+        if( y[i] < y[j] )
+        {
+            edge.yMin = y[i];
+            edge.yMax = y[j];
+            edge.xAtYMin = x[i];
+        }
+        else
+        {
+            edge.yMin = y[j];
+            edge.yMax = y[i];
+            edge.xAtYMin = x[j];
+        }
+        edge.slope = (x[j] - x[i]) / (y[j] - y[i]);
+
+        edges.push_back(edge);
+    }
+}
+
+/************************************************************************/
+/*                            addGeometry()                             */
+/************************************************************************/
+
+void PLCVectorMask::addGeometry(OGRGeometry *geom, const double *invGT)
+
+{
+    OGRwkbGeometryType eType = wkbFlatten(geom->getGeometryType());
+
+    if( eType == wkbMultiPolygon || eType == wkbGeometryCollection )
+    {
+        OGRGeometryCollection *coll = (OGRGeometryCollection *) geom;
+        for( int i = 0; i < coll->getNumGeometries(); i++ )
+            addGeometry(coll->getGeometryRef(i), invGT);
+        return;
+    }
+
+    if( eType != wkbPolygon )
+        return;
+
+    OGRPolygon *poly = (OGRPolygon *) geom;
+
+    for( int iRing = -1; iRing < poly->getNumInteriorRings(); iRing++ )
+    {
+        OGRLinearRing *ring = (iRing < 0) ? poly->getExteriorRing()
+            : poly->getInteriorRing(iRing);
+        if( ring == NULL || ring->getNumPoints() < 3 )
+            continue;
+
+        std::vector<double> x(ring->getNumPoints());
+        std::vector<double> y(ring->getNumPoints());
+
+        for( int i = 0; i < ring->getNumPoints(); i++ )
+            GDALApplyGeoTransform((double *) invGT,
+                                  ring->getX(i), ring->getY(i),
+                                  &(x[i]), &(y[i]));
+
+        addRing(x, y);
+    }
+
+    // Holes are handled by even-odd crossing within each polygon.
+    polygonCount++;
+}
+
+/************************************************************************/
+/*                             Initialize()                             */
+/*                                                                      */
+/*      Build the edge table for all polygons in all layers, in the     */
+/*      pixel/line space of the imagery dataset passed in.              */
+/************************************************************************/
+
+void PLCVectorMask::Initialize(GDALDataset *imageryDS)
+
+{
+    GDALDataset *vectorDS = (GDALDataset *)
+        GDALOpenEx(filename, GDAL_OF_VECTOR | GDAL_OF_VERBOSE_ERROR,
+                   NULL, NULL, NULL);
+    if( vectorDS == NULL )
+        exit(1);
+
+    width = imageryDS->GetRasterXSize();
+
+    double geoTransform[6], invGT[6];
+    imageryDS->GetGeoTransform(geoTransform);
+    if( !GDALInvGeoTransform(geoTransform, invGT) )
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "Unable to invert geotransform of %s for cloud vector %s.",
+                 imageryDS->GetDescription(), filename.c_str());
+
+    OGRSpatialReference imagerySRS;
+    const char *wkt = imageryDS->GetProjectionRef();
+    if( wkt != NULL && strlen(wkt) > 0 )
+    {
+        imagerySRS.importFromWkt(wkt);
+        imagerySRS.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+    }
+
+    for( int iLayer = 0; iLayer < vectorDS->GetLayerCount(); iLayer++ )
+    {
+        OGRLayer *layer = vectorDS->GetLayer(iLayer);
+        OGRCoordinateTransformation *ct = NULL;
+
+        if( layer->GetSpatialRef() != NULL && !imagerySRS.IsEmpty()
+            && !layer->GetSpatialRef()->IsSame(&imagerySRS) )
+        {
+            ct = OGRCreateCoordinateTransformation(layer->GetSpatialRef(),
+                                                   &imagerySRS);
+            if( ct == NULL )
+                exit(1);
+        }
+
+        OGRFeature *feature;
+        layer->ResetReading();
+        while( (feature = layer->GetNextFeature()) != NULL )
+        {
+            OGRGeometry *geom = feature->GetGeometryRef();
+
+            if( geom != NULL && ct != NULL )
+            {
+                if( geom->transform(ct) != OGRERR_NONE )
+                    geom = NULL;
+            }
+
+            if( geom != NULL )
+                addGeometry(geom, invGT);
+
+            OGRFeature::DestroyFeature(feature);
+        }
+
+        if( ct != NULL )
+            OGRCoordinateTransformation::DestroyCT(ct);
+    }
+
+    GDALClose(vectorDS);
+
+    std::sort(edges.begin(), edges.end(), EdgeYMinLess);
+
+    CPLDebug("PLC", "Cloud vector %s has %d polygons, %d edges.",
+             filename.c_str(), polygonCount, (int) edges.size());
+}
+
+/************************************************************************/
+/*                              getSpans()                              */
+/*                                                                      */
+/*      Compute the covered pixel spans for a line as [start,end)       */
+/*      pairs.  A pixel is covered if its center is inside a polygon.   */
+/*      Lines are normally requested in increasing order, so the        */
+/*      active edge list is carried from one call to the next.          */
+/************************************************************************/
+
+void PLCVectorMask::getSpans(int line, std::vector<int> &spans)
+
+{
+    double yCenter = line + 0.5;
+
+    spans.clear();
+
+    if( line < lastLine )
+    {
+        activeEdges.clear();
+        nextEdge = 0;
+    }
+    lastLine = line;
+
+    while( nextEdge < edges.size() && edges[nextEdge].yMin <= yCenter )
+        activeEdges.push_back(nextEdge++);
+
+    std::vector<std::pair<int,double> > crossings;
+    unsigned int iOut = 0;
+
+    for( unsigned int i = 0; i < activeEdges.size(); i++ )
+    {
+        const Edge &edge = edges[activeEdges[i]];
+
+        if( edge.yMax <= yCenter )
+            continue;
+
+        activeEdges[iOut++] = activeEdges[i];
+
+        if( edge.yMin <= yCenter )
+            crossings.push_back(
+                std::pair<int,double>(
+                    edge.polygon,
+                    edge.xAtYMin + (yCenter - edge.yMin) * edge.slope));
+    }
+    activeEdges.resize(iOut);
+
+    std::sort(crossings.begin(), crossings.end());
+
+    unsigned int i = 0;
+    while( i < crossings.size() )
+    {
+        // Pair up the crossings of each polygon (even-odd rule).
+        unsigned int j = i;
+        while( j < crossings.size() 
+               && crossings[j].first == crossings[i].first )
+            j++;
+
+        for( unsigned int k = i; k+1 < j; k += 2 )
+        {
+            int start = (int) ceil(crossings[k].second - 0.5);
+            int end = (int) ceil(crossings[k+1].second - 0.5);
+
+            start = MAX(0,start);
+            end = MIN(width,end);
+
+            if( start < end )
+            {
+                spans.push_back(start);
+                spans.push_back(end);
+            }
+        }
+
+        i = j;
+    }
+}
@@ -0,0 +1,354 @@
+/**
+ * Purpose: Disk cache of per-input qualities, reused across runs.
+ *
+ * Copyright 2016, Planet Labs, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cpl_multiproc.h"
+#include "compositor.h"
+
+#define QC_UNCHECKED   0
+#define QC_CACHED      1
+#define QC_WRITING     2
+#define QC_UNCACHED    3
+
+/************************************************************************/
+/*                             PLCHashKey()                             */
+/*                                                                      */
+/*      64 bit FNV-1a hash, for naming cache files.                     */
+/************************************************************************/
+
+GUIntBig PLCHashKey(const CPLString &key)
+
+{
+    GUIntBig hash = 14695981039346656037ULL;
+
+    for( size_t i = 0; i < key.size(); i++ )
+    {
+        hash ^= (GByte) key[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/************************************************************************/
+/*                            PLCFileStamp()                            */
+/*                                                                      */
+/*      Path, size and modification time of a file, to detect when     */
+/*      it has changed.  Empty for no file.                             */
+/************************************************************************/
+
+CPLString PLCFileStamp(const char *filename)
+
+{
+    CPLString stamp;
+    VSIStatBufL sStat;
+
+    if( filename == NULL || strlen(filename) == 0 )
+        return stamp;
+
+    stamp = filename;
+    if( VSIStatL(filename, &sStat) == 0 )
+        stamp += CPLString().Printf(":%lld:%lld",
+                                    (long long) sStat.st_size,
+                                    (long long) sStat.st_mtime);
+
+    return stamp;
+}
+
+/************************************************************************/
+/*                          PLCQualityCache()                           */
+/*                                                                      */
+/*      Only the leading quality methods that are cacheable are         */
+/*      cached.  The methods after them must not need the imagery or    */
+/*      cloud mask, which are not read for cached inputs.               */
+/************************************************************************/
+
+PLCQualityCache::PLCQualityCache(PLCContext *context)
+
+{
+    this->context = context;
+    directory = context->qualityCacheDir;
+    methodCount = 0;
+
+    // Pre-pass pruning marks pixels invalid, so the qualities computed
+    // are only good for this run.
+    writable = context->tileCandidates.size() == 0;
+
+    while( methodCount < (int) context->qualityMethods.size()
+           && context->qualityMethods[methodCount]->isCacheable() )
+        methodCount++;
+
+    for( int i = methodCount; i < (int) context->qualityMethods.size(); i++ )
+    {
+        QualityMethodBase *method = context->qualityMethods[i];
+
+        if( method->requiresImagery() || method->requiresCloud() )
+        {
+            CPLDebug("PLC", "Quality method %s needs input data, "
+                     "quality cache disabled.", method->getName());
+            methodCount = 0;
+        }
+    }
+
+    for( int i = 0; i < methodCount; i++ )
+        methodKey += context->qualityMethodKeys[i] + "|";
+
+    // The placement of inputs depends on the output grid.
+    double geoTransform[6];
+
+    if( context->outputDS->GetGeoTransform(geoTransform) == CE_None )
+    {
+        for( int i = 0; i < 6; i++ )
+            methodKey += CPLString().Printf("%.17g,", geoTransform[i]);
+    }
+    methodKey += CPLString().Printf("%dx%d|", context->width, context->height);
+    methodKey += context->outputDS->GetProjectionRef();
+
+    state.resize(context->inputFiles.size(), QC_UNCHECKED);
+    cacheDS.resize(context->inputFiles.size(), NULL);
+    linesWritten.resize(context->inputFiles.size(), 0);
+
+    VSIMkdir(directory, 0755);
+}
+
+/************************************************************************/
+/*                          ~PLCQualityCache()                          */
+/*                                                                      */
+/*      Cache files not completely written are discarded.               */
+/************************************************************************/
+
+PLCQualityCache::~PLCQualityCache()
+
+{
+    for( unsigned int i = 0; i < context->inputFiles.size(); i++ )
+        closeInput(context->inputFiles[i], FALSE);
+}
+
+/************************************************************************/
+/*                          getCacheFilename()                          */
+/************************************************************************/
+
+CPLString PLCQualityCache::getCacheFilename(PLCInput *input)
+
+{
+    CPLString name;
+    CPLString key = methodKey + "|" + input->getCacheKey();
+
+    for( int i = 0; i < methodCount; i++ )
+        key += "|" + context->qualityMethods[i]->getCacheKey(input);
+
+    name.Printf("%s_%016llx", CPLGetBasename(input->getFilename()),
+                (unsigned long long) PLCHashKey(key));
+
+    return CPLFormFilename(directory, name, "tif");
+}
+
+/************************************************************************/
+/*                        getTempCacheFilename()                        */
+/*                                                                      */
+/*      Cache files are written under a name of our own, and renamed    */
+/*      into place once complete, so other processes never see a        */
+/*      partial file.                                                   */
+/************************************************************************/
+
+CPLString PLCQualityCache::getTempCacheFilename(PLCInput *input)
+
+{
+    CPLString name;
+
+    name.Printf("%s.%d.tmp", getCacheFilename(input).c_str(), 
+                (int) CPLGetPID());
+
+    return name;
+}
+
+/************************************************************************/
+/*                           getCacheWindow()                           */
+/*                                                                      */
+/*      Cache files hold the part of the input footprint on the         */
+/*      output.                                                         */
+/************************************************************************/
+
+void PLCQualityCache::getCacheWindow(PLCInput *input, int *xOff, int *yOff,
+                                     int *xSize, int *ySize)
+
+{
+    *xOff = MAX(0, input->getXOff());
+    *yOff = MAX(0, input->getYOff());
+    *xSize = MIN(context->width, input->getXOff() + input->getXSize()) - *xOff;
+    *ySize = MIN(context->height, input->getYOff() + input->getYSize())
+        - *yOff;
+}
+
+/************************************************************************/
+/*                              isCached()                              */
+/*                                                                      */
+/*      Is the quality of this input read from the cache?  If not, a    */
+/*      cache file is started for it where possible.                    */
+/************************************************************************/
+
+int PLCQualityCache::isCached(PLCInput *input)
+
+{
+    int i = input->getInputIndex();
+
+    if( methodCount == 0 )
+        return FALSE;
+
+    if( state[i] != QC_UNCHECKED )
+        return state[i] == QC_CACHED;
+
+    CPLString filename = getCacheFilename(input);
+    VSIStatBufL sStat;
+    int xOff, yOff, xSize, ySize;
+
+    getCacheWindow(input, &xOff, &yOff, &xSize, &ySize);
+
+    if( VSIStatL(filename, &sStat) == 0 )
+    {
+        cacheDS[i] = (GDALDataset *) GDALOpen(filename, GA_ReadOnly);
+
+        if( cacheDS[i] != NULL
+            && cacheDS[i]->GetRasterXSize() == xSize
+            && cacheDS[i]->GetRasterYSize() == ySize )
+        {
+            CPLDebug("PLC", "Using cached quality %s for %s.",
+                     filename.c_str(), input->getFilename());
+            state[i] = QC_CACHED;
+            return TRUE;
+        }
+
+        if( cacheDS[i] != NULL )
+            GDALClose(cacheDS[i]);
+        cacheDS[i] = NULL;
+    }
+
+    state[i] = QC_UNCACHED;
+
+    if( !writable || xSize <= 0 || ySize <= 0 )
+        return FALSE;
+
+    GDALDriver *tiffDriver = (GDALDriver *) GDALGetDriverByName("GTiff");
+    CPLStringList createOptions;
+
+    createOptions.AddString("COMPRESS=DEFLATE");
+    createOptions.AddString("PREDICTOR=3");
+
+    cacheDS[i] = tiffDriver->Create(getTempCacheFilename(input), 
+                                    xSize, ySize, 1,
+                                    GDT_Float32, createOptions);
+    if( cacheDS[i] != NULL )
+    {
+        state[i] = QC_WRITING;
+        linesWritten[i] = 0;
+    }
+
+    return FALSE;
+}
+
+/************************************************************************/
+/*                              readLine()                              */
+/************************************************************************/
+
+void PLCQualityCache::readLine(PLCInput *input, int line, PLCLine *lineObj)
+
+{
+    int i = input->getInputIndex();
+    int xOff, yOff, xSize, ySize;
+    float *quality = lineObj->getQuality();
+
+    CPLAssert( state[i] == QC_CACHED );
+
+    getCacheWindow(input, &xOff, &yOff, &xSize, &ySize);
+
+    if( lineObj->hasValidPixels() )
+    {
+        CPLErr eErr = cacheDS[i]->GetRasterBand(1)->
+            RasterIO(GF_Read, 0, line - yOff, xSize, 1,
+                     quality + xOff, xSize, 1, GDT_Float32, 0, 0);
+        if( eErr != CE_None )
+            exit(1);
+
+        // Pixels pruned by a pre-pass this run stay excluded.
+        lineObj->maskQuality(quality);
+    }
+
+    if( line == yOff + ySize - 1 )
+        closeInput(input, TRUE);
+}
+
+/************************************************************************/
+/*                             writeLine()                              */
+/************************************************************************/
+
+void PLCQualityCache::writeLine(PLCInput *input, int line, PLCLine *lineObj)
+
+{
+    int i = input->getInputIndex();
+    int xOff, yOff, xSize, ySize;
+    float *quality = lineObj->getQuality();
+
+    if( state[i] != QC_WRITING )
+        return;
+
+    getCacheWindow(input, &xOff, &yOff, &xSize, &ySize);
+
+    // Values outside the valid spans are undefined, store them as -1.
+    lineObj->maskQuality(quality);
+
+    CPLErr eErr = cacheDS[i]->GetRasterBand(1)->
+        RasterIO(GF_Write, 0, line - yOff, xSize, 1,
+                 quality + xOff, xSize, 1, GDT_Float32, 0, 0);
+    if( eErr != CE_None )
+        exit(1);
+
+    if( ++linesWritten[i] == ySize )
+        closeInput(input, TRUE);
+}
+
+/************************************************************************/
+/*                             closeInput()                             */
+/************************************************************************/
+
+void PLCQualityCache::closeInput(PLCInput *input, int complete)
+
+{
+    int i = input->getInputIndex();
+
+    if( cacheDS[i] == NULL )
+        return;
+
+    if( state[i] != QC_WRITING )
+    {
+        GDALClose(cacheDS[i]);
+        cacheDS[i] = NULL;
+        return;
+    }
+
+    CPLString tempFilename = getTempCacheFilename(input);
+    CPLString filename = getCacheFilename(input);
+
+    GDALClose(cacheDS[i]);
+    cacheDS[i] = NULL;
+    state[i] = QC_UNCACHED;
+
+    if( complete && VSIRename(tempFilename, filename) == 0 )
+        CPLDebug("PLC", "Cached quality of %s in %s.",
+                 input->getFilename(), filename.c_str());
+    else
+        VSIUnlink(tempFilename);
+}
@@ -25,18 +25,11 @@ class QualityFromFile : public QualityMethodBase
     PLCContext *context;
     CPLString file_key;
     CPLString file_suffix;
-    std::vector<GDALDataset*> qualityFiles;
+    CPLString resampling;
     double scale_min, scale_max;
 
 public:
     QualityFromFile() : QualityMethodBase("qualityfromfile") {}
-    ~QualityFromFile() {
-        for(unsigned int i=0; i < qualityFiles.size(); i++ )
-        {
-            GDALClose(qualityFiles[i]);
-        }
-        qualityFiles.resize(0);
-    }
 
     /********************************************************************/
     QualityMethodBase *create(PLCContext* context, WJElement node) {
@@ -52,6 +45,8 @@ public:
                 context->getStratParam("quality_file_scale_min", "0.0"));
             obj->scale_max = CPLAtof(
                 context->getStratParam("quality_file_scale_max", "1.0"));
+            obj->resampling = 
+                context->getStratParam("quality_file_resampling", "nearest");
         }
         else
         {
@@ -59,58 +54,62 @@ public:
             obj->scale_max = WJEDouble(node, "scale_max", WJE_GET, 1.0);
 
             obj->file_key = WJEString(node, "file_key", WJE_GET, "");
+            obj->resampling = WJEString(node, "resampling", WJE_GET, 
+                                        "nearest");
         }
         
         return obj;
     }
 
     /********************************************************************/
-    void collectInputQualityFiles() {
+    CPLString getQualityFilename(PLCInput *input) {
+        if( file_key.size() > 0 )
+            return input->getParm(file_key);
+        else
+            return input->getFilename() + file_suffix;
+    }
 
-        // We have to defer collecting the quality files in the JSON case,
-        // so that the inputFiles objects will be initialized.
+    /********************************************************************/
+    CPLString getCacheKey(PLCInput *input) {
+        return PLCFileStamp(getQualityFilename(input));
+    }
 
-        for(unsigned int i = 0; i < context->inputFiles.size(); i++)
-        {
-            CPLString filename;
+    /********************************************************************/
+    PLCAuxRaster *getQualityFile(PLCInput *input) {
 
-            if( file_key.size() > 0 )
-                filename = context->inputFiles[i]->getParm(file_key);
-            else
-                filename = context->inputFiles[i]->getFilename() + file_suffix;
-            
-            GDALDataset *ds = (GDALDataset*) GDALOpen(filename, GA_ReadOnly);
-            if( ds == NULL )
-            {
-                CPLError(CE_Fatal, CPLE_AppDefined,
-                         "Failed to open quality file %s.", 
-                         filename.c_str());
-            }
-            qualityFiles.push_back(ds);
-        }
+        // Files are only opened for inputs that are actually used, and
+        // are held by the input so they are closed with it once its
+        // last line is done.  Quality files may be at an integer
+        // fraction of the imagery resolution.
+
+        return input->getAuxRaster(getQualityFilename(input), resampling);
     }
 
     /********************************************************************/
-    int computeQuality(PLCInput *input, PLCLine *lineObj) {
+    int requiresImagery() { return FALSE; }
 
-        if( qualityFiles.size() == 0 )
-            collectInputQualityFiles();
+    /********************************************************************/
+    int requiresCloud() { return FALSE; }
 
-        int width = lineObj->getWidth();
+    /********************************************************************/
+    int computeQuality(PLCInput *input, PLCLine *lineObj) {
+
+        const std::vector<int> &spans = lineObj->getValidSpans();
         float *quality = lineObj->getNewQuality();
-        CPLErr eErr;
-        GDALRasterBand *band = qualityFiles[input->getInputIndex()]->GetRasterBand(1);
-
-        eErr = band->RasterIO(GF_Read, 0, context->line, width, 1, 
-                              quality, width, 1, GDT_Float32,
-                              0, 0);
-        if( eErr != CE_None )
-            exit(1);
+
+        if( spans.size() == 0 )
+            return TRUE;
+
+        input->readAuxLine(getQualityFile(input), context->line, 
+                           quality, GDT_Float32);
         
         if( scale_max != 1.0 || scale_min != 0.0)
         {
-            for(int i=0; i < width; i++ )
-                quality[i] = (quality[i] - scale_min) / (scale_max - scale_min);
+            for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
+            {
+                for(int i=spans[iSpan]; i < spans[iSpan+1]; i++ )
+                    quality[i] = (quality[i] - scale_min) / (scale_max - scale_min);
+            }
         }
 
         return TRUE;
@@ -70,6 +70,7 @@ QualityMethodBase *QualityMethodBase::CreateQualityFunction(
 /************************************************************************/
 
 int QualityMethodBase::computeStackQuality(PLCContext *context,
+                                           std::vector<PLCInput *> &inputs,
                                            std::vector<PLCLine *> &lines)
 
 {
@@ -77,7 +78,7 @@ int QualityMethodBase::computeStackQuality(PLCContext *context,
     
     for( unsigned int iInput=0; iInput < lines.size(); iInput++)
     {
-        if( !computeQuality(context->inputFiles[iInput], lines[iInput]) )
+        if( !computeQuality(inputs[iInput], lines[iInput]) )
             result = FALSE;
     }
 
@@ -94,16 +95,42 @@ void QualityMethodBase::mergeQuality(PLCInput *input, PLCLine *line)
 
 {
     float *quality = line->getQuality();
-    float *newQuality = line->getNewQuality();
+    const std::vector<int> &spans = line->getValidSpans();
+    float uniformQuality;
 
-    for(int i=0; i < line->getWidth(); i++)
+    // Invalid pixels already have a quality of -1.
+    if( line->getNewQualityUniform(&uniformQuality) )
     {
-        if( newQuality[i] < 0.0 || quality[i] < 0.0 )
-            quality[i] = -1.0;
-        else
-            quality[i] = quality[i] * newQuality[i];
-
-        // reset new quality to default.
-        newQuality[i] = 1.0;
+        if( uniformQuality != 1.0 )
+        {
+            for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
+            {
+                for(int i=spans[iSpan]; i < spans[iSpan+1]; i++)
+                {
+                    if( uniformQuality < 0.0 || quality[i] < 0.0 )
+                        quality[i] = -1.0;
+                    else
+                        quality[i] = quality[i] * uniformQuality;
+                }
+            }
+        }
+    }
+    else
+    {
+        float *newQuality = line->getNewQuality();
+
+        for(unsigned int iSpan=0; iSpan < spans.size(); iSpan += 2)
+        {
+            for(int i=spans[iSpan]; i < spans[iSpan+1]; i++)
+            {
+                if( newQuality[i] < 0.0 || quality[i] < 0.0 )
+                    quality[i] = -1.0;
+                else
+                    quality[i] = quality[i] * newQuality[i];
+            }
+        }
     }
+
+    // reset new quality to default.
+    line->setNewQualityUniform(1.0);
 }
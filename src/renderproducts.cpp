@@ -0,0 +1,266 @@
+/**
+ * Purpose: Render outputs from a source map, without quality evaluation.
+ *
+ * Copyright 2016, Planet Labs, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compositor.h"
+
+/************************************************************************/
+/*                          GatherFromSource()                          */
+/*                                                                      */
+/*      Fill the bands and alpha of lineObj from the inputs named by    */
+/*      the source map line (1 based, 0 for none).  inputs is           */
+/*      indexed by input index and may hold NULLs.  Each input is       */
+/*      only read for the blocks of pixels it supplies.                 */
+/************************************************************************/
+
+void GatherFromSource(PLCContext *plContext, int line,
+                      std::vector<PLCInput *> &inputs,
+                      const unsigned short *source, PLCLine *lineObj)
+
+{
+    int iPixel, width = lineObj->getWidth();
+    GByte *dst_alpha = lineObj->getAlpha();
+    std::vector<PLCLine *> inputLines(inputs.size(), NULL);
+    std::vector<GByte> used(width);
+    unsigned int i;
+
+    for( i = 0; i < inputs.size(); i++ )
+    {
+        if( inputs[i] == NULL || !inputs[i]->intersectsLine(line) )
+            continue;
+
+        int useCount = 0;
+
+        for( iPixel = 0; iPixel < width; iPixel++ )
+        {
+            used[iPixel] = (source[iPixel] == i+1);
+            useCount += used[iPixel];
+        }
+
+        if( useCount == 0 )
+            continue;
+
+        inputLines[i] = inputs[i]->getLine(line, PLC_NO_BANDS);
+        inputs[i]->readImagery(inputLines[i], line, &(used[0]));
+    }
+
+    for( iPixel = 0; iPixel < width; iPixel++ )
+    {
+        PLCLine *sourceLine = NULL;
+
+        if( source[iPixel] != 0 && source[iPixel] <= inputs.size() )
+            sourceLine = inputLines[source[iPixel]-1];
+
+        if( sourceLine == NULL || !sourceLine->isValid(iPixel) )
+        {
+            dst_alpha[iPixel] = 0;
+            continue;
+        }
+
+        for( int iBand = 0; iBand < lineObj->getBandCount(); iBand++ )
+            lineObj->getBand(iBand)[iPixel] =
+                sourceLine->getBand(iBand)[iPixel];
+        dst_alpha[iPixel] = 255;
+    }
+
+    for( i = 0; i < inputs.size(); i++ )
+    {
+        delete inputLines[i];
+
+        if( inputs[i] != NULL
+            && line == inputs[i]->getYOff() + inputs[i]->getYSize() - 1 )
+            inputs[i]->releaseDS();
+    }
+}
+
+/************************************************************************/
+/*                             PLCProduct()                             */
+/************************************************************************/
+
+PLCProduct::PLCProduct()
+
+{
+    DS = NULL;
+}
+
+/************************************************************************/
+/*                            ~PLCProduct()                             */
+/************************************************************************/
+
+PLCProduct::~PLCProduct()
+
+{
+    for( unsigned int i = 0; i < inputs.size(); i++ )
+        delete inputs[i];
+
+    if( DS != NULL )
+        GDALClose(DS);
+}
+
+/************************************************************************/
+/*                             initialize()                             */
+/*                                                                      */
+/*      Open the product output, which must be on the output grid,      */
+/*      and place each input's variant file for this product.           */
+/************************************************************************/
+
+void PLCProduct::initialize(PLCContext *plContext)
+
+{
+    DS = (GDALDataset *) GDALOpen(outputFilename, GA_Update);
+    if( DS == NULL )
+        exit(1);
+
+    if( DS->GetRasterXSize() != plContext->width
+        || DS->GetRasterYSize() != plContext->height )
+    {
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "Product %s is %dx%d, but the output is %dx%d.",
+                 outputFilename.c_str(),
+                 DS->GetRasterXSize(), DS->GetRasterYSize(),
+                 plContext->width, plContext->height);
+    }
+
+    for( unsigned int i = 0; i < plContext->inputFiles.size(); i++ )
+    {
+        PLCInput *input = plContext->inputFiles[i];
+        const char *variantFilename = input->getFilename();
+
+        if( !EQUAL(inputKey, "") )
+            variantFilename = input->getParm(inputKey, NULL);
+
+        if( variantFilename == NULL )
+        {
+            CPLDebug("PLC", "Input %s has no %s for product %s.",
+                     input->getFilename(), inputKey.c_str(),
+                     outputFilename.c_str());
+            inputs.push_back(NULL);
+            continue;
+        }
+
+        PLCInput *variant = input->createVariant(variantFilename);
+        variant->Initialize(plContext);
+        inputs.push_back(variant);
+    }
+}
+
+/************************************************************************/
+/*                             renderLine()                             */
+/************************************************************************/
+
+void PLCProduct::renderLine(PLCContext *plContext, int line,
+                            const unsigned short *source)
+
+{
+    int i, width = plContext->width;
+    PLCLine lineObj(width);
+
+    for( i = 0; i < DS->GetRasterCount(); i++ )
+    {
+        if( DS->GetRasterBand(i+1)->GetColorInterpretation() != GCI_AlphaBand )
+            lineObj.getBand(i);
+    }
+
+    GatherFromSource(plContext, line, inputs, source, &lineObj);
+
+    for( i = 0; i < DS->GetRasterCount(); i++ )
+    {
+        CPLErr eErr;
+        GDALRasterBand *band = DS->GetRasterBand(i+1);
+
+        if( band->GetColorInterpretation() == GCI_AlphaBand )
+            eErr = band->RasterIO(
+                GF_Write, 0, line, width, 1,
+                lineObj.getAlpha(), width, 1, GDT_Byte, 0, 0);
+        else
+            eErr = band->RasterIO(
+                GF_Write, 0, line, width, 1,
+                lineObj.getBand(i), width, 1, GDT_Float32, 0, 0);
+
+        if( eErr != CE_None )
+            exit(1);
+    }
+}
+
+/************************************************************************/
+/*                       RenderFromSourceTrace()                        */
+/*                                                                      */
+/*      Render the output, and any products, from an existing source    */
+/*      trace.  No quality is computed, each output only costs          */
+/*      reading the pixels the source trace selects.                    */
+/************************************************************************/
+
+void RenderFromSourceTrace(PLCContext *plContext)
+
+{
+    GDALDataset *sourceDS = (GDALDataset *)
+        GDALOpen(plContext->renderSourceTraceFilename, GA_ReadOnly);
+    if( sourceDS == NULL )
+        exit(1);
+
+    if( sourceDS->GetRasterXSize() != plContext->width
+        || sourceDS->GetRasterYSize() != plContext->height )
+    {
+        CPLError(CE_Fatal, CPLE_AppDefined,
+                 "Source trace %s is %dx%d, but the output is %dx%d.",
+                 plContext->renderSourceTraceFilename.c_str(),
+                 sourceDS->GetRasterXSize(), sourceDS->GetRasterYSize(),
+                 plContext->width, plContext->height);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      The source trace records the inputs it was built from.  They    */
+/*      should be the same inputs, in the same order.                   */
+/* -------------------------------------------------------------------- */
+    for( unsigned int i = 0; i < plContext->inputFiles.size(); i++ )
+    {
+        CPLString key;
+        key.Printf("SOURCE_%d", i+1);
+
+        const char *traceSource = sourceDS->GetMetadataItem(key);
+        const char *inputFile = plContext->inputFiles[i]->getFilename();
+
+        if( traceSource != NULL
+            && !EQUAL(CPLGetFilename(traceSource), CPLGetFilename(inputFile)) )
+            CPLError(CE_Warning, CPLE_AppDefined,
+                     "Source trace input %d is %s, but %s was given.",
+                     i+1, traceSource, inputFile);
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Process all lines.                                              */
+/* -------------------------------------------------------------------- */
+    for( int line = 0; line < plContext->height; line++ )
+    {
+        PLCLine *lineObj = plContext->getNextOutputLine();
+
+        CPLAssert( plContext->line == line );
+
+        CPLErr eErr = sourceDS->GetRasterBand(1)->RasterIO(
+            GF_Read, 0, line, plContext->width, 1,
+            lineObj->getSource(), plContext->width, 1, GDT_UInt16, 0, 0);
+        if( eErr != CE_None )
+            exit(1);
+
+        GatherFromSource(plContext, line, plContext->inputFiles,
+                         lineObj->getSource(), lineObj);
+
+        plContext->writeOutputLine(true);
+    }
+
+    GDALClose(sourceDS);
+}
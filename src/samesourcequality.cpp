@@ -49,41 +49,63 @@ public:
         return obj;
     }
 
+    /********************************************************************/
+    int getUpperBound(PLCInput *input, double *bound) {
+        // Penalties only ever reduce quality.
+        *bound = 1.0;
+        return TRUE;
+    }
+
+    /********************************************************************/
+    // Depends on the previous output line.
+    int isCacheable() { return FALSE; }
+
+    /********************************************************************/
+    int requiresImagery() { return FALSE; }
+
+    /********************************************************************/
+    int requiresCloud() { return FALSE; }
+
     /********************************************************************/
     int computeQuality(PLCInput *input, PLCLine *lineObj) {
         PLCLine *lastOutputLine = context->getLastOutputLine();
-        float *newQuality = lineObj->getNewQuality();
 
         if( lastOutputLine == NULL )
         {
-            for(int i=lineObj->getWidth()-1; i >= 0; i--)
-                newQuality[i] = 1.0;
+            lineObj->setNewQualityUniform(1.0);
             return TRUE;
         }
 
+        float *newQuality = lineObj->getNewQuality();
+        const std::vector<int> &spans = lineObj->getValidSpans();
+        unsigned int iSpan;
+
         unsigned short *lastSource = lastOutputLine->getSource();
         float singlePenalty = mismatchPenalty / 3.0;
         
-        for(int i=lineObj->getWidth()-1; i >= 0; i--)
+        for(iSpan=0; iSpan < spans.size(); iSpan += 2)
         {
-            float thisQuality = 1.0;
-
-            // compare to top left
-            if( i > 0 && lastSource[i-1] != 0
-                && lastSource[i-1] != input->getInputIndex()+1 )
-                thisQuality -= singlePenalty;
-
-            // compare to top right
-            if( i < lineObj->getWidth()-1 && lastSource[i+1] != 0
-                && lastSource[i+1] != input->getInputIndex()+1 )
-                thisQuality -= singlePenalty;
-
-            // compare to top
-            if( lastSource[i] != 0
-                && lastSource[i] != input->getInputIndex()+1 )
-                thisQuality -= singlePenalty;
-
-            newQuality[i] = thisQuality;
+            for(int i=spans[iSpan]; i < spans[iSpan+1]; i++)
+            {
+                float thisQuality = 1.0;
+
+                // compare to top left
+                if( i > 0 && lastSource[i-1] != 0
+                    && lastSource[i-1] != input->getInputIndex()+1 )
+                    thisQuality -= singlePenalty;
+
+                // compare to top right
+                if( i < lineObj->getWidth()-1 && lastSource[i+1] != 0
+                    && lastSource[i+1] != input->getInputIndex()+1 )
+                    thisQuality -= singlePenalty;
+
+                // compare to top
+                if( lastSource[i] != 0
+                    && lastSource[i] != input->getInputIndex()+1 )
+                    thisQuality -= singlePenalty;
+
+                newQuality[i] = thisQuality;
+            }
         }
         
         return TRUE;
@@ -95,26 +95,27 @@ public:
 
 
     /********************************************************************/
-    int computeQuality(PLCInput *input, PLCLine *lineObj) {
+    int getUpperBound(PLCInput *input, double *bound) {
         if( measureValues.size() == 0 )
             initializeFromInputFiles();
 
-        float *quality = lineObj->getNewQuality();
-        int width = lineObj->getWidth();
-        float measureValue = measureValues[input->getInputIndex()];
+        *bound = measureValues[input->getInputIndex()];
+        return TRUE;
+    }
 
-        for(int iBand=0; iBand < lineObj->getBandCount(); iBand++)
-        {
-            for(int i=0; i < width; i++ )
-                quality[i] = measureValue;
-        }
-    
-        GByte *alpha = lineObj->getAlpha();
-        for(int i=0; i < width; i++ )
-        {
-            if( alpha[i] < 128 )
-                quality[i] = -1.0;
-        }
+    /********************************************************************/
+    int requiresImagery() { return FALSE; }
+
+    /********************************************************************/
+    int requiresCloud() { return FALSE; }
+
+    /********************************************************************/
+    int computeQuality(PLCInput *input, PLCLine *lineObj) {
+        if( measureValues.size() == 0 )
+            initializeFromInputFiles();
+
+        // The same for every pixel of the scene.
+        lineObj->setNewQualityUniform(measureValues[input->getInputIndex()]);
 
         return TRUE;
     }
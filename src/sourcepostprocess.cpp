@@ -19,8 +19,10 @@
 #include "compositor.h"
 #include "gdal_alg.h"
 
-static void RebuildOutputFromSourceMap(PLCContext *plContext);
-static void RebuildOutputLineFromSourceMap(PLCContext *plContext, int line);
+static int RebuildOutputFromSourceMap(PLCContext *plContext,
+                                      GDALDataset *sievedDS);
+static int RebuildOutputLineFromSourceMap(PLCContext *plContext, int line,
+                                          GDALRasterBand *sievedBand);
 
 /************************************************************************/
 /*                         SourcePostProcess()                          */
@@ -48,15 +50,32 @@ void SourcePostProcess(PLCContext *plContext)
     }
 
 /* -------------------------------------------------------------------- */
-/*      Do the sieve filtering.                                         */
+/*      Sieve into a temporary copy of the source map, so that we       */
+/*      can tell which pixels the sieve changed.  Sieved source maps    */
+/*      are mostly large uniform areas and compress well.               */
 /* -------------------------------------------------------------------- */
     GDALRasterBand *poSourceMapBand =
         plContext->sourceTraceDS->GetRasterBand(1);
+    GDALDriver *tiffDriver = (GDALDriver *) GDALGetDriverByName("GTiff");
+    CPLString sievedFilename = CPLGenerateTempFilename("plc_sieve");
+    CPLStringList createOptions;
+
+    sievedFilename += ".tif";
+    createOptions.AddString("COMPRESS=LZW");
+    createOptions.AddString("TILED=YES");
+
+    GDALDataset *sievedDS = 
+        tiffDriver->Create(sievedFilename, 
+                           plContext->width, plContext->height, 1,
+                           poSourceMapBand->GetRasterDataType(), 
+                           createOptions);
+    if( sievedDS == NULL )
+        exit(1);
 
     CPLErr eErr = GDALSieveFilter(
         (GDALRasterBandH) poSourceMapBand,
         NULL,
-        (GDALRasterBandH) poSourceMapBand,
+        (GDALRasterBandH) sievedDS->GetRasterBand(1),
         plContext->sourceSieveThreshold,
         4,
         NULL,
@@ -67,51 +86,124 @@ void SourcePostProcess(PLCContext *plContext)
         exit(1);
     
 /* -------------------------------------------------------------------- */
-/*      Rebuild the output result image.                                */
+/*      Rebuild the output result image where the source changed,       */
+/*      and update the source map to match.                             */
 /* -------------------------------------------------------------------- */
-    RebuildOutputFromSourceMap(plContext);
+    int changedLines = RebuildOutputFromSourceMap(plContext, sievedDS);
+
+    CPLDebug("PLC", "Source sieve changed %d of %d lines.",
+             changedLines, plContext->height);
+
+    GDALClose(sievedDS);
+    tiffDriver->Delete(sievedFilename);
 }
 
 /************************************************************************/
 /*                   RebulidOutputLineFromSourceMap()                   */
+/*                                                                      */
+/*      Compare the sieved source map line to the original and          */
+/*      repaint only the pixels whose source changed, reading           */
+/*      imagery only from their new sources.  Returns FALSE if the      */
+/*      line did not change and nothing was done.                       */
 /************************************************************************/
 
-static void RebuildOutputLineFromSourceMap(PLCContext *plContext,
-                                           int line)
+static int RebuildOutputLineFromSourceMap(PLCContext *plContext, int line,
+                                          GDALRasterBand *sievedBand)
 
 {
-    PLCLine *lineObj = plContext->getNextOutputLine();
-    GByte *dst_alpha = lineObj->getAlpha();
-    unsigned int i, iPixel, width=lineObj->getWidth();
-
-    CPLAssert( plContext->line == line );
+    unsigned int i, iPixel, width=plContext->width;
 
 /* -------------------------------------------------------------------- */
-/*      Read the source map for this line.                              */
+/*      Read the original and sieved source map for this line, and      */
+/*      find the changed pixels.                                        */
 /* -------------------------------------------------------------------- */
-    unsigned short *source = lineObj->getSource();
+    std::vector<unsigned short> oldSource(width);
+    std::vector<unsigned short> source(width);
 
     CPLErr eErr = plContext->sourceTraceDS->GetRasterBand(1)->RasterIO(
         GF_Read, 0, line, width, 1, 
-        source, width, 1, GDT_UInt16, 0, 0);
-
+        &(oldSource[0]), width, 1, GDT_UInt16, 0, 0);
+    if( eErr == CE_None )
+        eErr = sievedBand->RasterIO(
+            GF_Read, 0, line, width, 1, 
+            &(source[0]), width, 1, GDT_UInt16, 0, 0);
     if( eErr != CE_None )
         exit( 1 );
+
+    std::vector<GByte> changed(width, 0);
+    int changeCount = 0;
+
+    for( iPixel = 0; iPixel < width; iPixel++ )
+    {
+        if( source[iPixel] != oldSource[iPixel] )
+        {
+            changed[iPixel] = 1;
+            changeCount++;
+        }
+    }
+
+    if( changeCount == 0 )
+        return FALSE;
+
+/* -------------------------------------------------------------------- */
+/*      Fetch the current output line.                                  */
+/* -------------------------------------------------------------------- */
+    plContext->line = line - 1;
+
+    PLCLine *lineObj = plContext->getNextOutputLine();
+    GByte *dst_alpha = lineObj->getAlpha();
+
+    CPLAssert( plContext->line == line );
+
+    memcpy(lineObj->getSource(), &(source[0]), 
+           sizeof(unsigned short) * width);
     
 /* -------------------------------------------------------------------- */
-/*      Read inputs.                                                    */
+/*      Read the new sources, with imagery only for the blocks          */
+/*      holding pixels they now supply.  Inputs that supply no          */
+/*      changed pixel are not read at all.                              */
 /* -------------------------------------------------------------------- */
+    std::vector<PLCInput *> inputs;
     std::vector<PLCLine *> inputLines;
+    std::vector<GByte> used(width);
 
-    for(i = 0; i < plContext->inputFiles.size(); i++ )
-        inputLines.push_back(plContext->inputFiles[i]->getLine(line));
+    plContext->getLineInputs(line, inputs);
+    inputLines.resize(plContext->inputFiles.size(), NULL);
+
+    for(i = 0; i < inputs.size(); i++ )
+    {
+        int sourceValue = inputs[i]->getInputIndex() + 1;
+        int useCount = 0;
+
+        for( iPixel = 0; iPixel < width; iPixel++ )
+        {
+            used[iPixel] = changed[iPixel] && source[iPixel] == sourceValue;
+            useCount += used[iPixel];
+        }
+
+        if( useCount == 0 )
+            continue;
+
+        PLCLine *inputLine = inputs[i]->getLine(line, PLC_NO_BANDS);
+
+        inputs[i]->readImagery(inputLine, line, &(used[0]));
+        inputLines[inputs[i]->getInputIndex()] = inputLine;
+    }
 
 /* -------------------------------------------------------------------- */
-/*      Build output based on source map.                               */
+/*      Repaint the changed pixels.                                     */
 /* -------------------------------------------------------------------- */
     for( iPixel = 0; iPixel < width; iPixel++ )
     {
-        if( source[iPixel] == 0 )
+        if( !changed[iPixel] )
+            continue;
+
+        // The sieve may assign a source that does not cover the pixel.
+        PLCLine *sourceLine = NULL;
+        if( source[iPixel] != 0 )
+            sourceLine = inputLines[source[iPixel]-1];
+
+        if( sourceLine == NULL || !sourceLine->isValid(iPixel) )
             dst_alpha[iPixel] = 0;
         else
         {
@@ -119,8 +211,7 @@ static void RebuildOutputLineFromSourceMap(PLCContext *plContext,
             {
                 float *dst_pixels = lineObj->getBand(iBand);
 
-                dst_pixels[iPixel] = 
-                        inputLines[source[iPixel]-1]->getBand(iBand)[iPixel];
+                dst_pixels[iPixel] = sourceLine->getBand(iBand)[iPixel];
             }
             dst_alpha[iPixel] = 255;
         }
@@ -129,33 +220,53 @@ static void RebuildOutputLineFromSourceMap(PLCContext *plContext,
 /* -------------------------------------------------------------------- */
 /*      Cleanup input lines.                                            */
 /* -------------------------------------------------------------------- */
-    for(i = 0; i < plContext->inputFiles.size(); i++ )
-        delete inputLines[i];
+    for(i = 0; i < inputs.size(); i++ )
+    {
+        delete inputLines[inputs[i]->getInputIndex()];
+
+        if( line == inputs[i]->getYOff() + inputs[i]->getYSize() - 1 )
+            inputs[i]->releaseDS();
+    }
 
 /* -------------------------------------------------------------------- */
-/*      Write out the image pixels and alpha.                           */
+/*      Write out the image pixels and alpha, and the sieved source.    */
 /* -------------------------------------------------------------------- */
     plContext->writeOutputLine(true);
+
+    eErr = plContext->sourceTraceDS->GetRasterBand(1)->RasterIO(
+        GF_Write, 0, line, width, 1, 
+        &(source[0]), width, 1, GDT_UInt16, 0, 0);
+    if( eErr != CE_None )
+        exit( 1 );
+
+    return TRUE;
 }
 
 /************************************************************************/
 /*                     RebulidOutputFromSourceMap()                     */
 /************************************************************************/
 
-static void RebuildOutputFromSourceMap(PLCContext *plContext)
+static int RebuildOutputFromSourceMap(PLCContext *plContext,
+                                      GDALDataset *sievedDS)
 
 {
+    int changedLines = 0;
+
 /* -------------------------------------------------------------------- */
-/*      Reset reader.                                                   */
-/* -------------------------------------------------------------------- */
-    plContext->line = -1;
-    
-/* -------------------------------------------------------------------- */
-/*      Process all lines.                                              */
+/*      Process all lines, skipping those the sieve did not change.     */
 /* -------------------------------------------------------------------- */
     for(int line=0; line < plContext->outputDS->GetRasterYSize(); line++ )
     {
-        RebuildOutputLineFromSourceMap(plContext, line);
+        if( RebuildOutputLineFromSourceMap(plContext, line, 
+                                           sievedDS->GetRasterBand(1)) )
+            changedLines++;
     }
-}
 
+/* -------------------------------------------------------------------- */
+/*      Close any inputs left open by lines we skipped.                 */
+/* -------------------------------------------------------------------- */
+    for(unsigned int i=0; i < plContext->inputFiles.size(); i++ )
+        plContext->inputFiles[i]->releaseDS();
+
+    return changedLines;
+}
@@ -0,0 +1,205 @@
+/**
+ * Purpose: Per pixel statistics of the input stack.
+ *
+ * Copyright 2016, Planet Labs, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <float.h>
+#include "compositor.h"
+
+static const char *statisticNames[PLC_STATISTIC_COUNT] = 
+{ "mean", "stddev", "min", "max", "count" };
+
+/************************************************************************/
+/*                         PLCStackStatistics()                         */
+/*                                                                      */
+/*      Create the statistics output, or open it to carry on when       */
+/*      resuming.                                                       */
+/************************************************************************/
+
+PLCStackStatistics::PLCStackStatistics(PLCContext *context, int resume)
+
+{
+    this->context = context;
+
+    bandCount = 0;
+    for( int i = 0; i < context->outputDS->GetRasterCount(); i++ )
+    {
+        if( context->outputDS->GetRasterBand(i+1)->GetColorInterpretation()
+            != GCI_AlphaBand )
+            bandCount = i+1;
+    }
+
+    if( resume )
+    {
+        DS = (GDALDataset *) GDALOpen(context->statisticsFilename, GA_Update);
+        if( DS == NULL )
+            exit(1);
+        return;
+    }
+
+    GDALDriver *tiffDriver = (GDALDriver *) GDALGetDriverByName("GTiff");
+    CPLStringList createOptions;
+
+    createOptions.AddString("COMPRESS=DEFLATE");
+    createOptions.AddString("PREDICTOR=3");
+
+    DS = tiffDriver->Create(context->statisticsFilename,
+                            context->width, context->height,
+                            bandCount * PLC_STATISTIC_COUNT,
+                            GDT_Float32, createOptions);
+    if( DS == NULL )
+        exit(1);
+
+    DS->SetProjection(context->outputDS->GetProjectionRef());
+
+    double geotransform[6];
+    context->outputDS->GetGeoTransform(geotransform);
+    DS->SetGeoTransform(geotransform);
+
+    for( int iBand = 0; iBand < bandCount; iBand++ )
+    {
+        for( int iStat = 0; iStat < PLC_STATISTIC_COUNT; iStat++ )
+        {
+            DS->GetRasterBand(iBand * PLC_STATISTIC_COUNT + iStat + 1)->
+                SetDescription(CPLString().Printf("band_%d_%s", iBand+1,
+                                                  statisticNames[iStat]));
+        }
+    }
+}
+
+/************************************************************************/
+/*                        ~PLCStackStatistics()                         */
+/************************************************************************/
+
+PLCStackStatistics::~PLCStackStatistics()
+
+{
+    GDALClose(DS);
+}
+
+/************************************************************************/
+/*                            getWeights()                              */
+/*                                                                      */
+/*      Each input is weighted by its final quality, and only counted   */
+/*      where that is positive.                                         */
+/************************************************************************/
+
+void PLCStackStatistics::getWeights(std::vector<PLCLine *> &inputLines,
+                                    std::vector< std::vector<float> > &weights)
+
+{
+    weights.resize(inputLines.size());
+
+    for( unsigned int i = 0; i < inputLines.size(); i++ )
+    {
+        const std::vector<int> &spans = inputLines[i]->getValidSpans();
+        float *quality = inputLines[i]->getQuality();
+
+        weights[i].assign(context->width, 0.0);
+
+        for( unsigned int iSpan = 0; iSpan < spans.size(); iSpan += 2 )
+        {
+            for( int iPixel = spans[iSpan]; iPixel < spans[iSpan+1]; iPixel++ )
+            {
+                if( quality[iPixel] > 0.0 )
+                    weights[i][iPixel] = quality[iPixel];
+            }
+        }
+    }
+}
+
+/************************************************************************/
+/*                            processLine()                             */
+/*                                                                      */
+/*      Accumulate the weighted moments of each band one input at a     */
+/*      time, with West's weighted form of Welford's update, and        */
+/*      write the statistics of the line.                               */
+/************************************************************************/
+
+void PLCStackStatistics::processLine(int line, 
+                                     std::vector<PLCLine *> &inputLines,
+                                     std::vector< std::vector<float> > &weights)
+
+{
+    int iPixel, width = context->width;
+    std::vector<double> weightSum(width), mean(width), m2(width);
+    std::vector<float> minimum(width), maximum(width), count(width);
+    std::vector<float> result(width);
+
+    for( int iBand = 0; iBand < bandCount; iBand++ )
+    {
+        std::fill(weightSum.begin(), weightSum.end(), 0.0);
+        std::fill(mean.begin(), mean.end(), 0.0);
+        std::fill(m2.begin(), m2.end(), 0.0);
+        std::fill(minimum.begin(), minimum.end(), FLT_MAX);
+        std::fill(maximum.begin(), maximum.end(), -FLT_MAX);
+        std::fill(count.begin(), count.end(), 0.0);
+
+        for( unsigned int i = 0; i < inputLines.size(); i++ )
+        {
+            const float *weight = &(weights[i][0]);
+            const float *value = inputLines[i]->getBand(iBand);
+
+            for( iPixel = 0; iPixel < width; iPixel++ )
+            {
+                if( weight[iPixel] <= 0.0 )
+                    continue;
+
+                double delta = value[iPixel] - mean[iPixel];
+
+                weightSum[iPixel] += weight[iPixel];
+                mean[iPixel] += delta * weight[iPixel] / weightSum[iPixel];
+                m2[iPixel] += weight[iPixel] * delta 
+                    * (value[iPixel] - mean[iPixel]);
+
+                minimum[iPixel] = MIN(minimum[iPixel], value[iPixel]);
+                maximum[iPixel] = MAX(maximum[iPixel], value[iPixel]);
+                count[iPixel] += 1.0;
+            }
+        }
+
+/* -------------------------------------------------------------------- */
+/*      Write out each statistic, zero where there was no input.        */
+/* -------------------------------------------------------------------- */
+        for( int iStat = 0; iStat < PLC_STATISTIC_COUNT; iStat++ )
+        {
+            for( iPixel = 0; iPixel < width; iPixel++ )
+            {
+                if( count[iPixel] == 0.0 )
+                    result[iPixel] = 0.0;
+                else if( iStat == 0 )
+                    result[iPixel] = mean[iPixel];
+                else if( iStat == 1 )
+                    result[iPixel] = sqrt(MAX(0.0, m2[iPixel]) 
+                                          / weightSum[iPixel]);
+                else if( iStat == 2 )
+                    result[iPixel] = minimum[iPixel];
+                else if( iStat == 3 )
+                    result[iPixel] = maximum[iPixel];
+                else
+                    result[iPixel] = count[iPixel];
+            }
+
+            CPLErr eErr = 
+                DS->GetRasterBand(iBand * PLC_STATISTIC_COUNT + iStat + 1)->
+                RasterIO(GF_Write, 0, line, width, 1, 
+                         &(result[0]), width, 1, GDT_Float32, 0, 0);
+            if( eErr != CE_None )
+                exit(1);
+        }
+    }
+}
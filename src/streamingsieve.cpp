@@ -0,0 +1,476 @@
+/**
+ * Purpose: Streaming source map sieve applied while compositing.
+ *
+ * Copyright 2016, Planet Labs, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include "compositor.h"
+
+/************************************************************************/
+/*                         PLCStreamingSieve()                          */
+/************************************************************************/
+
+PLCStreamingSieve::PLCStreamingSieve(PLCContext *context)
+
+{
+    this->context = context;
+    width = context->width;
+    threshold = context->sourceSieveThreshold;
+    firstLine = 0;
+    lastLine = -1;
+    seedLines = 0;
+
+    // A region smaller than the threshold is never taller than the
+    // threshold, so a window that tall sieves exactly.  Larger
+    // thresholds are capped to bound memory unless a window is given.
+    window = context->sourceSieveWindow;
+    if( window <= 0 )
+        window = MIN(threshold, 256);
+    window = MAX(window, 2);
+
+    if( context->averageBestRatio > 0.0 )
+    {
+        CPLError( CE_Fatal, CPLE_AppDefined,
+                  "source_sieve_threshold and average_best_ratio set, "
+                  "they are mutually exclusive.");
+        exit(1);
+    }
+}
+
+/************************************************************************/
+/*                         ~PLCStreamingSieve()                         */
+/************************************************************************/
+
+PLCStreamingSieve::~PLCStreamingSieve()
+
+{
+    for( unsigned int i = 0; i < rows.size(); i++ )
+        delete rows[i];
+}
+
+/************************************************************************/
+/*                              newLabel()                              */
+/************************************************************************/
+
+int PLCStreamingSieve::newLabel(unsigned short source, int line)
+
+{
+    parent.push_back(parent.size());
+    size.push_back(0);
+    firstRow.push_back(line);
+    lastRow.push_back(line);
+    value.push_back(source);
+    settled.push_back(FALSE);
+
+    return parent.size() - 1;
+}
+
+/************************************************************************/
+/*                                find()                                */
+/************************************************************************/
+
+int PLCStreamingSieve::find(int label)
+
+{
+    int root = label;
+
+    while( parent[root] != root )
+        root = parent[root];
+
+    while( parent[label] != root )
+    {
+        int next = parent[label];
+        parent[label] = root;
+        label = next;
+    }
+
+    return root;
+}
+
+/************************************************************************/
+/*                                join()                                */
+/*                                                                      */
+/*      Union two regions, returning the new root.                      */
+/************************************************************************/
+
+int PLCStreamingSieve::join(int a, int b)
+
+{
+    a = find(a);
+    b = find(b);
+
+    if( a == b )
+        return a;
+
+    if( size[a] < size[b] )
+        std::swap(a, b);
+
+    parent[b] = a;
+    size[a] += size[b];
+    firstRow[a] = MIN(firstRow[a], firstRow[b]);
+    lastRow[a] = MAX(lastRow[a], lastRow[b]);
+    settled[a] = settled[a] || settled[b];
+
+    return a;
+}
+
+/************************************************************************/
+/*                              addLine()                               */
+/*                                                                      */
+/*      Take a copy of a composited output line, label its source       */
+/*      runs, and sieve the regions it closed.                          */
+/************************************************************************/
+
+void PLCStreamingSieve::addLine(int line, PLCLine *lineObj)
+
+{
+    CPLAssert( line == lastLine + 1 );
+
+    PLCLine *row = new PLCLine(width);
+    int iBand;
+
+    for( iBand = 0; iBand < lineObj->getBandCount(); iBand++ )
+        memcpy(row->getBand(iBand), lineObj->getBand(iBand),
+               sizeof(float) * width);
+    memcpy(row->getAlpha(), lineObj->getAlpha(), width);
+    memcpy(row->getSource(), lineObj->getSource(),
+           sizeof(unsigned short) * width);
+    memcpy(row->getQuality(), lineObj->getQuality(),
+           sizeof(float) * width);
+
+    if( rows.size() == 0 )
+        firstLine = line;
+
+    rows.push_back(row);
+    labels.push_back(std::vector<int>(width));
+    lastLine = line;
+
+/* -------------------------------------------------------------------- */
+/*      Label runs, joining them to the matching source above.          */
+/* -------------------------------------------------------------------- */
+    unsigned short *source = row->getSource();
+    std::vector<int> &label = labels.back();
+    unsigned short *aboveSource = NULL;
+    std::vector<int> *aboveLabel = NULL;
+
+    if( rows.size() > 1 )
+    {
+        aboveSource = rows[rows.size()-2]->getSource();
+        aboveLabel = &(labels[labels.size()-2]);
+    }
+
+    for( int i = 0; i < width; i++ )
+    {
+        if( i > 0 && source[i-1] == source[i] )
+            label[i] = label[i-1];
+        else
+            label[i] = newLabel(source[i], line);
+
+        size[find(label[i])]++;
+
+        if( aboveSource != NULL && aboveSource[i] == source[i] )
+            lastRow[join(label[i], (*aboveLabel)[i])] = line;
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Regions on the line above that did not continue onto this       */
+/*      line are now complete.                                          */
+/* -------------------------------------------------------------------- */
+    if( rows.size() > 1 )
+        closeComponents(rows.size() - 2, line);
+
+    if( (int) rows.size() > window )
+        flushLine();
+}
+
+/************************************************************************/
+/*                              seedLine()                              */
+/*                                                                      */
+/*      When resuming, start from the source of the last line written.  */
+/*      Its regions are settled, and it is not written again, but       */
+/*      small regions below may still merge into them.                  */
+/************************************************************************/
+
+void PLCStreamingSieve::seedLine(int line, const unsigned short *source)
+
+{
+    CPLAssert( rows.size() == 0 );
+
+    PLCLine *row = new PLCLine(width);
+
+    memcpy(row->getSource(), source, sizeof(unsigned short) * width);
+
+    firstLine = line;
+    lastLine = line;
+    seedLines = 1;
+    rows.push_back(row);
+    labels.push_back(std::vector<int>(width));
+
+    std::vector<int> &label = labels.back();
+
+    for( int i = 0; i < width; i++ )
+    {
+        if( i > 0 && source[i-1] == source[i] )
+            label[i] = label[i-1];
+        else
+        {
+            label[i] = newLabel(source[i], line);
+            settled[label[i]] = TRUE;
+        }
+
+        size[label[i]]++;
+    }
+}
+
+/************************************************************************/
+/*                          closeComponents()                           */
+/*                                                                      */
+/*      Sieve the regions touching the given buffered row that do       */
+/*      not extend to nextLine.                                         */
+/************************************************************************/
+
+void PLCStreamingSieve::closeComponents(int row, int nextLine)
+
+{
+    std::vector<int> &label = labels[row];
+
+    for( int i = 0; i < width; i++ )
+    {
+        int root = find(label[i]);
+
+        if( settled[root] || lastRow[root] >= nextLine )
+            continue;
+
+        // Source 0 (no input) areas are left as they are.
+        if( size[root] >= threshold || value[root] == 0 )
+            settled[root] = TRUE;
+        else
+            mergeComponent(root);
+    }
+}
+
+/************************************************************************/
+/*                           mergeComponent()                           */
+/*                                                                      */
+/*      Merge a small closed region into the largest neighbouring       */
+/*      region with a source, as GDALSieveFilter() would.               */
+/************************************************************************/
+
+void PLCStreamingSieve::mergeComponent(int root)
+
+{
+    int bestNeighbour = -1;
+    int rowStart = firstRow[root] - firstLine;
+    int rowEnd = MIN((int) rows.size() - 1, lastRow[root] - firstLine);
+
+    for( int iRow = rowStart; iRow <= rowEnd; iRow++ )
+    {
+        for( int i = 0; i < width; i++ )
+        {
+            if( find(labels[iRow][i]) != root )
+                continue;
+
+            int neighbours[4] = { -1, -1, -1, -1 };
+
+            if( i > 0 )
+                neighbours[0] = labels[iRow][i-1];
+            if( i < width-1 )
+                neighbours[1] = labels[iRow][i+1];
+            if( iRow > 0 )
+                neighbours[2] = labels[iRow-1][i];
+            if( iRow < (int) rows.size() - 1 )
+                neighbours[3] = labels[iRow+1][i];
+
+            for( int k = 0; k < 4; k++ )
+            {
+                if( neighbours[k] < 0 )
+                    continue;
+
+                int other = find(neighbours[k]);
+
+                if( other == root || value[other] == 0 )
+                    continue;
+
+                if( bestNeighbour < 0 || size[other] > size[bestNeighbour] )
+                    bestNeighbour = other;
+            }
+        }
+    }
+
+    if( bestNeighbour < 0 )
+    {
+        settled[root] = TRUE;
+        return;
+    }
+
+    unsigned short newSource = value[bestNeighbour];
+
+    repaint(root, newSource);
+    value[join(root, bestNeighbour)] = newSource;
+}
+
+/************************************************************************/
+/*                              repaint()                               */
+/*                                                                      */
+/*      Take the pixels of a region from another input, reading just    */
+/*      the blocks needed.  Pixels that input does not cover become     */
+/*      transparent, as with the sieve and rebuild.                     */
+/************************************************************************/
+
+void PLCStreamingSieve::repaint(int root, unsigned short newSource)
+
+{
+    PLCInput *input = context->inputFiles[newSource-1];
+    int rowStart = firstRow[root] - firstLine;
+    int rowEnd = MIN((int) rows.size() - 1, lastRow[root] - firstLine);
+    std::vector<GByte> used(width);
+
+    for( int iRow = rowStart; iRow <= rowEnd; iRow++ )
+    {
+        PLCLine *row = rows[iRow];
+        int useCount = 0;
+
+        for( int i = 0; i < width; i++ )
+        {
+            used[i] = (find(labels[iRow][i]) == root);
+            useCount += used[i];
+        }
+
+        if( useCount == 0 )
+            continue;
+
+        int line = firstLine + iRow;
+        PLCLine *inputLine = input->getLine(line, PLC_NO_BANDS);
+        GByte *dst_alpha = row->getAlpha();
+
+        input->readImagery(inputLine, line, &(used[0]));
+
+        for( int i = 0; i < width; i++ )
+        {
+            if( !used[i] )
+                continue;
+
+            row->getSource()[i] = newSource;
+
+            if( !inputLine->isValid(i) )
+            {
+                dst_alpha[i] = 0;
+                continue;
+            }
+
+            for( int iBand = 0; iBand < row->getBandCount(); iBand++ )
+                row->getBand(iBand)[i] = inputLine->getBand(iBand)[i];
+            dst_alpha[i] = 255;
+        }
+
+        delete inputLine;
+    }
+
+    // The compositor may already have closed this input.
+    if( lastLine >= input->getYOff() + input->getYSize() - 1 )
+        input->releaseDS();
+}
+
+/************************************************************************/
+/*                             flushLine()                              */
+/*                                                                      */
+/*      Write out the oldest buffered line.  Regions still open on      */
+/*      it are kept as they are.                                        */
+/************************************************************************/
+
+void PLCStreamingSieve::flushLine()
+
+{
+    for( int i = 0; i < width; i++ )
+        settled[find(labels[0][i])] = TRUE;
+
+    if( seedLines > 0 )
+        seedLines--;
+    else
+        context->writeOutputLine(rows[0], firstLine, false);
+
+    delete rows[0];
+    rows.pop_front();
+    labels.pop_front();
+    firstLine++;
+
+    if( parent.size() > (size_t) 4 * width * (rows.size() + 1) )
+        compact();
+}
+
+/************************************************************************/
+/*                              compact()                               */
+/*                                                                      */
+/*      Drop union-find nodes no longer referenced by buffered rows.    */
+/************************************************************************/
+
+void PLCStreamingSieve::compact()
+
+{
+    std::vector<int> remap(parent.size(), -1);
+    std::vector<int> newSize, newFirstRow, newLastRow;
+    std::vector<unsigned short> newValue;
+    std::vector<GByte> newSettled;
+
+    for( unsigned int iRow = 0; iRow < labels.size(); iRow++ )
+    {
+        for( int i = 0; i < width; i++ )
+        {
+            int root = find(labels[iRow][i]);
+
+            if( remap[root] < 0 )
+            {
+                remap[root] = newSize.size();
+                newSize.push_back(size[root]);
+                newFirstRow.push_back(firstRow[root]);
+                newLastRow.push_back(lastRow[root]);
+                newValue.push_back(value[root]);
+                newSettled.push_back(settled[root]);
+            }
+
+            labels[iRow][i] = remap[root];
+        }
+    }
+
+    size.swap(newSize);
+    firstRow.swap(newFirstRow);
+    lastRow.swap(newLastRow);
+    value.swap(newValue);
+    settled.swap(newSettled);
+
+    parent.resize(size.size());
+    for( unsigned int i = 0; i < parent.size(); i++ )
+        parent[i] = i;
+}
+
+/************************************************************************/
+/*                               finish()                               */
+/*                                                                      */
+/*      Sieve the regions on the last line and write out the rest.      */
+/************************************************************************/
+
+void PLCStreamingSieve::finish()
+
+{
+    if( rows.size() > 0 )
+        closeComponents(rows.size() - 1, lastLine + 1);
+
+    while( rows.size() > 0 )
+        flushLine();
+
+    for( unsigned int i = 0; i < context->inputFiles.size(); i++ )
+        context->inputFiles[i]->releaseDS();
+}
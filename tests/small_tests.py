@@ -7,7 +7,7 @@ import traceback
 import json
 import subprocess
 
-from osgeo import gdal, gdal_array
+from osgeo import gdal, gdal_array, ogr, osr
 
 TEMPLATE_FLOAT = 'data/2x2_float_template.tif'
 TEMPLATE_GRAY = 'data/2x2_gray_template.tif'
@@ -18,6 +18,10 @@ TEMPLATE_UINT16 = 'data/2x2_gray_uint16_template.tif'
 TEMPLATE_GRAY_3X3 = 'data/3x3_gray_template.tif'
 TEMPLATE_FLOAT_3X3 = 'data/3x3_float_template.tif'
 
+# Two gray inputs, each darkest on one side, and their darkest composite.
+DARKEST_INPUTS = [[[10, 60], [10, 60]], [[50, 20], [50, 20]]]
+DARKEST_RESULT = [[10, 20], [10, 20]]
+
 class Tests(unittest.TestCase):
 
     def setUp(self):
@@ -49,6 +53,33 @@ class Tests(unittest.TestCase):
 
         return filename
 
+    def make_sized_file(self, template_filename, data):
+        # Like make_file(), but sized to the data, with the template's
+        # data type, projection and origin.
+        template_filename = os.path.join(os.path.dirname(__file__),
+                                         template_filename)
+        caller = traceback.extract_stack(limit=2)[0][2]
+        filename = '%s_%d.tif' % (caller, len(self.temp_test_files))
+
+        data = numpy.array(data)
+        template_ds = gdal.Open(template_filename)
+        ds = gdal.GetDriverByName('GTiff').Create(
+            filename, data.shape[1], data.shape[0], 1,
+            template_ds.GetRasterBand(1).DataType)
+        ds.SetProjection(template_ds.GetProjectionRef())
+        ds.SetGeoTransform(template_ds.GetGeoTransform())
+        ds.GetRasterBand(1).WriteArray(data)
+        ds = None
+        template_ds = None
+
+        self.temp_test_files.append(filename)
+        return filename
+
+    def make_darkest_inputs(self):
+        # Inputs for the DARKEST_INPUTS fixture.
+        return [ { 'filename': self.make_file(TEMPLATE_GRAY, data) }
+                 for data in DARKEST_INPUTS ]
+
     def clean_files(self):
         for filename in self.temp_test_files:
             os.unlink(filename)
@@ -232,6 +263,198 @@ class Tests(unittest.TestCase):
 
         self.clean_files()
         
+    def test_small_darkest_nodata(self):
+        test_file = self.make_file(TEMPLATE_GRAY)
+
+        in_1 = self.make_file(TEMPLATE_GRAY, [[0, 1], [6, 5]])
+        ds = gdal.Open(in_1, gdal.GA_Update)
+        ds.GetRasterBand(1).SetNoDataValue(0)
+        ds = None
+
+        args = [
+            '-q',
+            '-s', 'quality', 'darkest',
+            '-o', test_file, 
+            '-i', in_1,
+            '-i', self.make_file(TEMPLATE_GRAY, [[9, 8], [2, 3]]),
+            ]
+
+        self.run_compositor(args)
+
+        self.compare_file(test_file, [[9, 1], [2, 3]])
+
+        self.clean_files()
+        
+    def test_small_partial_footprint(self):
+        test_file = self.make_file(TEMPLATE_GRAY)
+
+        # A single column input covering the right half of the output.
+        template_ds = gdal.Open(test_file)
+        gt = template_ds.GetGeoTransform()
+        in_2 = 'partial_footprint_in_2.tif'
+        ds = gdal.GetDriverByName('GTiff').Create(in_2, 1, 2, 1,
+                                                  gdal.GDT_Byte)
+        ds.SetProjection(template_ds.GetProjectionRef())
+        ds.SetGeoTransform([gt[0] + gt[1], gt[1], 0.0, gt[3], 0.0, gt[5]])
+        ds.GetRasterBand(1).WriteArray(numpy.array([[1], [1]]))
+        ds = None
+        template_ds = None
+
+        args = [
+            '-q',
+            '-s', 'quality', 'darkest',
+            '-o', test_file, 
+            '-i', self.make_file(TEMPLATE_GRAY, [[5, 5], [5, 5]]),
+            '-i', in_2,
+            ]
+
+        self.run_compositor(args)
+
+        self.compare_file(test_file, [[5, 1], [5, 1]])
+
+        os.unlink(in_2)
+        self.clean_files()
+        
+    def test_small_warped_input(self):
+        test_file = self.make_file(TEMPLATE_GRAY)
+
+        # An input at twice the output resolution, warped on the fly.
+        template_ds = gdal.Open(test_file)
+        gt = template_ds.GetGeoTransform()
+        in_2 = 'warped_input_in_2.tif'
+        ds = gdal.GetDriverByName('GTiff').Create(in_2, 4, 4, 1,
+                                                  gdal.GDT_Byte)
+        ds.SetProjection(template_ds.GetProjectionRef())
+        ds.SetGeoTransform([gt[0], gt[1] / 2, 0.0, gt[3], 0.0, gt[5] / 2])
+        ds.GetRasterBand(1).WriteArray(numpy.array([[1, 1, 2, 2],
+                                                    [1, 1, 2, 2],
+                                                    [3, 3, 4, 4],
+                                                    [3, 3, 4, 4]]))
+        ds = None
+        template_ds = None
+
+        args = [
+            '-q',
+            '-s', 'quality', 'darkest',
+            '-o', test_file, 
+            '-i', self.make_file(TEMPLATE_GRAY, [[5, 5], [5, 5]]),
+            '-i', in_2,
+            ]
+
+        self.run_compositor(args)
+
+        self.compare_file(test_file, [[1, 2], [3, 4]])
+
+        os.unlink(in_2)
+        self.clean_files()
+        
+    def test_scene_measure_short_circuit(self):
+        test_file = self.make_file(TEMPLATE_RGBA)
+
+        # The first input can never win, ties go to the earlier input.
+        args = [
+            '-q',
+            '-s', 'quality', 'scene_measure',
+            '-s', 'scene_measure', 'newness',
+            '-o', test_file, 
+            '-i',
+            self.make_file(TEMPLATE_RGBA, 
+                           [[[1, 1], [1, 1]],
+                            [[1, 1], [1, 1]],
+                            [[1, 1], [1, 1]],
+                            [[255, 255], [255, 255]]]),
+            '-qm', 'newness', '0.5',
+            '-i',
+            self.make_file(TEMPLATE_RGBA, 
+                           [[[2, 2], [2, 2]],
+                            [[2, 2], [2, 2]],
+                            [[2, 2], [2, 2]],
+                            [[255, 0], [255, 255]]]),
+            '-qm', 'newness', '0.9',
+            '-i',
+            self.make_file(TEMPLATE_RGBA, 
+                           [[[3, 3], [3, 3]],
+                            [[3, 3], [3, 3]],
+                            [[3, 3], [3, 3]],
+                            [[255, 255], [255, 255]]]),
+            '-qm', 'newness', '0.9',
+            ]
+
+        self.run_compositor(args)
+
+        self.compare_file(test_file, 
+                          [[[2, 3], [2, 2]], 
+                           [[2, 3], [2, 2]], 
+                           [[2, 3], [2, 2]],
+                           [[255, 255], [255, 255]]])
+
+        self.clean_files()
+        
+    def test_prepass_candidates_json(self):
+        json_file = 'small_prepass.json'
+        candidates_file = 'small_prepass_candidates.txt'
+        test_file = self.make_file(TEMPLATE_RGBA)
+
+        # The first input is outside the margin and pruned in every tile,
+        # the result matches a run without the pre-pass.
+        control = {
+            'output_file': test_file,
+            'prepass_decimation': 2,
+            'prepass_tile_size': 1,
+            'prepass_margin': 0.2,
+            'prepass_candidates': candidates_file,
+            'compositors': [
+                {
+                    'class': 'scene_measure',
+                    'scene_measure': 'newness',
+                    },
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_RGBA, 
+                                               [[[1, 1], [1, 1]],
+                                                [[1, 1], [1, 1]],
+                                                [[1, 1], [1, 1]],
+                                                [[255, 255], [255, 255]]]),
+                    'newness': 0.5,
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_RGBA, 
+                                               [[[2, 2], [2, 2]],
+                                                [[2, 2], [2, 2]],
+                                                [[2, 2], [2, 2]],
+                                                [[255, 0], [255, 255]]]),
+                    'newness': 0.9,
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_RGBA, 
+                                               [[[3, 3], [3, 3]],
+                                                [[3, 3], [3, 3]],
+                                                [[3, 3], [3, 3]],
+                                                [[255, 255], [255, 255]]]),
+                    'newness': 0.9,
+                    },
+                ]
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor([ '-q', '-j', json_file])
+
+        self.compare_file(test_file, 
+                          [[[2, 3], [2, 2]], 
+                           [[2, 3], [2, 2]], 
+                           [[2, 3], [2, 2]],
+                           [[255, 255], [255, 255]]])
+
+        lines = open(candidates_file).read().splitlines()
+        self.assertEqual(len(lines), 4)
+        for line in lines:
+            self.assertEqual(line.split(':')[1], ' 2 3')
+
+        os.unlink(json_file)
+        os.unlink(candidates_file)
+        self.clean_files()
+        
     def test_percentile(self):
         test_file = self.make_file(TEMPLATE_GRAY)
         
@@ -286,6 +509,154 @@ class Tests(unittest.TestCase):
         os.unlink(json_file)
         self.clean_files()
         
+    def test_percentiles_json(self):
+        json_file = 'percentiles.json'
+        test_file = self.make_file(TEMPLATE_GRAY)
+        brightest_file = self.make_file(TEMPLATE_GRAY)
+        darkest_file = self.make_file(TEMPLATE_GRAY)
+
+        control = {
+            'output_file': test_file,
+            'compositors': [
+                {
+                    'class': 'darkest',
+                    },
+                {
+                    'class': 'percentile',
+                    'quality_percentiles': [60.0, 0.0, 100.0],
+                    'percentile_outputs': [brightest_file, darkest_file],
+                    },
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, [[9, 3], [1, 1]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, [[5, 1], [9, 9]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, [[1, 2], [9, 1]]),
+                    },
+                ],
+            }
+
+        open(json_file, 'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+        self.compare_file(test_file, [[5, 2], [9, 1]])
+        self.compare_file(brightest_file, [[9, 3], [9, 9]])
+        self.compare_file(darkest_file, [[1, 1], [1, 1]])
+
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_medoid_json(self):
+        json_file = 'medoid.json'
+        test_file = self.make_file(TEMPLATE_GRAY)
+
+        control = {
+            'output_file': test_file,
+            'compositors': [
+                {
+                    'class': 'medoid',
+                    },
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[10, 60], [200, 5]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[12, 61], [100, 5]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[50, 90], [101, 7]]),
+                    },
+                ],
+            }
+
+        open(json_file, 'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+        self.compare_file(test_file, [[12, 61], [101, 5]])
+
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_medoid_references_json(self):
+        json_file = 'medoid_references.json'
+        test_file = self.make_file(TEMPLATE_GRAY)
+
+        # Compared with all others the median, 95, wins.  Compared with
+        # only the inputs at 10, 20 and 90 (evenly spaced through the
+        # stack), 20 is closest.
+        values = [10, 100, 20, 95, 90, 97, 99]
+        control = {
+            'output_file': test_file,
+            'compositors': [
+                {
+                    'class': 'medoid',
+                    },
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[v, v], [v, v]]),
+                    } for v in values
+                ],
+            }
+
+        open(json_file, 'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+        self.compare_file(test_file, [[95, 95], [95, 95]])
+
+        control['compositors'][0]['max_references'] = 3
+        open(json_file, 'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+        self.compare_file(test_file, [[20, 20], [20, 20]])
+
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_medoid_weighted_json(self):
+        json_file = 'medoid_weighted.json'
+        test_file = self.make_file(TEMPLATE_GRAY)
+
+        # Unweighted 50 is the medoid.  Weighted by quality, distance to
+        # the good input at 100 dominates.
+        control = {
+            'output_file': test_file,
+            'compositors': [
+                {
+                    'class': 'qualityfromfile',
+                    'file_key': 'quality',
+                    },
+                {
+                    'class': 'medoid',
+                    },
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[v, v], [v, v]]),
+                    'quality': self.make_file(TEMPLATE_FLOAT, 
+                                              [[q, q], [q, q]]),
+                    } for (v, q) in [(10, 0.1), (50, 0.1), (100, 1.0)]
+                ],
+            }
+
+        open(json_file, 'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+        self.compare_file(test_file, [[50, 50], [50, 50]])
+
+        control['compositors'][1]['quality_weighted'] = True
+        open(json_file, 'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+        self.compare_file(test_file, [[100, 100], [100, 100]])
+
+        os.unlink(json_file)
+        self.clean_files()
+        
     def test_quality_file(self):
         test_file = self.make_file(TEMPLATE_GRAY)
         quality_out = 'qf_test_quality.tif'
@@ -379,49 +750,32 @@ class Tests(unittest.TestCase):
         os.unlink(json_file)
         self.clean_files()
         
-    def test_snow_quality(self):
-        json_file = 'quality_file.json'
+    def test_quality_file_average_json(self):
+        json_file = 'quality_file_average.json'
         test_file = self.make_file(TEMPLATE_GRAY)
-        quality_out = 'snow_test_quality.tif'
-        
-        snow_only = 23552
-        cloud_only = 53248
-        cloud_and_snow = 56320
-        clear = 20480
-        cirrus = 28672
 
+        # Quality from files only, so imagery is gathered after selection.
         control = {
             'output_file': test_file,
-            'quality_output': quality_out,
+            'average_best_ratio': 1.0,
             'compositors': [
-                {"class": "landsat8",
-                 "fully_confident_cloud": 0.01,
-                 },
-                {"class": "landsat8snow",
-                 "fully_confident_snow": 0.02,
-                 },
-                ],
-            'inputs': [
                 {
-                    'filename': self.make_file(TEMPLATE_GRAY, 
-                                               [[101, 101], [101, 101]]),
-                    'cloud_file': self.make_file(TEMPLATE_UINT16, 
-                                              [[clear, snow_only], 
-                                               [cloud_and_snow, cloud_only]]),
+                    'class': 'qualityfromfile',
+                    'file_key': 'quality',
                     },
+                ],
+            'inputs': [
                 {
                     'filename': self.make_file(TEMPLATE_GRAY, 
-                                               [[102, 102], [102, 102]]),
-                    'cloud_file': self.make_file(TEMPLATE_UINT16,
-                                              [[cirrus, cloud_only], 
-                                               [cloud_only, cirrus]]),
+                                               [[100, 100], [100, 100]]),
+                    'quality': self.make_file(TEMPLATE_FLOAT, 
+                                              [[0.5, 2.0], [-1.0, 0.01]]),
                     },
                 {
                     'filename': self.make_file(TEMPLATE_GRAY, 
-                                               [[103, 103], [103, 103]]),
-                    'cloud_file': self.make_file(TEMPLATE_UINT16,
-                                              [[snow_only, cloud_and_snow], 
-                                               [clear, snow_only]]),
+                                               [[200, 200], [200, 200]]),
+                    'quality': self.make_file(TEMPLATE_FLOAT,
+                                              [[2.0, -1.0], [-1.0, 0.25]]),
                     },
                 ],
             }
@@ -429,48 +783,879 @@ class Tests(unittest.TestCase):
         open(json_file,'w').write(json.dumps(control))
         self.run_compositor(['-q', '-j', json_file])
 
-        self.compare_file(test_file, [[101, 101], [103, 102]])
-	self.compare_file(quality_out,
-                          [[[0.528,   0.01056],
-                            [0.528,   0.132]],
-                           [[0.528,   0.01056],
-                            [0.00016, 0.008]],
-                           [[0.132,   0.008],
+        self.compare_file(test_file, [[150, 100], [0, 150]])
+
+        os.unlink(json_file)
+        self.clean_files()
+
+    def test_quality_file_coarse_json(self):
+        json_file = 'quality_file_coarse.json'
+        test_file = self.make_file(TEMPLATE_GRAY)
+
+        # Quality files at half the imagery resolution (1x1 for 2x2).
+        quality_files = []
+        for value in [0.5, 0.8]:
+            filename = 'qfc_quality_%d.tif' % len(quality_files)
+            ds = gdal.GetDriverByName('GTiff').Create(filename, 1, 1, 1,
+                                                      gdal.GDT_Float32)
+            ds.GetRasterBand(1).Fill(value)
+            ds = None
+            quality_files.append(filename)
+
+        control = {
+            'output_file': test_file,
+            'compositors': [
+                {
+                    'class': 'qualityfromfile',
+                    'file_key': 'quality',
+                    },
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[101, 101], [101, 101]]),
+                    'quality': quality_files[0],
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[102, 102], [102, 102]]),
+                    'quality': quality_files[1],
+                    },
+                ],
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, [[102, 102], [102, 102]])
+
+        for filename in quality_files:
+            os.unlink(filename)
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_snow_quality(self):
+        json_file = 'quality_file.json'
+        test_file = self.make_file(TEMPLATE_GRAY)
+        quality_out = 'snow_test_quality.tif'
+        
+        snow_only = 23552
+        cloud_only = 53248
+        cloud_and_snow = 56320
+        clear = 20480
+        cirrus = 28672
+
+        control = {
+            'output_file': test_file,
+            'quality_output': quality_out,
+            'compositors': [
+                {"class": "landsat8",
+                 "fully_confident_cloud": 0.01,
+                 },
+                {"class": "landsat8snow",
+                 "fully_confident_snow": 0.02,
+                 },
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[101, 101], [101, 101]]),
+                    'cloud_file': self.make_file(TEMPLATE_UINT16, 
+                                              [[clear, snow_only], 
+                                               [cloud_and_snow, cloud_only]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[102, 102], [102, 102]]),
+                    'cloud_file': self.make_file(TEMPLATE_UINT16,
+                                              [[cirrus, cloud_only], 
+                                               [cloud_only, cirrus]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[103, 103], [103, 103]]),
+                    'cloud_file': self.make_file(TEMPLATE_UINT16,
+                                              [[snow_only, cloud_and_snow], 
+                                               [clear, snow_only]]),
+                    },
+                ],
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, [[101, 101], [103, 102]])
+	self.compare_file(quality_out,
+                          [[[0.528,   0.01056],
+                            [0.528,   0.132]],
+                           [[0.528,   0.01056],
+                            [0.00016, 0.008]],
+                           [[0.132,   0.008],
                             [0.008,   0.132]],
                            [[0.01056, 0.00016],
                             [0.528,   0.01056]]], 
                            tolerance=0.001)
 
-        os.unlink(quality_out)
+        os.unlink(quality_out)
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_cloud_vector_json(self):
+        json_file = 'cloud_vector.json'
+        vector_file = 'cloud_vector.geojson'
+        test_file = self.make_file(TEMPLATE_GRAY)
+        in_1 = self.make_file(TEMPLATE_GRAY, [[1, 1], [1, 1]])
+
+        # Polygon covering the left column of the 2x2 grid.
+        srs = osr.SpatialReference(gdal.Open(in_1).GetProjectionRef())
+        vector_ds = ogr.GetDriverByName('GeoJSON').CreateDataSource(
+            vector_file)
+        layer = vector_ds.CreateLayer('clouds', srs=srs)
+        feature = ogr.Feature(layer.GetLayerDefn())
+        feature.SetGeometry(ogr.CreateGeometryFromWkt(
+            'POLYGON((440720 3751320,440780 3751320,440780 3751200,'
+            '440720 3751200,440720 3751320))'))
+        layer.CreateFeature(feature)
+        feature = None
+        vector_ds = None
+
+        control = {
+            'output_file': test_file,
+            'compositors': [
+                {
+                    'class': 'darkest',
+                    },
+                ],
+            'inputs': [
+                {
+                    'filename': in_1,
+                    'cloud_vector': vector_file,
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[5, 5], [5, 5]]),
+                    },
+                ],
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, [[5, 1], [5, 1]])
+
+        os.unlink(vector_file)
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_cloud_vector_warped_json(self):
+        json_file = 'cloud_vector_warped.json'
+        vector_file = 'cloud_vector_warped.geojson'
+        in_1 = 'cloud_vector_warped_in_1.tif'
+        test_file = self.make_file(TEMPLATE_GRAY)
+        utm_file = self.make_file(TEMPLATE_GRAY, [[1, 1], [1, 1]])
+
+        # An input in geographic coordinates, warped to the output grid,
+        # with a cloud vector in the same geographic coordinates.
+        gdal.Warp(in_1, utm_file, dstSRS='EPSG:4326')
+
+        utm_srs = osr.SpatialReference(gdal.Open(utm_file).GetProjectionRef())
+        geo_srs = osr.SpatialReference()
+        geo_srs.ImportFromEPSG(4326)
+        for srs in (utm_srs, geo_srs):
+            if hasattr(srs, 'SetAxisMappingStrategy'):
+                srs.SetAxisMappingStrategy(osr.OAMS_TRADITIONAL_GIS_ORDER)
+
+        # Polygon covering the left column of the 2x2 grid.
+        geometry = ogr.CreateGeometryFromWkt(
+            'POLYGON((440720 3751320,440780 3751320,440780 3751200,'
+            '440720 3751200,440720 3751320))')
+        geometry.Transform(osr.CoordinateTransformation(utm_srs, geo_srs))
+
+        vector_ds = ogr.GetDriverByName('GeoJSON').CreateDataSource(
+            vector_file)
+        layer = vector_ds.CreateLayer('clouds', srs=geo_srs)
+        feature = ogr.Feature(layer.GetLayerDefn())
+        feature.SetGeometry(geometry)
+        layer.CreateFeature(feature)
+        feature = None
+        vector_ds = None
+
+        control = {
+            'output_file': test_file,
+            'compositors': [
+                {
+                    'class': 'darkest',
+                    },
+                ],
+            'inputs': [
+                {
+                    'filename': in_1,
+                    'cloud_vector': vector_file,
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[5, 5], [5, 5]]),
+                    },
+                ],
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, [[5, 1], [5, 1]])
+
+        os.unlink(in_1)
+        os.unlink(vector_file)
+        os.unlink(json_file)
+        self.clean_files()
+
+    def test_same_source_json(self):
+        json_file = 'same_source.json'
+        test_file = self.make_file(TEMPLATE_GRAY_3X3)
+        quality_out = 'qfj_test_same_source.tif'
+
+        control = {
+            'output_file': test_file,
+            'quality_output': quality_out,
+            'compositors': [
+                {
+                    'class': 'qualityfromfile',
+                    'file_key': 'quality',
+                    'scale_min': 0.0,
+                    'scale_max': 1.0,
+                    },
+                {
+                    'class': 'samesource',
+                    'mismatch_penalty': 0.3,
+                    },
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY_3X3, 
+                                               [[101, 101, 101],
+                                                [101, 101, 101],
+                                                [101, 101, 101]]),
+                    'quality': self.make_file(TEMPLATE_FLOAT_3X3, 
+                                              [[1.0, 1.0, 1.0],
+                                               [0.9, 0.9, 0.9],
+                                               [0.4, 0.4, 0.4]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY_3X3, 
+                                               [[102, 102, 102],
+                                                [102, 102, 102],
+                                                [102, 102, 102]]),
+                    'quality': self.make_file(TEMPLATE_FLOAT_3X3, 
+                                              [[0.9, 0.9, 0.9],
+                                               [1.0, 1.0, 1.0],
+                                               [1.0, 1.0, 1.0]]),
+                    },
+                ],
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, [[101, 101, 101],
+                                      [101, 101, 101],
+                                      [102, 102, 102]])
+        self.compare_file(quality_out, 
+                          [[[1.0, 1.0, 1.0],
+                            [0.9, 0.9, 0.9],
+                            [0.8, 0.7, 0.8]],
+                           [[1.0, 1.0, 1.0],
+                            [0.9, 0.9, 0.9],
+                            [0.4, 0.4, 0.4]],
+                           [[0.9, 0.9, 0.9],
+                            [0.8, 0.7, 0.8],
+                            [0.8, 0.7, 0.8]]],
+                          tolerance=0.001)
+
+        os.unlink(quality_out)
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_sieve_json(self):
+        json_file = 'sieve.json'
+        test_file = self.make_file(TEMPLATE_GRAY_3X3)
+        st_out = 'st_test_same_source.tif'
+
+        control = {
+            'output_file': test_file,
+            'source_sieve_threshold': 2,
+            'source_trace': st_out,
+            'compositors': [
+                {
+                    'class': 'qualityfromfile',
+                    'file_key': 'quality',
+                    'scale_min': 0.0,
+                    'scale_max': 1.0,
+                    }
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY_3X3, 
+                                               [[101, 101, 101],
+                                                [101, 101, 101],
+                                                [101, 101, 101]]),
+                    'quality': self.make_file(TEMPLATE_FLOAT_3X3, 
+                                              [[1.0, 0.0, 1.0],
+                                               [0.0, 0.0, 0.0],
+                                               [1.0, 1.0, 1.0]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY_3X3, 
+                                               [[102, 102, 102],
+                                                [102, 102, 102],
+                                                [102, 102, 102]]),
+                    'quality': self.make_file(TEMPLATE_FLOAT_3X3, 
+                                              [[0.5, 0.5, 0.5],
+                                               [0.5, 0.5, 0.5],
+                                               [0.5, 0.5, 0.5]]),
+                    },
+                ],
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, [[102, 102, 102],
+                                      [102, 102, 102],
+                                      [101, 101, 101]])
+
+        os.unlink(st_out)
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_sieve_gdal_json(self):
+        json_file = 'sieve_gdal.json'
+        test_file = self.make_file(TEMPLATE_GRAY_3X3)
+        st_out = 'st_test_sieve_gdal.tif'
+
+        control = {
+            'output_file': test_file,
+            'source_sieve_threshold': 2,
+            'source_sieve_method': 'gdal',
+            'source_trace': st_out,
+            'compositors': [
+                {
+                    'class': 'qualityfromfile',
+                    'file_key': 'quality',
+                    'scale_min': 0.0,
+                    'scale_max': 1.0,
+                    }
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY_3X3, 
+                                               [[101, 101, 101],
+                                                [101, 101, 101],
+                                                [101, 101, 101]]),
+                    'quality': self.make_file(TEMPLATE_FLOAT_3X3, 
+                                              [[1.0, 0.0, 1.0],
+                                               [0.0, 0.0, 0.0],
+                                               [1.0, 1.0, 1.0]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY_3X3, 
+                                               [[102, 102, 102],
+                                                [102, 102, 102],
+                                                [102, 102, 102]]),
+                    'quality': self.make_file(TEMPLATE_FLOAT_3X3, 
+                                              [[0.5, 0.5, 0.5],
+                                               [0.5, 0.5, 0.5],
+                                               [0.5, 0.5, 0.5]]),
+                    },
+                ],
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, [[102, 102, 102],
+                                      [102, 102, 102],
+                                      [101, 101, 101]])
+
+        os.unlink(st_out)
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def sieve_both_ways(self, source_map, threshold, window):
+        # Composite two flat inputs following source_map (1 or 2 per
+        # pixel), sieving with the streaming and gdal methods, and return
+        # both outputs.
+        source_map = numpy.array(source_map)
+        json_file = 'sieve_both_ways.json'
+        st_out = 'st_sieve_both_ways.tif'
+        outputs = []
+
+        inputs = [
+            {
+                'filename': self.make_sized_file(
+                    TEMPLATE_GRAY, numpy.full(source_map.shape, 101)),
+                'quality': self.make_sized_file(
+                    TEMPLATE_FLOAT, (source_map == 1) * 1.0),
+                },
+            {
+                'filename': self.make_sized_file(
+                    TEMPLATE_GRAY, numpy.full(source_map.shape, 102)),
+                'quality': self.make_sized_file(
+                    TEMPLATE_FLOAT, numpy.full(source_map.shape, 0.5)),
+                },
+            ]
+
+        for method in ('streaming', 'gdal'):
+            test_file = self.make_sized_file(
+                TEMPLATE_GRAY, numpy.zeros(source_map.shape))
+
+            control = {
+                'output_file': test_file,
+                'source_sieve_threshold': threshold,
+                'source_sieve_method': method,
+                'source_sieve_window': window,
+                'source_trace': st_out,
+                'compositors': [
+                    {
+                        'class': 'qualityfromfile',
+                        'file_key': 'quality',
+                        },
+                    ],
+                'inputs': inputs,
+                }
+
+            open(json_file,'w').write(json.dumps(control))
+            self.run_compositor(['-q', '-j', json_file])
+
+            outputs.append(gdal_array.LoadFile(test_file))
+            os.unlink(st_out)
+
+        os.unlink(json_file)
+        return outputs
+
+    def test_sieve_streaming_late_merge_json(self):
+        # The arms of the U are separate regions until the last line
+        # joins them, and together they pass the threshold.  The single
+        # pixel in the cup is sieved.
+        source_map = [[1, 2, 2, 2, 1],
+                      [1, 2, 2, 2, 1],
+                      [1, 2, 1, 2, 1],
+                      [1, 2, 2, 2, 1],
+                      [1, 1, 1, 1, 1]]
+
+        streaming, gdal_sieved = self.sieve_both_ways(source_map, 5, 2)
+
+        expected = numpy.where(numpy.array(source_map) == 1, 101, 102)
+        expected[2][2] = 102
+        self.assertTrue(numpy.array_equal(streaming, expected), 
+                        str(streaming))
+        self.assertTrue(numpy.array_equal(gdal_sieved, expected), 
+                        str(gdal_sieved))
+
+        self.clean_files()
+
+    def test_sieve_streaming_tall_region_json(self):
+        # The first column is taller than the window, and still open when
+        # its first lines are written; it is kept.  The single pixel in
+        # the middle is sieved.
+        source_map = [[1, 2, 2, 2],
+                      [1, 2, 2, 2],
+                      [1, 2, 2, 2],
+                      [1, 2, 1, 2],
+                      [1, 2, 2, 2],
+                      [1, 2, 2, 2]]
+
+        streaming, gdal_sieved = self.sieve_both_ways(source_map, 4, 2)
+
+        expected = numpy.where(numpy.array(source_map) == 1, 101, 102)
+        expected[3][2] = 102
+        self.assertTrue(numpy.array_equal(streaming, expected), 
+                        str(streaming))
+        self.assertTrue(numpy.array_equal(gdal_sieved, expected), 
+                        str(gdal_sieved))
+
+        self.clean_files()
+
+    def test_sieve_streaming_compact_json(self):
+        # Stripes two pixels wide over enough lines that the labels are
+        # compacted, with single pixels sieved before and after that.
+        source_map = numpy.zeros((40, 16), dtype=numpy.int32)
+        for col in range(16):
+            source_map[:, col] = 1 + (col // 2) % 2
+        source_map[5][0] = 2
+        source_map[33][0] = 2
+
+        streaming, gdal_sieved = self.sieve_both_ways(source_map, 4, 2)
+
+        expected = numpy.where(source_map == 1, 101, 102)
+        expected[5][0] = 101
+        expected[33][0] = 101
+        self.assertTrue(numpy.array_equal(streaming, expected), 
+                        str(streaming))
+        self.assertTrue(numpy.array_equal(gdal_sieved, expected), 
+                        str(gdal_sieved))
+
+        self.clean_files()
+
+    def test_render_products_json(self):
+        json_file = 'render_products.json'
+        st_out = 'st_test_render_products.tif'
+        test_file = self.make_file(TEMPLATE_GRAY)
+        visual_file = self.make_file(TEMPLATE_GRAY)
+
+        # The visual product is gathered from each input's visual_file
+        # using the sources picked on the main inputs.
+        inputs = self.make_darkest_inputs()
+        inputs[0]['visual_file'] = self.make_file(TEMPLATE_GRAY, 
+                                                  [[110, 160], [110, 160]])
+        inputs[1]['visual_file'] = self.make_file(TEMPLATE_GRAY, 
+                                                  [[150, 120], [150, 120]])
+
+        control = {
+            'output_file': test_file,
+            'source_trace': st_out,
+            'compositors': [ { 'class': 'darkest' } ],
+            'products': [
+                {
+                    'output_file': visual_file,
+                    'input_key': 'visual_file',
+                    },
+                ],
+            'inputs': inputs,
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, DARKEST_RESULT)
+        self.compare_file(visual_file, [[110, 120], [110, 120]])
+
+        # Render again from the source trace alone.
+        render_file = self.make_file(TEMPLATE_GRAY)
+        render_visual_file = self.make_file(TEMPLATE_GRAY)
+
+        del control['source_trace']
+        control['output_file'] = render_file
+        control['render_from_source_trace'] = st_out
+        control['products'][0]['output_file'] = render_visual_file
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(render_file, DARKEST_RESULT)
+        self.compare_file(render_visual_file, [[110, 120], [110, 120]])
+
+        os.unlink(st_out)
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_update_json(self):
+        json_file = 'update.json'
+        st_out = 'st_test_update.tif'
+        q_out = 'q_test_update.tif'
+        test_file = self.make_file(TEMPLATE_GRAY)
+        inputs = self.make_darkest_inputs()
+
+        control = {
+            'output_file': test_file,
+            'source_trace': st_out,
+            'quality_output': q_out,
+            'compositors': [ { 'class': 'darkest' } ],
+            'inputs': inputs[:1],
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, DARKEST_INPUTS[0])
+
+        # Add a new scene that is darker on the right.
+        control['update'] = True
+        control['inputs'] = inputs[1:]
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, DARKEST_RESULT)
+        self.compare_file(st_out, [[1, 2], [1, 2]])
+
+        st_ds = gdal.Open(st_out)
+        self.assertEqual(st_ds.GetMetadataItem('SOURCE_2'),
+                         control['inputs'][0]['filename'])
+        st_ds = None
+
+        os.unlink(st_out)
+        os.unlink(q_out)
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_remove_inputs_json(self):
+        json_file = 'remove.json'
+        st_out = 'st_test_remove.tif'
+        cs_out = 'cs_test_remove.tif'
+        test_file = self.make_file(TEMPLATE_GRAY)
+
+        control = {
+            'output_file': test_file,
+            'source_trace': st_out,
+            'candidate_store': cs_out,
+            'candidate_count': 2,
+            'compositors': [ { 'class': 'darkest' } ],
+            'inputs': self.make_darkest_inputs() + [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[30, 40], [30, 40]]),
+                    },
+                ],
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, DARKEST_RESULT)
+        self.compare_file(st_out, [[1, 2], [1, 2]])
+
+        # Withdraw the first input, the runner-up takes its pixels.
+        control['remove_inputs'] = [ 1 ]
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, [[30, 20], [30, 20]])
+        self.compare_file(st_out, [[3, 2], [3, 2]])
+
+        os.unlink(st_out)
+        os.unlink(cs_out)
+        os.unlink(cs_out + '.quality.tif')
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_quality_cache_json(self):
+        json_file = 'quality_cache.json'
+        cache_dir = 'quality_cache_test'
+        test_file = self.make_file(TEMPLATE_GRAY)
+
+        control = {
+            'output_file': test_file,
+            'quality_cache_dir': cache_dir,
+            'compositors': [ { 'class': 'darkest' } ],
+            'inputs': self.make_darkest_inputs(),
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, DARKEST_RESULT)
+        cache_files = sorted(os.listdir(cache_dir))
+        self.assertEqual(len(cache_files), 2)
+
+        # A second run uses the cached qualities, and gets the same result.
+        ds = gdal.Open(test_file, gdal.GA_Update)
+        ds.GetRasterBand(1).Fill(0)
+        ds = None
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, DARKEST_RESULT)
+        self.assertEqual(sorted(os.listdir(cache_dir)), cache_files)
+
+        # Zero the cached qualities of the first input, the next run
+        # reads them instead of recomputing, and picks the second input.
+        first_name = os.path.splitext(
+            os.path.basename(control['inputs'][0]['filename']))[0]
+        first_cache = [f for f in cache_files 
+                       if f.startswith(first_name + '_')]
+        self.assertEqual(len(first_cache), 1)
+        ds = gdal.Open(os.path.join(cache_dir, first_cache[0]), 
+                       gdal.GA_Update)
+        ds.GetRasterBand(1).Fill(0)
+        ds = None
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, DARKEST_INPUTS[1])
+
+        shutil.rmtree(cache_dir)
         os.unlink(json_file)
         self.clean_files()
         
-    def test_same_source_json(self):
-        json_file = 'same_source.json'
-        test_file = self.make_file(TEMPLATE_GRAY_3X3)
-        quality_out = 'qfj_test_same_source.tif'
+    def test_block_cache_json(self):
+        json_file = 'block_cache.json'
+        cache_dir = 'block_cache_test'
+        test_file = self.make_file(TEMPLATE_GRAY)
+
+        control = {
+            'output_file': test_file,
+            'block_cache_dir': cache_dir,
+            'compositors': [ { 'class': 'darkest' } ],
+            'inputs': self.make_darkest_inputs(),
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, DARKEST_RESULT)
+        self.assertNotEqual(len(os.listdir(cache_dir)), 0)
+
+        # Rewrite the first input in place, keeping its size and
+        # modification time, so it still matches its cached blocks.  The
+        # second run reads those, and gets the original result.
+        in_1 = control['inputs'][0]['filename']
+        in_1_stat = os.stat(in_1)
+        ds = gdal.Open(in_1, gdal.GA_Update)
+        ds.GetRasterBand(1).Fill(90)
+        ds = None
+        os.utime(in_1, (in_1_stat.st_atime, in_1_stat.st_mtime))
+        self.assertEqual(os.stat(in_1).st_size, in_1_stat.st_size)
+
+        ds = gdal.Open(test_file, gdal.GA_Update)
+        ds.GetRasterBand(1).Fill(0)
+        ds = None
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, DARKEST_RESULT)
+
+        # Without the cache the rewritten input is read.
+        shutil.rmtree(cache_dir)
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, DARKEST_INPUTS[1])
+
+        shutil.rmtree(cache_dir)
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_resume_json(self):
+        json_file = 'resume.json'
+        checkpoint = 'resume_test.ckpt'
+        golden_file = self.make_file(TEMPLATE_GRAY_3X3)
+        test_file = self.make_file(TEMPLATE_GRAY_3X3, numpy.zeros((3, 3)))
+
+        control = {
+            'output_file': golden_file,
+            'compositors': [ { 'class': 'darkest' } ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY_3X3, 
+                                               [[10, 60, 10],
+                                                [10, 60, 10],
+                                                [10, 60, 10]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY_3X3, 
+                                               [[50, 20, 50],
+                                                [50, 20, 50],
+                                                [50, 20, 50]]),
+                    },
+                ],
+            }
+
+        # An uninterrupted run to compare with.
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+
+        # Stop after the checkpoint following the first line.
+        control['output_file'] = test_file
+        control['checkpoint_file'] = checkpoint
+        control['checkpoint_interval'] = 1
+        control['resume'] = True
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor(['--config', 'COMPOSITOR_CHECKPOINT_STOP', '1',
+                             '-q', '-j', json_file], fail_ok=True)
+
+        self.assertTrue(os.path.exists(checkpoint))
+        self.assertFalse(os.path.exists(checkpoint + '.tmp'))
+        self.compare_file(test_file, [[10, 20, 10],
+                                      [0, 0, 0],
+                                      [0, 0, 0]])
+
+        # Resume from the checkpoint written, and finish.
+        self.run_compositor(['-q', '-j', json_file])
+
+        self.compare_file(test_file, gdal_array.LoadFile(golden_file))
+        self.assertFalse(os.path.exists(checkpoint))
+
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_pipelines_json(self):
+        json_file = 'pipelines.json'
+        test_file = self.make_file(TEMPLATE_GRAY)
+        pipeline_file = self.make_file(TEMPLATE_GRAY)
 
         control = {
             'output_file': test_file,
-            'quality_output': quality_out,
             'compositors': [
                 {
-                    'class': 'qualityfromfile',
-                    'file_key': 'quality',
-                    'scale_min': 0.0,
-                    'scale_max': 1.0,
+                    'class': 'darkest',
+                    },
+                ],
+            'pipelines': [
+                {
+                    'output_file': pipeline_file,
+                    'compositors': [
+                        {
+                            'class': 'darkest',
+                            },
+                        {
+                            'class': 'percentile',
+                            'quality_percentile': 60.0,
+                            },
+                        ],
+                    },
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, [[9, 3], [1, 1]]),
                     },
                 {
-                    'class': 'samesource',
-                    'mismatch_penalty': 0.3,
+                    'filename': self.make_file(TEMPLATE_GRAY, [[5, 1], [9, 9]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, [[1, 2], [9, 1]]),
+                    },
+                ],
+            }
+
+        open(json_file, 'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+        self.compare_file(test_file, [[1, 1], [1, 1]])
+        self.compare_file(pipeline_file, [[5, 2], [9, 1]])
+
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_resume_pipelines_json(self):
+        json_file = 'resume_pipelines.json'
+        checkpoint = 'resume_pipelines_test.ckpt'
+        test_file = self.make_file(TEMPLATE_GRAY_3X3, numpy.zeros((3, 3)))
+        pipeline_file = self.make_file(TEMPLATE_GRAY_3X3, numpy.zeros((3, 3)))
+        quality_file = {
+            'class': 'qualityfromfile',
+            'file_key': 'quality',
+            }
+
+        # The pipeline's second line depends on the source of its first,
+        # which has to come from the checkpoint.
+        control = {
+            'output_file': test_file,
+            'checkpoint_file': checkpoint,
+            'checkpoint_interval': 1,
+            'resume': True,
+            'compositors': [ quality_file ],
+            'pipelines': [
+                {
+                    'output_file': pipeline_file,
+                    'compositors': [
+                        quality_file,
+                        {
+                            'class': 'samesource',
+                            'mismatch_penalty': 0.3,
+                            },
+                        ],
                     },
                 ],
             'inputs': [
                 {
                     'filename': self.make_file(TEMPLATE_GRAY_3X3, 
-                                               [[101, 101, 101],
-                                                [101, 101, 101],
-                                                [101, 101, 101]]),
+                                               numpy.full((3, 3), 101)),
                     'quality': self.make_file(TEMPLATE_FLOAT_3X3, 
                                               [[1.0, 1.0, 1.0],
                                                [0.9, 0.9, 0.9],
@@ -478,9 +1663,7 @@ class Tests(unittest.TestCase):
                     },
                 {
                     'filename': self.make_file(TEMPLATE_GRAY_3X3, 
-                                               [[102, 102, 102],
-                                                [102, 102, 102],
-                                                [102, 102, 102]]),
+                                               numpy.full((3, 3), 102)),
                     'quality': self.make_file(TEMPLATE_FLOAT_3X3, 
                                               [[0.9, 0.9, 0.9],
                                                [1.0, 1.0, 1.0],
@@ -489,77 +1672,142 @@ class Tests(unittest.TestCase):
                 ],
             }
 
-        open(json_file,'w').write(json.dumps(control))
+        open(json_file, 'w').write(json.dumps(control))
+        self.run_compositor(['--config', 'COMPOSITOR_CHECKPOINT_STOP', '1',
+                             '-q', '-j', json_file], fail_ok=True)
+
+        self.assertTrue(os.path.exists(checkpoint))
+        self.compare_file(pipeline_file, [[101, 101, 101],
+                                          [0, 0, 0],
+                                          [0, 0, 0]])
+
         self.run_compositor(['-q', '-j', json_file])
 
         self.compare_file(test_file, [[101, 101, 101],
-                                      [101, 101, 101],
+                                      [102, 102, 102],
                                       [102, 102, 102]])
-        self.compare_file(quality_out, 
-                          [[[1.0, 1.0, 1.0],
-                            [0.9, 0.9, 0.9],
-                            [0.8, 0.7, 0.8]],
-                           [[1.0, 1.0, 1.0],
-                            [0.9, 0.9, 0.9],
-                            [0.4, 0.4, 0.4]],
-                           [[0.9, 0.9, 0.9],
-                            [0.8, 0.7, 0.8],
-                            [0.8, 0.7, 0.8]]],
-                          tolerance=0.001)
+        self.compare_file(pipeline_file, [[101, 101, 101],
+                                          [101, 101, 101],
+                                          [102, 102, 102]])
+        self.assertFalse(os.path.exists(checkpoint))
 
-        os.unlink(quality_out)
         os.unlink(json_file)
         self.clean_files()
         
-    def test_sieve_json(self):
-        json_file = 'sieve.json'
-        test_file = self.make_file(TEMPLATE_GRAY_3X3)
-        st_out = 'st_test_same_source.tif'
+    def test_bins_json(self):
+        json_file = 'bins.json'
+        test_file = self.make_file(TEMPLATE_GRAY)
+        january_file = self.make_file(TEMPLATE_GRAY)
+        february_file = self.make_file(TEMPLATE_GRAY)
+        january_inputs = self.make_darkest_inputs()
+        for january_input in january_inputs:
+            january_input['month'] = 1
 
         control = {
             'output_file': test_file,
-            'source_sieve_threshold': 2,
-            'source_trace': st_out,
+            'bin_key': 'month',
+            'bins': [
+                {
+                    'bin': '1',
+                    'output_file': january_file,
+                    },
+                {
+                    'bin': '2',
+                    'output_file': february_file,
+                    },
+                ],
             'compositors': [
                 {
-                    'class': 'qualityfromfile',
-                    'file_key': 'quality',
-                    'scale_min': 0.0,
-                    'scale_max': 1.0,
-                    }
+                    'class': 'darkest',
+                    },
                 ],
-            'inputs': [
+            'inputs': january_inputs + [
                 {
-                    'filename': self.make_file(TEMPLATE_GRAY_3X3, 
-                                               [[101, 101, 101],
-                                                [101, 101, 101],
-                                                [101, 101, 101]]),
-                    'quality': self.make_file(TEMPLATE_FLOAT_3X3, 
-                                              [[1.0, 0.0, 1.0],
-                                               [0.0, 0.0, 0.0],
-                                               [1.0, 1.0, 1.0]]),
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[30, 40], [5, 90]]),
+                    'month': '2',
                     },
+                ],
+            }
+
+        open(json_file, 'w').write(json.dumps(control))
+        self.run_compositor(['-q', '-j', json_file])
+        self.compare_file(test_file, [[10, 20], [5, 20]])
+        self.compare_file(january_file, DARKEST_RESULT)
+        self.compare_file(february_file, [[30, 40], [5, 90]])
+
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_statistics_json(self):
+        json_file = 'statistics.json'
+        stats_file = 'statistics_test.tif'
+        test_file = self.make_file(TEMPLATE_GRAY)
+
+        # With scale_max 100 the third input has no quality on the left,
+        # so is left out of the statistics there.  It never wins.
+        control = {
+            'output_file': test_file,
+            'statistics_output': stats_file,
+            'compositors': [ { 'class': 'darkest', 'scale_max': 100.0 } ],
+            'inputs': self.make_darkest_inputs() + [
                 {
-                    'filename': self.make_file(TEMPLATE_GRAY_3X3, 
-                                               [[102, 102, 102],
-                                                [102, 102, 102],
-                                                [102, 102, 102]]),
-                    'quality': self.make_file(TEMPLATE_FLOAT_3X3, 
-                                              [[0.5, 0.5, 0.5],
-                                               [0.5, 0.5, 0.5],
-                                               [0.5, 0.5, 0.5]]),
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[120, 40], [120, 40]]),
                     },
                 ],
             }
 
         open(json_file,'w').write(json.dumps(control))
         self.run_compositor(['-q', '-j', json_file])
+        self.compare_file(test_file, DARKEST_RESULT)
+
+        # Weighted by the darkest quality, (100 - value) / 100.
+        def weighted(values):
+            weights = [(100 - v) / 100.0 for v in values]
+            total = sum(weights)
+            mean = sum([w * v for (w, v) in zip(weights, values)]) / total
+            var = sum([w * (v - mean) ** 2 
+                       for (w, v) in zip(weights, values)]) / total
+            return mean, var ** 0.5
+
+        left = weighted([10, 50])
+        right = weighted([60, 20, 40])
+
+        self.compare_file(stats_file, 
+                          [[[left[0], right[0]], [left[0], right[0]]],
+                           [[left[1], right[1]], [left[1], right[1]]],
+                           [[10, 20], [10, 20]],
+                           [[50, 60], [50, 60]],
+                           [[2, 3], [2, 3]]],
+                          tolerance=0.001)
 
-        self.compare_file(test_file, [[102, 102, 102],
-                                      [102, 102, 102],
-                                      [101, 101, 101]])
+        os.unlink(stats_file)
+        os.unlink(json_file)
+        self.clean_files()
+        
+    def test_statistics_prepass_json(self):
+        # The pre-pass drops inputs from the stack, so it is refused.
+        json_file = 'statistics_prepass.json'
+        stats_file = 'statistics_prepass_test.tif'
+        test_file = self.make_file(TEMPLATE_GRAY)
+
+        control = {
+            'output_file': test_file,
+            'statistics_output': stats_file,
+            'prepass_decimation': 2,
+            'compositors': [ { 'class': 'darkest' } ],
+            'inputs': self.make_darkest_inputs(),
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        (rc, out, err) = self.run_compositor(['-q', '-j', json_file],
+                                             fail_ok = True)
+
+        self.assertNotEqual(0, rc)
+        self.assertIn("statistics_output can't be combined", err)
+        self.assertFalse(os.path.exists(stats_file))
 
-        os.unlink(st_out)
         os.unlink(json_file)
         self.clean_files()
         
@@ -634,6 +1882,47 @@ class Tests(unittest.TestCase):
 
         os.unlink(json_file)
         self.clean_files()
+
+    def test_darkest_quality_weighted_averaging_json(self):
+        json_file = 'darkest_quality_weighted_averaging.json'
+        test_file = self.make_file(TEMPLATE_FLOAT)
+        control = {
+            'output_file': test_file,
+            'average_best_ratio': 0.75,
+            'average_best_weighting': 'quality',
+            'compositors': [
+                {
+                    'class': 'darkest',
+                    'scale_min': 0.0,
+                    'scale_max': 255.0,
+                    },
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[10, 255], [6, 5]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[20, 255], [2, 3]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_GRAY, 
+                                               [[30, 12], [2, 3]]),
+                    },
+                ],
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor([ '-q', '-j', json_file])
+
+        # 10 and 20 weighted by their qualities, 245/255 and 235/255.
+        self.compare_file(test_file, 
+                          [[(10 * 245 + 20 * 235) / 480.0, 12], [2, 3]],
+                          tolerance=0.001)
+
+        os.unlink(json_file)
+        self.clean_files()
         
     def test_darkest_alt_rgb_ratio_json(self):
         json_file = 'small_darkest_alt_rgb_ratio.json'
@@ -679,5 +1968,46 @@ class Tests(unittest.TestCase):
         os.unlink(json_file)
         self.clean_files()
         
+    def test_darkest_zero_weight_json(self):
+        json_file = 'small_darkest_zero_weight.json'
+        test_file = self.make_file(TEMPLATE_RGB)
+
+        # Band 2 is not used for quality, and only read where selected.
+        control = {
+            'output_file': test_file,
+            'compositors': [
+                {
+                    'class': 'darkest',
+                    'band_2_weight': 0.0,
+                    },
+                ],
+            'inputs': [
+                {
+                    'filename': self.make_file(TEMPLATE_RGB, 
+                                               [DARKEST_INPUTS[0],
+                                                [[200, 0], [200, 0]],
+                                                DARKEST_INPUTS[0]]),
+                    },
+                {
+                    'filename': self.make_file(TEMPLATE_RGB, 
+                                               [DARKEST_INPUTS[1],
+                                                [[0, 200], [0, 200]],
+                                                DARKEST_INPUTS[1]]),
+                    },
+                ]
+            }
+
+        open(json_file,'w').write(json.dumps(control))
+        self.run_compositor([ '-q', '-j', json_file])
+
+        self.compare_file(
+                test_file, [
+                    DARKEST_RESULT,
+                    [[200, 200], [200, 200]],
+                    DARKEST_RESULT,
+                    ])
+        os.unlink(json_file)
+        self.clean_files()
+        
 if __name__ == '__main__':
     unittest.main()